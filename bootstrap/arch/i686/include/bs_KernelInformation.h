@@ -37,8 +37,16 @@ typedef uint8_t KItemNature;
 //Reserved entries of kernel memory map.
 #define MAX_KMMAP_LENGTH 512
 
+//Limits of the NUMA topology description
+#define MAX_NUMA_NODES 8
+#define MAX_NUMA_RANGES 64
+#define MAX_NUMA_CPUS 256
+
 typedef struct KernelCPUInfo KernelCPUInfo;
 typedef struct KernelMMapItem KernelMMapItem;
+typedef struct KernelNumaCPU KernelNumaCPU;
+typedef struct KernelNumaInfo KernelNumaInfo;
+typedef struct KernelNumaRange KernelNumaRange;
 typedef struct KernelInformation KernelInformation;
 
 struct KernelCPUInfo {
@@ -55,11 +63,35 @@ struct KernelMMapItem {
                      //Kernel and modules are called by their GRUB modules names
 } __attribute__ ((packed));
 
+//NUMA topology, as described by the ACPI SRAT and SLIT. When they are not available, node_amount
+//is zero and memory access is considered to be uniform.
+struct KernelNumaRange {
+    knl_size_t location;
+    knl_size_t size;
+    uint32_t node;
+} __attribute__ ((packed));
+
+struct KernelNumaCPU {
+    uint32_t apic_id;
+    uint32_t node;
+} __attribute__ ((packed));
+
+struct KernelNumaInfo {
+    uint32_t node_amount; //Number of NUMA nodes, at most MAX_NUMA_NODES
+    knl_size_t range_amount; //Number of entries in the table of memory ranges
+    knl_size_t ranges; //KernelNumaRange* to the node of each range of memory
+    knl_size_t cpu_amount; //Number of entries in the table of CPUs
+    knl_size_t cpus; //KernelNumaCPU* to the node of each CPU
+    knl_size_t distances; //uint8_t* to the node_amount*node_amount matrix of relative distances
+                          //between nodes (10 meaning local), or 0 if unknown
+} __attribute__ ((packed));
+
 struct KernelInformation {
     knl_size_t command_line; //char* to the kernel command line
     knl_size_t kmmap_length; //Number of entries in kernel memory map
     knl_size_t kmmap; //KernelMMapItem* to the kernel memory map
     KernelCPUInfo cpu_info; //Information about the processor we run on
+    KernelNumaInfo numa_info; //NUMA topology of the system
     ArchSpecificKInfo arch_info; //Other arch-specific information
 } __attribute__ ((packed));
 
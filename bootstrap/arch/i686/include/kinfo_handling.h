@@ -52,6 +52,8 @@ KernelCPUInfo* generate_cpu_info(KernelInformation* kinfo);
 KernelMMapItem* generate_memory_map(const multiboot_info_t* mbd, KernelInformation* kinfo);
 //Generate info related to multiprocessing.
 KernelCPUInfo* generate_multiprocessing_info(KernelInformation* kinfo);
+//Generate info about the NUMA topology of the system, using ACPI tables
+KernelNumaInfo* generate_numa_info(KernelInformation* kinfo);
 
 
 //Generate a kernel information structure (see KernelInformation.h)
@@ -0,0 +1,90 @@
+ /* The bits of the ACPI specification which are needed to find out the NUMA topology of the
+    system (static resource affinity table and system locality information table)
+
+        Copyright (C) 2013    Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA    02110-1301    USA */
+
+#ifndef _X86ACPI_H_
+#define _X86ACPI_H_
+
+#include <stdint.h>
+
+typedef struct acpi_rsdp acpi_rsdp;
+typedef struct acpi_sdt_hdr acpi_sdt_hdr;
+typedef struct srat_cpu_entry srat_cpu_entry;
+typedef struct srat_mem_entry srat_mem_entry;
+
+struct acpi_rsdp {
+    char signature[8]; //Must contain "RSD PTR "
+    uint8_t checksum; //All bytes of this structure must add up to zero
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address; //Physical address of the root system description table
+} __attribute__((packed));
+
+struct acpi_sdt_hdr {
+    char signature[4];
+    uint32_t length; //Length of the table in bytes, including header
+    uint8_t revision;
+    uint8_t checksum; //All bytes of the table (including header) must add up to zero
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+//The SRAT begins with a header, followed by 12 reserved bytes and a list of entries of variable
+//length. Entry types are processor local APIC affinity (0) and memory affinity (1).
+#define SRAT_ENTRIES_OFFSET (sizeof(acpi_sdt_hdr)+12)
+#define SRAT_CPU_ENTRY 0
+#define SRAT_MEM_ENTRY 1
+
+struct srat_cpu_entry {
+    uint8_t entry_type; //Must be SRAT_CPU_ENTRY
+    uint8_t length;
+    uint8_t proximity_low; //Bits 0-7 of the proximity domain (NUMA node) of the processor
+    uint8_t apic_id;
+    uint32_t flags; //First bit tells if the entry is enabled
+    uint8_t sapic_eid;
+    uint8_t proximity_high[3]; //Bits 8-31 of the proximity domain
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_mem_entry {
+    uint8_t entry_type; //Must be SRAT_MEM_ENTRY
+    uint8_t length;
+    uint32_t proximity; //Proximity domain (NUMA node) of the memory range
+    uint16_t reserved1;
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t reserved2;
+    uint32_t flags; //First bit tells if the entry is enabled
+    uint64_t reserved3;
+} __attribute__((packed));
+
+//The SLIT begins with a header and the amount of localities N, followed by a NxN matrix of
+//relative distances between localities (10 meaning "local")
+#define SLIT_MATRIX_OFFSET (sizeof(acpi_sdt_hdr)+8)
+
+acpi_rsdp* find_rsdp(); //Finds the root system description pointer, if it exists, otherwise returns 0
+uint8_t rsdp_check(const uint32_t location); //Check if there's a valid RSDP at this location
+acpi_sdt_hdr* find_sdt(const acpi_rsdp* rsdp, const char* signature); //Find a valid ACPI table, or return 0
+uint8_t sdt_check(const acpi_sdt_hdr* table, const char* signature); //Check an ACPI table's signature and checksum
+
+#endif
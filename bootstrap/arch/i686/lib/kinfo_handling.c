@@ -21,6 +21,7 @@
 #include <bs_string.h>
 #include <die.h>
 #include <kinfo_handling.h>
+#include <x86acpi.h>
 #include <x86asm.h>
 #include <x86multiproc.h>
 
@@ -346,6 +347,74 @@ KernelCPUInfo* generate_multiprocessing_info(KernelInformation* kinfo) {
     return &(kinfo->cpu_info);
 }
 
+KernelNumaInfo* generate_numa_info(KernelInformation* kinfo) {
+    //Some buffers
+    static KernelNumaRange range_buff[MAX_NUMA_RANGES];
+    static KernelNumaCPU cpu_buff[MAX_NUMA_CPUS];
+    static uint8_t distance_buff[MAX_NUMA_NODES*MAX_NUMA_NODES];
+    KernelNumaInfo* numa_info = &(kinfo->numa_info);
+    acpi_rsdp* rsdp;
+    acpi_sdt_hdr *srat, *slit;
+    uint32_t offset, node, node_amount = 0, i, j;
+
+    //Let's say we've nothing available in the beginning
+    numa_info->node_amount = 0;
+    numa_info->range_amount = 0;
+    numa_info->ranges = TO_KNL_PTR(range_buff);
+    numa_info->cpu_amount = 0;
+    numa_info->cpus = TO_KNL_PTR(cpu_buff);
+    numa_info->distances = 0;
+
+    //Without a static resource affinity table, there's no NUMA topology information
+    rsdp = find_rsdp();
+    if(!rsdp) return numa_info;
+    srat = find_sdt(rsdp, "SRAT");
+    if(!srat) return numa_info;
+
+    //Parse the SRAT, looking for CPUs and memory ranges. Nodes which we cannot handle are ignored.
+    for(offset = SRAT_ENTRIES_OFFSET; offset+2 <= srat->length; offset+= ((uint8_t*) srat)[offset+1]) {
+        uint8_t* entry = ((uint8_t*) srat) + offset;
+        if(!entry[1]) break; //Invalid entry length
+        if(entry[0] == SRAT_CPU_ENTRY) {
+            srat_cpu_entry* cpu_entry = (srat_cpu_entry*) entry;
+            if(!(cpu_entry->flags & 1)) continue;
+            node = cpu_entry->proximity_low + (cpu_entry->proximity_high[0] << 8)
+                 + (cpu_entry->proximity_high[1] << 16) + (cpu_entry->proximity_high[2] << 24);
+            if((node >= MAX_NUMA_NODES) || (numa_info->cpu_amount == MAX_NUMA_CPUS)) continue;
+            cpu_buff[numa_info->cpu_amount].apic_id = cpu_entry->apic_id;
+            cpu_buff[numa_info->cpu_amount].node = node;
+            ++(numa_info->cpu_amount);
+        }
+        if(entry[0] == SRAT_MEM_ENTRY) {
+            srat_mem_entry* mem_entry = (srat_mem_entry*) entry;
+            if(!(mem_entry->flags & 1)) continue;
+            node = mem_entry->proximity;
+            if((node >= MAX_NUMA_NODES) || (numa_info->range_amount == MAX_NUMA_RANGES)) continue;
+            range_buff[numa_info->range_amount].location = mem_entry->base_low + (((knl_size_t) mem_entry->base_high) << 32);
+            range_buff[numa_info->range_amount].size = mem_entry->length_low + (((knl_size_t) mem_entry->length_high) << 32);
+            range_buff[numa_info->range_amount].node = node;
+            ++(numa_info->range_amount);
+            if(node >= node_amount) node_amount = node+1;
+        }
+    }
+    numa_info->node_amount = node_amount;
+
+    //If there's a system locality information table, get relative distances between nodes
+    slit = find_sdt(rsdp, "SLIT");
+    if(slit) {
+        uint32_t locality_amount = *((uint32_t*) (((uint8_t*) slit) + sizeof(acpi_sdt_hdr)));
+        uint8_t* matrix = ((uint8_t*) slit) + SLIT_MATRIX_OFFSET;
+        if((locality_amount >= node_amount) && (SLIT_MATRIX_OFFSET+locality_amount*locality_amount <= slit->length)) {
+            for(i=0; i<node_amount; ++i) {
+                for(j=0; j<node_amount; ++j) distance_buff[i*node_amount+j] = matrix[i*locality_amount+j];
+            }
+            numa_info->distances = TO_KNL_PTR(distance_buff);
+        }
+    }
+
+    return numa_info;
+}
+
 KernelInformation* kinfo_gen(const multiboot_info_t* mbd) {
     //Some buffers
     static KernelInformation result;
@@ -373,6 +442,8 @@ KernelInformation* kinfo_gen(const multiboot_info_t* mbd) {
     add_modules(&result, mbd);
     //Gather CPU information
     generate_cpu_info(&result);
+    //Find out the NUMA topology of the system
+    generate_numa_info(&result);
 
     return &result;
 }
@@ -0,0 +1,112 @@
+ /* The bits of the ACPI specification which are needed to find out the NUMA topology of the
+    system (static resource affinity table and system locality information table)
+
+        Copyright (C) 2013    Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.    See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA    02110-1301    USA */
+
+#include <x86acpi.h>
+
+acpi_rsdp* find_rsdp() {
+    //According to the ACPI specification, the RSDP is located on a 16-byte boundary in one of
+    //the following places (in that order) :
+    //    1/First kb of the Extended BIOS Data Area (EBDA)
+    //    2/Bios rom address space (0xe0000 -> 0xfffff)
+
+    //EBDA base address is located in the BIOS Data Area (BDA). One has to use (the word at location
+    //0x40e) << 4.
+    uint16_t* ebda_base_ptr = (uint16_t*) 0x40e;
+    uint32_t location = *ebda_base_ptr << 4;
+    uint32_t limit;
+
+    if((location>=0x80000) && (location<0xa0000)) {
+        limit = location + 0x400 - sizeof(acpi_rsdp);
+        for(; location<=limit; location+=16) {
+            if(rsdp_check(location)) return (acpi_rsdp*) location;
+        }
+    }
+
+    limit = 0x100000 - sizeof(acpi_rsdp);
+    for(location = 0xe0000; location<=limit; location+=16) {
+        if(rsdp_check(location)) return (acpi_rsdp*) location;
+    }
+
+    return 0;
+}
+
+uint8_t rsdp_check(const uint32_t location) {
+    const char* signature = "RSD PTR ";
+    acpi_rsdp* rsdp = (acpi_rsdp*) location;
+    uint32_t remaining_size = sizeof(acpi_rsdp);
+    uint8_t checksum_check = 0;
+    uint8_t* byte_ptr = (uint8_t*) rsdp;
+    int i;
+
+    //Check RSDP signature
+    for(i=0; i<8; ++i) {
+        if(rsdp->signature[i]!=signature[i]) return 0;
+    }
+    //Check the checksum of the ACPI 1.0 part of the structure
+    while(remaining_size) {
+        checksum_check += *byte_ptr;
+        ++byte_ptr;
+        --remaining_size;
+    }
+    if(checksum_check) return 0;
+    //All good !
+    return 1;
+}
+
+acpi_sdt_hdr* find_sdt(const acpi_rsdp* rsdp, const char* signature) {
+    acpi_sdt_hdr* rsdt = (acpi_sdt_hdr*) rsdp->rsdt_address;
+    uint32_t* table_ptr;
+    uint32_t table_amount, i;
+
+    //Check the root system description table, then look for the requested table in it
+    if(!sdt_check(rsdt, "RSDT")) return 0;
+    table_ptr = (uint32_t*) (rsdt+1);
+    table_amount = (rsdt->length - sizeof(acpi_sdt_hdr))/sizeof(uint32_t);
+    for(i=0; i<table_amount; ++i) {
+        acpi_sdt_hdr* table = (acpi_sdt_hdr*) table_ptr[i];
+        if(sdt_check(table, signature)) return table;
+    }
+
+    return 0;
+}
+
+uint8_t sdt_check(const acpi_sdt_hdr* table, const char* signature) {
+    uint32_t remaining_size;
+    uint8_t checksum_check = 0;
+    uint8_t* byte_ptr = (uint8_t*) table;
+    int i;
+
+    //Check that table is present
+    if(!table) return 0;
+    //Check table signature
+    for(i=0; i<4; ++i) {
+        if(table->signature[i]!=signature[i]) return 0;
+    }
+    //Check the checksum of the table
+    if(table->length < sizeof(acpi_sdt_hdr)) return 0; //Size check
+    remaining_size = table->length;
+    while(remaining_size) {
+        checksum_check += *byte_ptr;
+        ++byte_ptr;
+        --remaining_size;
+    }
+    if(checksum_check) return 0;
+    //All good !
+    return 1;
+}
@@ -68,5 +68,11 @@ extern "C" int kmain(const KernelInformation& kinfo) {
 
     dbgout << txtcolor(TXT_WHITE) << "* Ready to roll out !" << txtcolor(TXT_DEFAULT);
 
+    //There is nothing left to do, so the CPU is idle : finish giving memory to the RAM manager,
+    //compact fragmented memory, then zero some free pages in advance
+    while(ram_manager.init_deferred_memory());
+    for(int runs = 0; (runs < RAM_COMPACT_RUNS) && ram_manager.compact_memory(); ++runs);
+    while(ram_manager.zero_free_pages());
+
     return 0;
 }
@@ -35,7 +35,7 @@ bool MemAllocator::alloc_mapitems() {
     if(!allocated_chunk) return false;
 
     //Fill it with initialized map items
-    free_mapitems = (MemoryChunk*) (allocated_chunk->location);
+    free_mapitems = (MemoryChunk*) ram_manager->frame_pointer(allocated_chunk->location);
     current_item = free_mapitems;
     for(size_t used_mem = sizeof(MemoryChunk); used_mem <= allocated_chunk->size; used_mem+= sizeof(MemoryChunk)) {
         current_item = new(current_item) MemoryChunk();
@@ -58,7 +58,7 @@ bool MemAllocator::alloc_process_descs() {
     if(!allocated_chunk) return false;
 
     //Fill it with initialized list items
-    free_process_descs = (MallocProcess*) (allocated_chunk->location);
+    free_process_descs = (MallocProcess*) ram_manager->frame_pointer(allocated_chunk->location);
     current_item = free_process_descs;
     for(size_t used_mem = sizeof(MallocProcess); used_mem <= allocated_chunk->size; used_mem+= sizeof(MallocProcess)) {
         current_item = new(current_item) MallocProcess();
@@ -74,12 +74,12 @@ bool MemAllocator::alloc_process_descs() {
 
 size_t MemAllocator::allocator(MallocProcess* target,
                                const size_t size,
-                               const PageFlags flags,
-                               const bool force) {
+                               const PageFlags flags) {
     //How it works :
     //  1.Look for a suitable hole in the target's free_map linked list
     //  2.If there is none, allocate a chunk through ram_manager and map it through paging_manager,
-    //    then put it in free_map. Return NULL if it fails
+    //    then put it in free_map. Large chunks are only reserved through paging_manager, and RAM
+    //    is allocated when they are accessed. Return NULL if it fails
     //  3.Take the requested space from the chunk found/created in free_map, update free_map and
     //    busy_map
 
@@ -93,18 +93,19 @@ size_t MemAllocator::allocator(MallocProcess* target,
     //Step 2 : If there's none, create it
     if(!hole) {
         //Allocating enough memory
-        ram_chunk = ram_manager->alloc_chunk(target->identifier, align_pgup(size));
-        if(!ram_chunk) {
-            if(!force) return NULL;
-            liberate_memory();
-            return allocator(target, size, flags, force);
-        }
-        page_chunk = paging_manager->map_chunk(target->identifier, ram_chunk, flags);
-        if(!page_chunk) {
-            ram_manager->free_chunk(target->identifier, ram_chunk->location);
-            if(!force) return NULL;
-            liberate_memory();
-            return allocator(target, size, flags, force);
+        if((size >= MALLOC_DEMAND_THRESHOLD) && (target->identifier != PID_KERNEL)) {
+            page_chunk = paging_manager->reserve_chunk(target->identifier, align_pgup(size), flags);
+            if(!page_chunk) return NULL;
+        } else {
+            ram_chunk = ram_manager->alloc_chunk(target->identifier, align_pgup(size));
+            if(!ram_chunk) {
+                return NULL;
+            }
+            page_chunk = paging_manager->map_chunk(target->identifier, ram_chunk, flags);
+            if(!page_chunk) {
+                ram_manager->free_chunk(target->identifier, ram_chunk->location);
+                return NULL;
+            }
         }
 
         //Putting that memory in a MemoryChunk block
@@ -112,10 +113,8 @@ size_t MemAllocator::allocator(MallocProcess* target,
             alloc_mapitems();
             if(!free_mapitems) {
                 paging_manager->free_chunk(target->identifier, page_chunk->location);
-                ram_manager->free_chunk(target->identifier, ram_chunk->location);
-                if(!force) return NULL;
-                liberate_memory();
-                return allocator(target, size, flags, force);
+                if(ram_chunk) ram_manager->free_chunk(target->identifier, ram_chunk->location);
+                return NULL;
             }
         }
         hole = free_mapitems;
@@ -146,9 +145,7 @@ size_t MemAllocator::allocator(MallocProcess* target,
         if(!free_mapitems) {
             if(page_chunk) paging_manager->free_chunk(target->identifier, page_chunk->location);
             if(ram_chunk) ram_manager->free_chunk(target->identifier, ram_chunk->location);
-            if(!force) return NULL;
-            liberate_memory();
-            return allocator(target, size, flags, force);
+            return NULL;
         }
     }
     MemoryChunk* allocated = free_mapitems;
@@ -200,23 +197,18 @@ size_t MemAllocator::allocator(MallocProcess* target,
 
 size_t MemAllocator::allocator_shareable(MallocProcess* target,
                                          size_t size,
-                                         const PageFlags flags,
-                                         const bool force) {
+                                         const PageFlags flags) {
     //Same as above, but always allocates a new chunk and does not put extra memory in free_map
 
     //Allocating memory
     RamChunk* ram_chunk = ram_manager->alloc_chunk(target->identifier, align_pgup(size));
     if(!ram_chunk) {
-        if(!force) return NULL;
-        liberate_memory();
-        return allocator_shareable(target, size, flags, force);
+        return NULL;
     }
     PageChunk* page_chunk = paging_manager->map_chunk(target->identifier, ram_chunk, flags);
     if(!page_chunk) {
         ram_manager->free_chunk(target->identifier, ram_chunk->location);
-        if(!force) return NULL;
-        liberate_memory();
-        return allocator_shareable(target, size, flags, force);
+        return NULL;
     }
 
     //Putting that memory in a MemoryChunk block
@@ -225,9 +217,7 @@ size_t MemAllocator::allocator_shareable(MallocProcess* target,
         if(!free_mapitems) {
             paging_manager->free_chunk(target->identifier, page_chunk->location);
             ram_manager->free_chunk(target->identifier, ram_chunk->location);
-            if(!force) return NULL;
-            liberate_memory();
-            return allocator_shareable(target, size, flags, force);
+            return NULL;
         }
     }
     MemoryChunk* allocated = free_mapitems;
@@ -302,9 +292,10 @@ bool MemAllocator::liberator(MallocProcess* target, const size_t location) {
     if(item_is_alone) {
         //Step 3a : Liberate the chunks and any item of free_map belonging to them.
 
-        //Liberate the RAM/page chunks associated with our item if possible.
+        //Liberate the RAM/page chunks associated with our item if possible. Chunks which are
+        //allocated on demand have no RAM chunk, their memory is freed by paging_manager.
         PageChunk* belonged_to = freed_item->belongs_to;
-        ram_manager->free_chunk(target->identifier, belonged_to->points_to->location);
+        if(belonged_to->points_to) ram_manager->free_chunk(target->identifier, belonged_to->points_to->location);
         paging_manager->free_chunk(target->identifier, belonged_to->location);
         freed_item = new(freed_item) MemoryChunk();
         freed_item->next_item = free_mapitems;
@@ -413,15 +404,15 @@ size_t MemAllocator::share(MallocProcess* source,
                            MallocProcess* target,
                            const PageFlags flags,
                            const bool force) {
-    //This function shares a memory block of source with target, giving target "flags" access flags
+    //This function shares a memory block of source with target, giving target "flags" access flags.
+    //With PAGE_FLAG_C, the block is copied on write : both processes get read-only mappings of it,
+    //and pages are only copied when one of them writes there.
 
     //Allocate management structures (we need at most two MemoryChunks)
     if(!free_mapitems || !(free_mapitems->next_item)) {
         alloc_mapitems();
         if(!free_mapitems || !(free_mapitems->next_item)) {
-            if(!force) return NULL;
-            liberate_memory();
-            return share(source, location, target, flags, force);
+            return NULL;
         }
     }
 
@@ -439,6 +430,11 @@ size_t MemAllocator::share(MallocProcess* source,
         if(force) panic(PANIC_IMPOSSIBLE_SHARING);
         return NULL;
     }
+    if((flags & PAGE_FLAG_C) && ((source->identifier == PID_KERNEL) || (target->identifier == PID_KERNEL))) {
+        //The kernel can't take page faults on its own memory, so it can't copy it on write
+        if(force) panic(PANIC_IMPOSSIBLE_SHARING);
+        return NULL;
+    }
     PID target_pid = target->identifier;
     RamChunk* ram_chunk = shared_item->belongs_to->points_to;
     //Check that the chunk is not shared with target already, if so simply increment the share_count
@@ -458,15 +454,22 @@ size_t MemAllocator::share(MallocProcess* source,
         if(shared_item != source->busy_map->find_thischunk(location)) {
             liberator(source, shared_item->location);
         }
-        if(!force) return NULL;
-        liberate_memory();
-        return share(source, location, target, flags, force);
+        return NULL;
     }
     PageChunk* shared_chunk;
-    if(flags | PAGE_FLAGS_SAME) {
-        shared_chunk = paging_manager->map_chunk(target_pid, ram_chunk, shared_item->belongs_to->flags);
-    } else {
-        shared_chunk = paging_manager->map_chunk(target_pid, ram_chunk, flags);
+    const PageFlags source_flags = shared_item->belongs_to->flags;
+    PageFlags target_flags = flags;
+    if(flags & PAGE_FLAGS_SAME) target_flags = source_flags | (flags & PAGE_FLAG_C);
+    shared_chunk = paging_manager->map_chunk(target_pid, ram_chunk, target_flags);
+    if(shared_chunk && (target_flags & PAGE_FLAG_C) && !(source_flags & PAGE_FLAG_C)) {
+        //For copy-on-write sharing, the source's mapping must become read-only too
+        if(!paging_manager->adjust_chunk_flags(source->identifier,
+                                               shared_item->belongs_to->location,
+                                               PAGE_FLAG_C,
+                                               PAGE_FLAG_C)) {
+            paging_manager->free_chunk(target_pid, shared_chunk->location);
+            shared_chunk = NULL;
+        }
     }
     if(!shared_chunk) {
         ram_manager->free_chunk(target_pid, ram_chunk->location);
@@ -474,9 +477,7 @@ size_t MemAllocator::share(MallocProcess* source,
         if(shared_item != source->busy_map->find_thischunk(location)) {
             liberator(source, shared_item->location);
         }
-        if(!force) return NULL;
-        liberate_memory();
-        return share(source, location, target, flags, force);
+        return NULL;
 
     }
 
@@ -597,9 +598,24 @@ bool MemAllocator::set_pool(MallocProcess* target, size_t pool_location) {
     return true;
 }
 
-void MemAllocator::liberate_memory() {
-    //Draft !
-    panic(PANIC_OUT_OF_MEMORY);
+void MemAllocator::liberate_memory(const size_t amount, const int attempt) {
+    size_t liberated = 0;
+
+    //Each new attempt asks for twice as much memory as the previous one
+    if(attempt >= MALLOC_MAX_RETRIES) panic(PANIC_OUT_OF_MEMORY);
+    const size_t requested = align_pgup(amount) << attempt;
+
+    //Call shrinkers by increasing priority value, until enough memory has been liberated
+    shrinkers_mutex.grab_spin();
+
+        for(int index = 0; (index < shrinker_amount) && (liberated < requested); ++index) {
+            liberated+= shrinkers[index].shrink(requested-liberated);
+        }
+
+    shrinkers_mutex.release();
+
+    //If nothing could be liberated, retrying would be pointless
+    if(!liberated) panic(PANIC_OUT_OF_MEMORY);
 }
 
 MemAllocator::MemAllocator(RamManager& ram_man, PagingManager& page_man) : ram_manager(&ram_man),
@@ -607,12 +623,26 @@ MemAllocator::MemAllocator(RamManager& ram_man, PagingManager& page_man) : ram_m
                                                                            paging_manager(&page_man),
                                                                            process_list(NULL),
                                                                            free_mapitems(NULL),
-                                                                           free_process_descs(NULL) {
+                                                                           free_process_descs(NULL),
+                                                                           shrinker_amount(0) {
     //Allocate support structures
     alloc_mapitems();
     alloc_process_descs();
     process_list = setup_pid(PID_KERNEL);
 
+    //Memory held in PagingManager's and RamManager's caches is the cheapest to get back. Pages
+    //which PagingManager gives back go to RamManager's caches, so PagingManager is asked first.
+    ShrinkerDescriptor paging_manager_shrinker;
+    paging_manager_shrinker.shrinker_name = "PagingManager";
+    paging_manager_shrinker.priority = 0;
+    paging_manager_shrinker.shrink = paging_manager_shrink;
+    add_shrinker(paging_manager_shrinker);
+    ShrinkerDescriptor ram_manager_shrinker;
+    ram_manager_shrinker.shrinker_name = "RamManager";
+    ram_manager_shrinker.priority = 0;
+    ram_manager_shrinker.shrink = ram_manager_shrink;
+    add_shrinker(ram_manager_shrinker);
+
     //Activate global memory allocation service
     mem_allocator = this;
 }
@@ -636,6 +666,30 @@ bool MemAllocator::init_process(ProcessManager& procman) {
     return true;
 }
 
+bool MemAllocator::add_shrinker(const ShrinkerDescriptor& shrinker) {
+    if(!shrinker.shrink) return false;
+
+    shrinkers_mutex.grab_spin();
+
+        if(shrinker_amount == MALLOC_MAX_SHRINKERS) {
+            shrinkers_mutex.release();
+            return false;
+        }
+
+        //Keep shrinkers sorted by priority, in registration order for a given priority
+        int position = shrinker_amount;
+        while((position > 0) && (shrinkers[position-1].priority > shrinker.priority)) {
+            shrinkers[position] = shrinkers[position-1];
+            --position;
+        }
+        shrinkers[position] = shrinker;
+        ++shrinker_amount;
+
+    shrinkers_mutex.release();
+
+    return true;
+}
+
 size_t MemAllocator::malloc(PID target, const size_t size, const PageFlags flags, const bool force) {
     if(!size) return NULL;
     MallocProcess* process;
@@ -662,7 +716,12 @@ size_t MemAllocator::malloc(PID target, const size_t size, const PageFlags flags
                 process->pool_size-= size;
             }
         } else {
-            result = allocator(process, size, flags, force);
+            //Forced allocations are retried after liberating memory
+            result = allocator(process, size, flags);
+            for(int attempt = 0; force && !result; ++attempt) {
+                liberate_memory(size, attempt);
+                result = allocator(process, size, flags);
+            }
         }
 
     process->mutex.release();
@@ -697,7 +756,12 @@ size_t MemAllocator::malloc_shareable(PID target,
                     process->pool_size-= size;
                 }
             } else {
-                result = allocator_shareable(process, size, flags, force);
+                //Forced allocations are retried after liberating memory
+                result = allocator_shareable(process, size, flags);
+                for(int attempt = 0; force && !result; ++attempt) {
+                    liberate_memory(size, attempt);
+                    result = allocator_shareable(process, size, flags);
+                }
             }
 
         process->mutex.release();
@@ -756,7 +820,12 @@ size_t MemAllocator::share(PID source,
         source_process->mutex.grab_spin(); //To prevent deadlocks, we must always grab mutexes in
         target_process->mutex.grab_spin(); //the same order.
 
+            //Forced sharing is retried after liberating memory
             result = share(source_process, location, target_process, flags, force);
+            for(int attempt = 0; force && !result; ++attempt) {
+                liberate_memory(PG_SIZE, attempt);
+                result = share(source_process, location, target_process, flags, force);
+            }
 
         target_process->mutex.release();
         source_process->mutex.release();
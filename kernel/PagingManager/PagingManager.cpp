@@ -30,7 +30,7 @@ bool PagingManager::alloc_mapitems() {
     if(!allocated_chunk) return false;
 
     //Fill it with initialized map items
-    current_item = (PageChunk*) (allocated_chunk->location);
+    current_item = (PageChunk*) ram_manager->frame_pointer(allocated_chunk->location);
     for(size_t used_mem = sizeof(PageChunk); used_mem <= allocated_chunk->size; used_mem+= sizeof(PageChunk)) {
         current_item = new(current_item) PageChunk;
         current_item->next_buddy = current_item+1;
@@ -38,7 +38,7 @@ bool PagingManager::alloc_mapitems() {
     }
     --current_item;
     current_item->next_buddy = free_mapitems;
-    free_mapitems = (PageChunk*) (allocated_chunk->location);
+    free_mapitems = (PageChunk*) ram_manager->frame_pointer(allocated_chunk->location);
 
     //All good !
     return true;
@@ -53,7 +53,7 @@ bool PagingManager::alloc_process_descs() {
     if(!allocated_chunk) return false;
 
     //Fill it with initialized list items
-    current_item = (PagingManagerProcess*) (allocated_chunk->location);
+    current_item = (PagingManagerProcess*) ram_manager->frame_pointer(allocated_chunk->location);
     for(size_t used_mem = sizeof(PagingManagerProcess); used_mem <= allocated_chunk->size; used_mem+= sizeof(PagingManagerProcess)) {
         current_item = new(current_item) PagingManagerProcess();
         current_item->next_item = current_item+1;
@@ -61,7 +61,7 @@ bool PagingManager::alloc_process_descs() {
     }
     --current_item;
     current_item->next_item = free_process_descs;
-    free_process_descs = (PagingManagerProcess*) (allocated_chunk->location);
+    free_process_descs = (PagingManagerProcess*) ram_manager->frame_pointer(allocated_chunk->location);
 
     //All good !
     return true;
@@ -69,8 +69,9 @@ bool PagingManager::alloc_process_descs() {
 
 PageChunk* PagingManager::alloc_virtual_address_space(PagingManagerProcess* target,
                                                         size_t size,
-                                                        size_t location) {
-    PageChunk *result, *map_parser = NULL, *last_item;
+                                                        size_t location,
+                                                        const size_t alignment) {
+    PageChunk *result, *previous_item, *next_item;
 
     //Allocate the new memory map item
     if(!free_mapitems) {
@@ -85,90 +86,47 @@ PageChunk* PagingManager::alloc_virtual_address_space(PagingManagerProcess* targ
     result->location = location;
     result->size = size;
 
-    //Put the chunk in the map
     if(!location) {
-        //Find the first location where the chunk could be put
-        if(target->map_pointer == NULL) {
-            result->location = PG_SIZE; //First page includes the NULL pointer. Not to be used.
-            target->map_pointer = result;
+        //Find the first hole where the chunk could be put, with the requested alignment, using the
+        //largest gaps stored in the map index. Chunks go at the end of holes. If there is no
+        //suitable hole, put the chunk after the last item of the map. Chunks may not be put below
+        //the start of the address space, which excludes at least the first page, since it
+        //includes the NULL pointer.
+        next_item = find_gap(target->map_index.top(), size, alignment);
+        if(next_item) {
+            result->location = align_down(next_item->location-size, alignment);
         } else {
-            if(target->map_pointer->location >= size+PG_SIZE) {
-                result->location = target->map_pointer->location-size;
-                result->next_mapitem = target->map_pointer;
-                target->map_pointer = result;
+            previous_item = target->map_index.last();
+            if(previous_item) {
+                result->location = align_up(previous_item->location+previous_item->size, alignment);
             } else {
-                last_item = target->map_pointer;
-                map_parser = target->map_pointer->next_mapitem;
-                while(map_parser) {
-                    if(map_parser->location-(last_item->location+last_item->size) >= size) {
-                        result->location = map_parser->location-size;
-                        result->next_mapitem = map_parser;
-                        last_item->next_mapitem = result;
-                        break;
-                    }
-                    last_item = map_parser;
-                    map_parser = map_parser->next_mapitem;
-                }
-                if(!map_parser) {
-                    result->location = last_item->location + last_item->size;
-                    last_item->next_mapitem = result;
-                }
+                result->location = align_up(space_start(target), alignment);
             }
         }
     } else {
         //We know where we want to put our chunk.
-        //Just find the place in the map and check that there's nothing there.
-        if(target->map_pointer == NULL) {
-            //Chunk should be inserted as the first item of the map
-            target->map_pointer = result;
+        //Just check that it's in the address space and that there's nothing there, before or
+        //after it.
+        previous_item = target->map_index.find_containing(location);
+        if(previous_item) {
+            next_item = previous_item->next_mapitem;
         } else {
-            if(target->map_pointer->location >= location) {
-                //Chunk should be inserted before the first item of the map.
-                //Check collisions with it
-                if(target->map_pointer->location < location+size) {
-                    //Required location is not available
-                    result = new(result) PageChunk();
-                    result->next_buddy = free_mapitems;
-                    free_mapitems = result;
-                    return NULL;
-                }
-                result->next_mapitem = target->map_pointer;
-                target->map_pointer = result;
-            } else {
-                last_item = target->map_pointer;
-                map_parser = last_item->next_mapitem;
-                while(map_parser) {
-                    if(map_parser->location >= location) break;
-                    last_item = map_parser;
-                    map_parser = map_parser->next_mapitem;
-                }
-                //At this point, we've found where the chunk should be inserted.
-                //Check collisions with the item before it
-                if(last_item->location+last_item->size > location) {
-                    //Required location is not available
-                    result = new(result) PageChunk();
-                    result->next_buddy = free_mapitems;
-                    free_mapitems = result;
-                    return NULL;
-                }
-                //Check collisions with the item after it, if any
-                if(map_parser) {
-                    if(map_parser->location < location + size) {
-                        //Required location is not available
-                        result = new(result) PageChunk();
-                        result->next_buddy = free_mapitems;
-                        free_mapitems = result;
-                        return NULL;
-                    }
-                    result->next_mapitem = map_parser;
-                    last_item->next_mapitem = result;
-                } else {
-                    last_item->next_mapitem = result;
-                }
-            }
+            next_item = target->map_pointer;
+        }
+        if((location < space_start(target)) ||
+           (previous_item && (previous_item->location+previous_item->size > location)) ||
+           (next_item && (next_item->location < location+size))) {
+            //Required location is not available
+            result = new(result) PageChunk();
+            result->next_buddy = free_mapitems;
+            free_mapitems = result;
+            return NULL;
         }
     }
 
+    //Put the chunk in the map
+    map_insert(target, result);
+
     return result;
 }
 
@@ -192,6 +150,28 @@ PageChunk* PagingManager::chunk_mapper(PagingManagerProcess* target,
     }
 }
 
+PageChunk* PagingManager::find_gap(PageChunk* subtree,
+                                   const size_t size,
+                                   const size_t alignment) {
+    //Find the lowest map item in the subtree before which a chunk of the requested size and
+    //alignment may be put. Subtrees whose largest gap is too small are not explored. Since
+    //alignment may make a large enough gap unsuitable, a few more may be explored than needed.
+    PageChunk* result;
+    size_t candidate;
+
+    if(!subtree || (subtree->max_gap < size)) return NULL;
+
+    result = find_gap(subtree->tree_node.left, size, alignment);
+    if(result) return result;
+
+    if(subtree->gap >= size) {
+        candidate = align_down(subtree->location-size, alignment);
+        if(candidate >= subtree->location-subtree->gap) return subtree;
+    }
+
+    return find_gap(subtree->tree_node.right, size, alignment);
+}
+
 PagingManagerProcess* PagingManager::find_pid(const PID target) {
     PagingManagerProcess* list_item;
 
@@ -204,23 +184,51 @@ PagingManagerProcess* PagingManager::find_pid(const PID target) {
     return list_item;
 }
 
-bool PagingManager::map_k_chunks(PagingManagerProcess* target) {
-    PagingManagerProcess* kernel = process_list; //Kernel is the first item of the process list.
-    PageChunk *kernel_map_parser = kernel->map_pointer, *result;
-
-    while(kernel_map_parser) {
-        if(kernel_map_parser->flags & PAGE_FLAG_K) {
-            result = chunk_mapper(target,
-                                  kernel_map_parser->points_to,
-                                  kernel_map_parser->flags,
-                                  kernel_map_parser->location);
-            if(!result) return false;
-        }
+void PagingManager::map_insert(PagingManagerProcess* target, PageChunk* item) {
+    //Put the item in the map list, after the item which precedes it, and in the map index
+    PageChunk* previous_item = target->map_index.find_containing(item->location);
+    size_t gap_start = space_start(target);
 
-        kernel_map_parser = kernel_map_parser->next_mapitem;
+    if(previous_item) {
+        item->next_mapitem = previous_item->next_mapitem;
+        previous_item->next_mapitem = item;
+        gap_start = previous_item->location+previous_item->size;
+    } else {
+        item->next_mapitem = target->map_pointer;
+        target->map_pointer = item;
     }
 
-    return true;
+    //Update the gap before the item and the gap after it, which it now splits
+    item->gap = (item->location > gap_start) ? item->location-gap_start : 0;
+    target->map_index.insert(item);
+    if(item->next_mapitem) {
+        gap_start = item->location+item->size;
+        item->next_mapitem->gap = item->next_mapitem->location-gap_start;
+        target->map_index.update(item->next_mapitem);
+    }
+}
+
+void PagingManager::map_remove(PagingManagerProcess* target, PageChunk* item) {
+    //Take the item out of the map list and of the map index
+    PageChunk* previous_item = NULL;
+    PageChunk* next_item = item->next_mapitem;
+    size_t gap_start = space_start(target);
+
+    if(item->location) previous_item = target->map_index.find_containing(item->location-1);
+    if(previous_item) {
+        previous_item->next_mapitem = next_item;
+        gap_start = previous_item->location+previous_item->size;
+    } else {
+        target->map_pointer = next_item;
+    }
+    item->next_mapitem = NULL;
+    target->map_index.remove(item);
+
+    //The gap after the item now extends down to the previous item
+    if(next_item) {
+        next_item->gap = (next_item->location > gap_start) ? next_item->location-gap_start : 0;
+        target->map_index.update(next_item);
+    }
 }
 
 bool PagingManager::init_process(ProcessManager& procman) {
@@ -276,7 +284,7 @@ bool PagingManager::free_chunk(const PID target, size_t chunk_beginning) {
 
         chunk_owner->mutex.grab_spin();
 
-            chunk = chunk_owner->map_pointer->find_thischunk(chunk_beginning);
+            chunk = chunk_owner->map_index.find(chunk_beginning);
             result = chunk_liberator(chunk_owner, chunk); //Free that chunk
 
         if(chunk_owner->pml4t_location) chunk_owner->mutex.release();
@@ -300,7 +308,7 @@ PageChunk* PagingManager::adjust_chunk_flags(const PID target,
     chunk_owner->mutex.grab_spin();
     proclist_mutex.release();
 
-        chunk = chunk_owner->map_pointer->find_thischunk(chunk_beginning);
+        chunk = chunk_owner->map_index.find(chunk_beginning);
         result = flag_adjust(chunk_owner, chunk, flags, mask); //Adjust these flags
 
     chunk_owner->mutex.release();
@@ -308,6 +316,93 @@ PageChunk* PagingManager::adjust_chunk_flags(const PID target,
     return result;
 }
 
+PageChunk* PagingManager::reserve_chunk(const PID target,
+                                        const size_t size,
+                                        const PageFlags flags) {
+    PagingManagerProcess* process;
+    PageChunk* result;
+
+    //The kernel can't take page faults on its own memory, and K pages are the kernel's
+    if((target == PID_KERNEL) || (flags & PAGE_FLAG_K)) return NULL;
+
+    proclist_mutex.grab_spin();
+
+        process = find_pid(target);
+        if(!process) {
+            proclist_mutex.release();
+            return NULL;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+            //Reserve address space. Chunks which don't point to a RAM chunk are allocated on demand.
+            result = alloc_virtual_address_space(process, align_pgup(size));
+            if(result) result->flags = flags;
+
+    process->mutex.release();
+
+    return result;
+}
+
+bool PagingManager::migrate_page(const RamChunk* page, const size_t new_location) {
+    //RamManager calls this function with its memory map locked, whereas PagingManager calls
+    //RamManager with its own mutexes held. To avoid deadlocks, no mutex is waited for here.
+    //Migrating a page takes two calls. The first one, without a new location, locks the address
+    //spaces of all owners of the page and write-protects the page there, so that it may be
+    //copied. The second one points their mappings to the copy, then unlocks them.
+    const PIDs& owners = page->owners;
+    const size_t owner_amount = owners.length();
+    PagingManagerProcess* process;
+    size_t index, locked;
+    bool repeated;
+
+    if(!new_location) {
+        if(!proclist_mutex.grab_attempt()) return false;
+
+        //Lock the address spaces of all owners of the page. Owners may be repeated, and are
+        //then found next to each other or as the first owner.
+        for(locked = 0; locked < owner_amount; ++locked) {
+            repeated = locked && ((owners[locked] == owners[0]) || (owners[locked] == owners[locked-1]));
+            if(repeated) continue;
+            process = find_pid(owners[locked]);
+            if(process && !(process->mutex.grab_attempt())) break;
+        }
+
+        //Write-protect the page in all of them if this worked. Everything then stays locked
+        //until the second call. Otherwise, unlock them.
+        const bool result = (locked == owner_amount);
+        for(index = 0; index < locked; ++index) {
+            repeated = index && ((owners[index] == owners[0]) || (owners[index] == owners[index-1]));
+            if(repeated) continue;
+            process = find_pid(owners[index]);
+            if(!process) continue;
+            if(result) {
+                page_remapper(process, page, page->location, true);
+            } else {
+                process->mutex.release();
+            }
+        }
+        if(!result) proclist_mutex.release();
+
+        return result;
+    }
+
+        //Remap the page at its new location with its usual flags, then unlock everything
+        for(index = 0; index < owner_amount; ++index) {
+            repeated = index && ((owners[index] == owners[0]) || (owners[index] == owners[index-1]));
+            if(repeated) continue;
+            process = find_pid(owners[index]);
+            if(!process) continue;
+            page_remapper(process, page, new_location);
+            process->mutex.release();
+        }
+
+    proclist_mutex.release();
+
+    return true;
+}
+
 void PagingManager::remove_process(PID target) {
     if(target == PID_KERNEL) return; //Find a more constructive way to commit suicide.
 
@@ -346,3 +441,25 @@ void PagingManager::print_mmap(PID owner) {
         list_item->mutex.release();
     }
 }
+
+void PagingManager::print_tcache(PID owner) {
+    PagingManagerProcess* list_item;
+
+    proclist_mutex.grab_spin();
+
+        list_item = find_pid(owner);
+        if(!list_item) {
+            dbgout << txtcolor(TXT_RED) << "Error : Process does not exist";
+            dbgout << txtcolor(TXT_DEFAULT);
+        } else {
+            list_item->mutex.grab_spin();
+        }
+
+    proclist_mutex.release();
+
+    if(list_item) {
+        dbgout << "Translation cache : " << list_item->tcache.hits << " hits, ";
+        dbgout << list_item->tcache.misses << " misses" << endl;
+        list_item->mutex.release();
+    }
+}
@@ -59,7 +59,6 @@ bool PagingManagerProcess::operator==(const PagingManagerProcess& param) const {
     if(pml4t_location != param.pml4t_location) return false;
     if(next_item != param.next_item) return false;
     if(mutex != param.mutex) return false;
-    if(may_free_kpages != param.may_free_kpages) return false;
 
     return true;
 }
@@ -18,6 +18,8 @@
 
 #include <new.h>
 #include <KernelInformation.h>
+#include <kmath.h>
+#include <panic.h>
 #include <RamManager.h>
 
 #include <dbgstream.h>
@@ -25,120 +27,97 @@
 
 RamManager* ram_manager = NULL;
 
-bool RamManager::alloc_mapitems(RamChunk* free_mem_override) {
-    size_t remaining_freemem = 0;
-    RamChunk *allocated_chunk, *current_item, *free_chunk = NULL;
+bool RamManager::alloc_mapitems() {
+    RamChunk* allocated_chunk;
 
-    //Get some free memory to store mapitems or abort
-    if(!free_mem_override) {
-        allocated_chunk = free_mem;
-        if(!allocated_chunk) return false;
-        remaining_freemem = allocated_chunk->size - PG_SIZE;
-        allocated_chunk->size = PG_SIZE;
-    } else {
-        allocated_chunk = free_mem_override;
+    //Take the smallest free block of high memory available, as close as possible to the current
+    //CPU, or abort. It cannot be split yet, since splitting requires map items.
+    RamZone** zones = zone_fallback[local_node()];
+    allocated_chunk = NULL;
+    for(int index = 0; (index < highmem_zone_amount) && !allocated_chunk; ++index) {
+        allocated_chunk = buddy_take(*(zones[index]), 0, false);
     }
+    if(!allocated_chunk) return false;
+    bitmap_mark(allocated_chunk->location, PG_SIZE, false);
     allocated_chunk->owners = PID_KERNEL;
+    find_process(PID_KERNEL)->memory_usage+= PG_SIZE;
 
-    //Store our brand new free memory map items in the allocated mem
-    current_item = (RamChunk*) (allocated_chunk->location);
-    for(size_t used_mem = sizeof(RamChunk); used_mem <= allocated_chunk->size; used_mem+= sizeof(RamChunk)) {
-        current_item = new(current_item) RamChunk();
-        current_item->next_mapitem = current_item+1;
-        ++current_item;
-    }
-    --current_item;
-    current_item->next_mapitem = free_mapitems;
-    free_mapitems = (RamChunk*) (allocated_chunk->location);
-
-    //Maybe there is some spare memory left after allocating our chunk ?
-    //If so, don't leak it.
-    if(remaining_freemem) {
-        free_chunk = free_mapitems;
-        free_mapitems = free_mapitems->next_mapitem;
-        free_chunk->location = allocated_chunk->location+allocated_chunk->size;
-        free_chunk->size = remaining_freemem;
-        free_chunk->next_mapitem = allocated_chunk->next_mapitem;
-        free_chunk->next_buddy = allocated_chunk->next_buddy;
-        allocated_chunk->next_mapitem = free_chunk;
-    }
-
-    //Update free memory information
-    if(!free_mem_override) {
-        if(free_chunk) {
-            free_mem = free_chunk;
-        } else {
-            free_mem = allocated_chunk->next_buddy;
-        }
-        find_process(PID_KERNEL)->memory_usage+= allocated_chunk->size;
+    //Store our brand new free memory map items in its first page
+    store_mapitems(allocated_chunk->location, PG_SIZE);
+
+    //Maybe there is some spare memory left after this page ? If so, don't leak it.
+    if(allocated_chunk->size > PG_SIZE) {
+        split_chunk(allocated_chunk, PG_SIZE);
+        RamChunk* free_chunk = allocated_chunk->next_mapitem;
+        free_chunk->owners = PID_INVALID;
+        buddy_free(free_chunk);
     }
-    allocated_chunk->next_buddy = NULL;
 
     return true;
 }
 
 
-bool RamManager::alloc_pids() {
-    size_t remaining_freemem;
-    PIDs *current_item;
-    RamChunk *allocated_chunk, *free_chunk = NULL;
+bool RamManager::alloc_pidarrays(const int size_class) {
+    PIDArray *current_item;
+    RamChunk *allocated_chunk;
+    const size_t array_bytes = pidarray_bytes(size_class);
 
-    //Get some free memory to store PIDs in or abort
-    allocated_chunk = free_mem;
+    //Get some free memory to store arrays of PIDs in or abort
+    allocated_chunk = highmem_alloc(local_node(), 0, false);
     if(!allocated_chunk) return false;
-    remaining_freemem = allocated_chunk->size - PG_SIZE;
-    allocated_chunk->size = PG_SIZE;
     allocated_chunk->owners = PID_KERNEL;
+    find_process(PID_KERNEL)->memory_usage+= allocated_chunk->size;
 
-    //Store our brand new PIDs in the allocated mem
-    current_item = (PIDs*) (allocated_chunk->location);
-    for(size_t used_mem = sizeof(PIDs); used_mem <= allocated_chunk->size; used_mem+= sizeof(PIDs)) {
-        current_item = new(current_item) PIDs();
-        current_item->next_item = current_item+1;
-        ++current_item;
-    }
-    --current_item;
-    current_item->next_item = free_pids;
-    free_pids = (PIDs*) (allocated_chunk->location);
-
-    //Maybe there is some spare memory after allocating our chunk ?
-    //If so, don't forget it.
-    if(remaining_freemem) {
-        free_chunk = free_mapitems;
-        free_mapitems = free_mapitems->next_mapitem;
-        free_chunk->location = allocated_chunk->location+PG_SIZE;
-        free_chunk->size = remaining_freemem;
-        free_chunk->next_mapitem = allocated_chunk->next_mapitem;
-        free_chunk->next_buddy = allocated_chunk->next_buddy;
-        allocated_chunk->next_mapitem = free_chunk;
-    }
-
-    //Update free memory information
-    if(free_chunk) {
-        free_mem = free_chunk;
-    } else {
-        free_mem = allocated_chunk->next_buddy;
+    //Store our brand new arrays of PIDs in the allocated mem
+    for(size_t used_mem = 0; used_mem+array_bytes <= allocated_chunk->size; used_mem+= array_bytes) {
+        current_item = new(frame_pointer(allocated_chunk->location+used_mem)) PIDArray(size_class);
+        current_item->next_item = free_pidarrays[size_class];
+        free_pidarrays[size_class] = current_item;
     }
+
+    return true;
+}
+
+bool RamManager::alloc_owneditems() {
+    RamOwnedItem *current_item, *first_item = NULL, *last_item = NULL;
+    RamChunk *allocated_chunk;
+
+    //Get some free memory to store records of owned chunks in or abort
+    allocated_chunk = highmem_alloc(local_node(), 0, false);
+    if(!allocated_chunk) return false;
+    allocated_chunk->owners = PID_KERNEL;
     find_process(PID_KERNEL)->memory_usage+= allocated_chunk->size;
-    allocated_chunk->next_buddy = NULL;
+
+    //Store our brand new records in the allocated mem, then put them in the pool
+    for(size_t used_mem = 0; used_mem+sizeof(RamOwnedItem) <= allocated_chunk->size; used_mem+= sizeof(RamOwnedItem)) {
+        current_item = new(frame_pointer(allocated_chunk->location+used_mem)) RamOwnedItem();
+        current_item->next_item = first_item;
+        first_item = current_item;
+        if(!last_item) last_item = current_item;
+    }
+    owneditems_mutex.grab_spin();
+
+        last_item->next_item = free_owneditems;
+        free_owneditems = first_item;
+
+    owneditems_mutex.release();
 
     return true;
 }
 
 bool RamManager::alloc_procitems() {
-    size_t remaining_freemem;
     RamManagerProcess* current_item;
-    RamChunk *allocated_chunk, *free_chunk = NULL;
+    RamChunk *allocated_chunk;
 
     //Get some free memory to store process descriptors in or abort
-    allocated_chunk = free_mem;
+    allocated_chunk = highmem_alloc(local_node(), 0, false);
     if(!allocated_chunk) return false;
-    remaining_freemem = allocated_chunk->size - PG_SIZE;
-    allocated_chunk->size = PG_SIZE;
     allocated_chunk->owners = PID_KERNEL;
+    find_process(PID_KERNEL)->memory_usage+= allocated_chunk->size;
 
     //Store our brand new process descritors in the allocated mem
-    current_item = (RamManagerProcess*) (allocated_chunk->location);
+    RamManagerProcess* const first_item = (RamManagerProcess*) frame_pointer(allocated_chunk->location);
+    current_item = first_item;
     for(size_t used_mem = sizeof(RamManagerProcess); used_mem <= allocated_chunk->size; used_mem+= sizeof(RamManagerProcess)) {
         current_item = new(current_item) RamManagerProcess();
         current_item->next_item = current_item+1;
@@ -146,158 +125,410 @@ bool RamManager::alloc_procitems() {
     }
     --current_item;
     current_item->next_item = free_procitems;
-    free_procitems = (RamManagerProcess*) (allocated_chunk->location);
-
-    //Maybe there is some spare memory after allocating our chunk ?
-    //If so, don't forget it.
-    if(remaining_freemem) {
-        free_chunk = free_mapitems;
-        free_mapitems = free_mapitems->next_mapitem;
-        free_chunk->location = allocated_chunk->location+PG_SIZE;
-        free_chunk->size = remaining_freemem;
-        free_chunk->next_mapitem = allocated_chunk->next_mapitem;
-        free_chunk->next_buddy = allocated_chunk->next_buddy;
-        allocated_chunk->next_mapitem = free_chunk;
-    }
-
-    //Update free memory information
-    if(free_chunk) {
-        free_mem = free_chunk;
-    } else {
-        free_mem = allocated_chunk->next_buddy;
-    }
-    find_process(PID_KERNEL)->memory_usage+= allocated_chunk->size;
-    allocated_chunk->next_buddy = NULL;
+    free_procitems = first_item;
 
     return true;
 }
 
-RamChunk* RamManager::chunk_allocator(RamManagerProcess* owner,
-                                      const size_t size,
-                                      RamChunk*& free_mem_used,
-                                      bool contiguous) {
-    size_t remaining_freemem = 0, to_be_allocd = 0;
-    RamChunk *previous_free_chunk = NULL, *new_free_chunk = NULL;
-    RamChunk *current_chunk, *previous_chunk, *result;
+bool RamManager::bitmap_find_run(const RamZone& zone,
+                                 const size_t size,
+                                 const size_t alignment,
+                                 size_t& location) {
+    //Free pages are looked for 64 at a time, and so are used pages when measuring a run
+    const size_t length = size/PG_SIZE, align_frames = alignment/PG_SIZE;
+    size_t frame, end_frame, run_start;
+    uint64_t word;
+    const uint64_t* const frame_bitmap = (uint64_t*) frame_pointer(bitmap_location);
+
+    frame = zone.location/PG_SIZE;
+    end_frame = bitmap_frames;
+    if(end_frame-frame > zone.ready_size/PG_SIZE) end_frame = frame+zone.ready_size/PG_SIZE;
+
+    while(frame < end_frame) {
+        //Skip used pages
+        word = frame_bitmap[frame/64] >> (frame%64);
+        if(!word) {
+            frame = align_down(frame, 64)+64;
+            continue;
+        }
+        frame+= __builtin_ctzll(word);
+        frame = align_up(frame, align_frames);
+        if(frame >= end_frame) break;
+
+        //Measure the run of free pages starting there
+        run_start = frame;
+        while((frame < end_frame) && (frame-run_start < length)) {
+            word = (~frame_bitmap[frame/64]) >> (frame%64);
+            if(word) {
+                frame+= __builtin_ctzll(word);
+                break;
+            }
+            frame = align_down(frame, 64)+64;
+        }
+        if(frame > end_frame) frame = end_frame;
+        if(frame-run_start >= length) {
+            location = run_start*PG_SIZE;
+            return true;
+        }
+    }
 
-    //Check if we can allocate the requested memory without busting caps
-    if(owner->memory_usage + size > owner->memory_cap) return NULL;
+    return false;
+}
 
-    //Make sure there's enough space for storing a new memory map item
-    if(!free_mapitems) {
-        if(!alloc_mapitems()) return NULL; //Memory is full
+
+void RamManager::bitmap_mark(const size_t location, const size_t size, const bool free) {
+    size_t frame = location/PG_SIZE, end_frame = (location+size)/PG_SIZE, count;
+    uint64_t mask;
+    uint64_t* const frame_bitmap = (uint64_t*) frame_pointer(bitmap_location);
+
+    if(end_frame > bitmap_frames) end_frame = bitmap_frames;
+    while(frame < end_frame) {
+        //Pages are marked a whole word at a time where possible
+        count = min(64-frame%64, end_frame-frame);
+        if(count == 64) {
+            mask = ~((uint64_t) 0);
+        } else {
+            mask = ((((uint64_t) 1) << count)-1) << (frame%64);
+        }
+        if(free) {
+            frame_bitmap[frame/64]|= mask;
+        } else {
+            frame_bitmap[frame/64]&= ~mask;
+        }
+        frame+= count;
     }
+}
 
-    //Find a suitable free chunk of memory, store it in current_chunk.
-    current_chunk = free_mem_used;
-    if(!current_chunk) return NULL;
-    if(contiguous) {
-        //To enforce contiguity, extra steps are needed. We will noticeably need to know which
-        //free memory chunk stood before the one we'll be dealing with, if any.
-        current_chunk = current_chunk->find_contigchunk(size);
-        if(!current_chunk) return NULL;
-        if(current_chunk != free_mem_used) {
-            previous_free_chunk = free_mem_used;
-            while(previous_free_chunk->next_buddy != current_chunk) {
-                previous_free_chunk = previous_free_chunk->next_buddy;
-            }
+
+RamChunk* RamManager::buddy_alloc(RamZone& zone, const int order, const bool honour_reserves) {
+    RamChunk* result;
+    int current_order;
+
+    //Find the smallest free block that is large enough
+    result = buddy_take(zone, order, honour_reserves);
+    if(!result) return NULL;
+
+    //Split it in halves until it has the requested size, putting the upper halves in free lists
+    current_order = 0;
+    while(buddy_size(current_order) < result->size) ++current_order;
+    while(current_order > order) {
+        if(!split_chunk(result, result->size/2)) {
+            //Memory is full, put what remains of the block back where it belongs
+            buddy_insert(zone, result, current_order);
+            return NULL;
         }
+        --current_order;
+        freelist_add(zone, result->next_mapitem, current_order);
     }
+    bitmap_mark(result->location, result->size, false);
 
-    //Allocate current_chunk. At this point, we may find ourselves in three situations :
-    // 1-We allocated too much and must split current_chunk in an allocated part and a free part.
-    // 2-We allocated exactly the right amount of memory.
-    // 3-We allocated too little memory and need to allocate more.
-    current_chunk->owners = owner->identifier;
-    result = current_chunk;
-    if(current_chunk->size > size) {
-        remaining_freemem = current_chunk->size-size;
-    } else {
-        to_be_allocd = size-current_chunk->size;
+    return result;
+}
+
+
+RamChunk* RamManager::buddy_carve(RamZone& zone, const size_t location, const size_t size) {
+    RamChunk *first_block, *block, *before = NULL, *after = NULL;
+    int order;
+
+    //Find the free block where the run begins
+    first_block = map_index.find_containing(location);
+
+    //Take all the blocks of the run out of the free lists, so that nothing else may use them
+    for(block = first_block; block && (block->location < location+size); block = block->next_mapitem) {
+        order = 0;
+        while(buddy_size(order) < block->size) ++order;
+        freelist_remove(zone, block, order);
     }
 
-    //First, if we allocated too little memory...
-    while(to_be_allocd) {
-        //...allocate another chunk of memory, abort if memory is full.
-        previous_chunk = current_chunk;
-        current_chunk = current_chunk->next_buddy;
-        if(!current_chunk) {
-            chunk_liberator(result);
-            return NULL;
+    //Glue them together, and cut the free memory which lies around the run
+    if(first_block->location < location) {
+        split_chunk(first_block, location-first_block->location);
+        before = first_block;
+        first_block = first_block->next_mapitem;
+    }
+    while(first_block->location+first_block->size < location+size) merge_with_next(first_block);
+    if(first_block->size > size) {
+        split_chunk(first_block, size);
+        after = first_block->next_mapitem;
+    }
+    bitmap_mark(location, size, false);
+
+    //Give this memory back to the buddy allocator
+    if(before) buddy_free(before);
+    if(after) buddy_free(after);
+
+    return first_block;
+}
+
+void RamManager::buddy_free(RamChunk* chunk) {
+    //Chunks which are given back to the buddy allocator may be of any size. They are cut into
+    //naturally aligned power-of-two blocks which are then inserted in the relevant free lists.
+    RamChunk* remainder;
+    size_t block_size;
+    int order;
+
+    while(chunk) {
+        RamZone& zone = find_zone(chunk->location);
+
+        //Find the largest block which may be cut at the beginning of the chunk
+        block_size = PG_SIZE;
+        order = 0;
+        while(order+1 < RAM_BUDDY_ORDERS) {
+            if(chunk->location % (2*block_size)) break;
+            if(chunk->size < 2*block_size) break;
+            if(!zone.contains(chunk->location, 2*block_size)) break;
+            block_size*= 2;
+            ++order;
         }
-        current_chunk->owners = owner->identifier;
 
-        //Update to_be_allocd and remaining_freemem
-        if(current_chunk->size < to_be_allocd) {
-            to_be_allocd-= current_chunk->size;
-        } else {
-            remaining_freemem = current_chunk->size-to_be_allocd;
-            to_be_allocd = 0;
+        //Cut it from the rest of the chunk
+        remainder = NULL;
+        if(chunk->size > block_size) {
+            if(!free_mapitems && !alloc_mapitems()) {
+                //Memory is so full that the map items required to free this chunk must be taken
+                //from the chunk itself.
+                store_mapitems(chunk->location, PG_SIZE);
+                split_chunk(chunk, PG_SIZE);
+                chunk->owners = PID_KERNEL;
+                find_process(PID_KERNEL)->memory_usage+= PG_SIZE;
+                chunk = chunk->next_mapitem;
+                continue;
+            }
+            split_chunk(chunk, block_size);
+            remainder = chunk->next_mapitem;
         }
 
-        //If the newly allocated chunk follows the previous one, merge them together
-        if(current_chunk->location == previous_chunk->location+previous_chunk->size) {
-            merge_with_next(previous_chunk);
-            current_chunk = previous_chunk;
+        //Put the block in the free lists, then move to the rest of the chunk
+        buddy_insert(zone, chunk, order);
+        chunk = remainder;
+    }
+}
+
+void RamManager::buddy_insert(RamZone& zone, RamChunk* block, int order) {
+    RamChunk* buddy;
+    size_t buddy_location, block_size = block->size;
+
+    bitmap_mark(block->location, block->size, true);
+
+    //As long as the buddy of our block is free, merge them together
+    while(order+1 < RAM_BUDDY_ORDERS) {
+        buddy_location = block->location ^ block_size;
+        if(!zone.contains(min(buddy_location, block->location), 2*block_size)) break;
+        if(buddy_location > block->location) {
+            buddy = block->next_mapitem;
+        } else {
+            buddy = block->previous_mapitem;
         }
+        if(!buddy || !(buddy->in_free_list)) break;
+        if((buddy->location != buddy_location) || (buddy->size != block_size)) break;
+
+        freelist_remove(zone, buddy, order);
+        if(buddy_location < block->location) block = buddy;
+        merge_with_next(block);
+        block_size*= 2;
+        ++order;
     }
 
-    //At this point, check if we allocated too much memory, and if so correct this
-    if(remaining_freemem) {
-        current_chunk->size-= remaining_freemem;
-        new_free_chunk = free_mapitems;
-        free_mapitems = free_mapitems->next_mapitem;
-        new_free_chunk->location = current_chunk->location+current_chunk->size;
-        new_free_chunk->size = remaining_freemem;
-        new_free_chunk->next_mapitem = current_chunk->next_mapitem;
-        new_free_chunk->next_buddy = current_chunk->next_buddy;
-        current_chunk->next_mapitem = new_free_chunk;
+    freelist_add(zone, block, order);
+}
+
+RamChunk* RamManager::buddy_take(RamZone& zone, const int min_order, const bool honour_reserves) {
+    RamChunk* result;
+
+    //Part of the zone's memory may not have been given to the buddy allocator yet, in which case
+    //more of it is initialized until the free lists can satisfy the request
+    do {
+        for(int order = min_order; order < RAM_BUDDY_ORDERS; ++order) {
+            if(honour_reserves && zone.breaks_reserves(order, min_order)) break;
+            result = zone.free_lists[order];
+            if(result) {
+                freelist_remove(zone, result, order);
+                return result;
+            }
+        }
+    } while(deferred_init(zone));
+
+    return NULL;
+}
+
+RamChunk* RamManager::chunk_allocator(RamManagerProcess* owner,
+                                      const size_t size,
+                                      RamZone** zones,
+                                      const int zone_amount,
+                                      bool contiguous,
+                                      const RamAllocFlags flags) {
+    RamChunk *block, *result = NULL;
+    int order, min_order = 0;
+    bool honour_reserves = true;
+
+    //Large frames are allocated as blocks of at least their order
+    if(flags & RAM_ALLOC_1G) {
+        min_order = RAM_ORDER_1G;
+    } else if(flags & RAM_ALLOC_2M) {
+        min_order = RAM_ORDER_2M;
     }
+    const size_t alloc_size = align_up(size, buddy_size(min_order));
+    if(!alloc_size) return NULL; //Empty chunks do not exist
 
-    //Update free memory information
-    if(!previous_free_chunk) {
-        if(new_free_chunk) {
-            free_mem_used = new_free_chunk;
-        } else {
-            free_mem_used = current_chunk->next_buddy;
+    //Check if we can allocate the requested memory without busting caps
+    if(owner->memory_usage + alloc_size > owner->memory_cap) return NULL;
+
+    //Find the order of the smallest block which holds the requested amount of memory
+    order = min_order;
+    while((order+1 < RAM_BUDDY_ORDERS) && (buddy_size(order) < alloc_size)) ++order;
+
+    if(contiguous) {
+        //Contiguous chunks are made of a single block, from which excess memory is given back.
+        //If there is no such block, the bitmap of free memory is searched for a run of free pages
+        //spanning several blocks instead. Zones are tried one after the other.
+        for(int index = 0; (index < zone_amount) && !result; ++index) {
+            RamZone& zone = *(zones[index]);
+            if(buddy_size(order) >= alloc_size) {
+                result = buddy_alloc(zone, order, true);
+                if(!result) result = buddy_alloc(zone, order, false);
+                if(result) break;
+            }
+            size_t run_location;
+            bool run_found = bitmap_find_run(zone, alloc_size, buddy_size(min_order), run_location);
+            while(!run_found && deferred_init(zone)) {
+                run_found = bitmap_find_run(zone, alloc_size, buddy_size(min_order), run_location);
+            }
+            if(!run_found) {
+                //Free memory may be too fragmented. Free pages of this zone which are held in
+                //caches are given back first, no more than the run may lack, then used pages are
+                //moved out of the way if this was not enough.
+                if(magazine_reclaim(NULL, alloc_size, &zone)) {
+                    run_found = bitmap_find_run(zone, alloc_size, buddy_size(min_order), run_location);
+                }
+                if(!run_found) compact(zone, alloc_size, buddy_size(min_order), owner);
+            }
+            if(!free_mapitems || !(free_mapitems->next_mapitem)) alloc_mapitems();
+            if(!free_mapitems || !(free_mapitems->next_mapitem)) return NULL; //Memory is full
+            if(!bitmap_find_run(zone, alloc_size, buddy_size(min_order), run_location)) continue;
+            result = buddy_carve(zone, run_location, alloc_size);
+        }
+        if(!result) return NULL;
+        result->owners = owner->identifier;
+        if(result->size > alloc_size) {
+            if(!split_chunk(result, alloc_size)) {
+                chunk_liberator(result);
+                return NULL;
+            }
+            buddy_free(result->next_mapitem);
         }
     } else {
-        if(new_free_chunk) {
-            previous_free_chunk->next_buddy = new_free_chunk;
-        } else {
-            previous_free_chunk->next_buddy = current_chunk->next_buddy;
+        //Noncontiguous chunks are made of blocks as large as possible, chained as buddies. Large
+        //blocks which are kept in reserve are only split if nothing else is available. Blocks
+        //are taken from the first zone until it runs dry, then from the next ones.
+        size_t remaining_size = alloc_size;
+        int index = 0;
+        while(remaining_size) {
+            while(buddy_size(order) > remaining_size) --order;
+            block = buddy_alloc(*(zones[index]), order, honour_reserves);
+            if(!block) {
+                //There is no free block this large anymore, try smaller ones, then try again while
+                //using reserves, then move to the next zone, and finally abort
+                if(order > min_order) {
+                    --order;
+                } else if(honour_reserves) {
+                    honour_reserves = false;
+                    order = RAM_BUDDY_ORDERS-1;
+                } else if(index+1 < zone_amount) {
+                    ++index;
+                    honour_reserves = true;
+                    order = RAM_BUDDY_ORDERS-1;
+                } else {
+                    if(result) chunk_liberator(result);
+                    return NULL;
+                }
+                continue;
+            }
+            block->owners = owner->identifier;
+            remaining_size-= block->size;
+            chunk_insert(result, block);
         }
     }
-    current_chunk->next_buddy = NULL;
 
     //Update process memory usage if allocation has been successful
-    owner->memory_usage+= size;
+    if(!result) return NULL;
+    RamOwnedItem* const item = owneditems_take(1, true);
+    if(!item) {
+        chunk_liberator(result);
+        return NULL;
+    }
+    owner->memory_usage+= alloc_size;
+    owned_link(owner, result, item);
 
     return result;
 }
 
 
+void RamManager::chunk_insert(RamChunk*& chunk, RamChunk* piece) {
+    //Noncontiguous chunks are kept sorted by address, and contiguous pieces are merged together
+    RamChunk *previous_piece = NULL, *next_piece = chunk;
+
+    while(next_piece && (next_piece->location < piece->location)) {
+        previous_piece = next_piece;
+        next_piece = next_piece->next_buddy;
+    }
+    piece->next_buddy = next_piece;
+    if(previous_piece) {
+        previous_piece->next_buddy = piece;
+    } else {
+        chunk = piece;
+    }
+
+    if(next_piece && (piece->location+piece->size == next_piece->location)) {
+        merge_with_next(piece);
+    }
+    if(previous_piece && (previous_piece->location+previous_piece->size == piece->location)) {
+        merge_with_next(previous_piece);
+    }
+}
+
+
+bool RamManager::chunk_liberator(RamChunk* chunk, const bool cache_pages) {
+    RamChunk *current_chunk, *next_chunk = chunk;
+
+    do {
+        //Keep track of the next memory map item in the chunk
+        current_chunk = next_chunk;
+        next_chunk = current_chunk->next_buddy;
+
+        //Free current item from its owners and buddies. For non-allocatable items, that's all.
+        pids_liberator(current_chunk->owners);
+        current_chunk->owners = PID_INVALID;
+        current_chunk->next_buddy = NULL;
+        if(!(current_chunk->allocatable)) continue;
+
+        //Allocatable items go back to the buddy allocator, except for single pages of high
+        //memory which may be kept in the current CPU's magazine.
+        if(cache_pages && (current_chunk->size == PG_SIZE) && (&find_zone(current_chunk->location) != &lowmem_zone)) {
+            magazine_free(current_chunk);
+        } else {
+            buddy_free(current_chunk);
+        }
+    } while(next_chunk);
+
+    return true;
+}
+
+
 bool RamManager::chunk_owneradd(RamManagerProcess* new_owner, RamChunk* chunk) {
-    RamChunk* current_item = chunk;
+    RamChunk* current_item;
+    size_t chunk_size = 0;
 
     //Check if we can allocate the requested memory without busting caps
-    if(new_owner->memory_usage + chunk->size > new_owner->memory_cap) return false;
+    for(current_item = chunk; current_item; current_item = current_item->next_buddy) {
+        chunk_size+= current_item->size;
+    }
+    if(new_owner->memory_usage + chunk_size > new_owner->memory_cap) return false;
 
-    while(current_item) {
-        //Check if there are some PIDs left in free_pids, attempt to allocate if needed
-        if(!free_pids) {
-            if(!alloc_pids()) break;
-        }
+    current_item = chunk;
 
+    while(current_item) {
         //Add a new owner to the chunk
-        PIDs& chunk_owners = current_item->owners;
-        PIDs* old_next_owner = chunk_owners.next_item;
-        chunk_owners.next_item = free_pids;
-        free_pids = free_pids->next_item;
-        chunk_owners.next_item->next_item = old_next_owner;
-
-        //Set up the new owner to an appropriate value
-        *(chunk_owners.next_item) = new_owner->identifier;
+        if(!pids_add(current_item->owners, new_owner->identifier)) break;
 
         //Examine next chunk buddy
         current_item = current_item->next_buddy;
@@ -305,80 +536,309 @@ bool RamManager::chunk_owneradd(RamManagerProcess* new_owner, RamChunk* chunk) {
 
     //If the operation fails, reverts changes.
     if(current_item) {
-        chunk_ownerdel(new_owner, chunk);
+        for(RamChunk* reverted_item = chunk; reverted_item != current_item; reverted_item = reverted_item->next_buddy) {
+            pids_remove(reverted_item->owners, new_owner->identifier);
+        }
         return false;
     }
 
-    //Update process memory usage if allocation has been successful
-    new_owner->memory_usage+= chunk->size;
+    //Update process memory usage if allocation has been successful. From now on, the chunk's
+    //ownership is only protected by mmap_mutex.
+    if(chunk->owned_item) chunk->owned_item->shared = true;
+    new_owner->memory_usage+= chunk_size;
+    ++(new_owner->shared_chunks);
 
     return true;
 }
 
 
-bool RamManager::chunk_ownerdel(RamManagerProcess* former_owner, RamChunk* chunk) {
+bool RamManager::chunk_ownerdel(RamManagerProcess* former_owner,
+                                RamChunk* chunk,
+                                const bool cache_pages) {
     RamChunk* current_chunk = chunk;
+    size_t chunk_size = 0;
+    bool still_owner = false, has_owners = false;
 
+    //Pages of the chunk which the process has given up (see unshare_page) are not owned by it
+    //anymore, so each piece of the chunk is looked at separately
     while(current_chunk) {
-        PIDs& current_owners = current_chunk->owners;
-        PIDs* former_pids = NULL;
+        //Remove the owner from the chunk
+        if(pids_remove(current_chunk->owners, former_owner->identifier)) {
+            chunk_size+= current_chunk->size;
+        }
+        if(current_chunk->has_owner(former_owner->identifier)) still_owner = true;
+        if(!current_chunk->has_owner(PID_INVALID)) has_owners = true;
 
-        //Find out if a PIDs is to be liberated, if yes mark it with the former_pids pointer
-        if(current_owners.current_pid == former_owner->identifier) {
-            if(!current_owners.next_item) {
-                current_owners.current_pid = PID_INVALID;
-            } else {
-                former_pids = current_owners.next_item;
-                if(former_pids) {
-                    current_owners.current_pid = former_pids->current_pid;
-                    current_owners.next_item = former_pids->next_item;
-                }
-            }
-        } else {
-            PIDs* parser = &current_owners;
-            while(parser->next_item) {
-                if(parser->next_item->current_pid == former_owner->identifier) {
-                    former_pids = parser->next_item;
-                    parser->next_item = former_pids->next_item;
-                    break;
-                }
-                parser = parser->next_item;
+        //Go to next item in the buddy list
+        current_chunk = current_chunk->next_buddy;
+    }
+    const bool listed = chunk->owned_item && (chunk->owned_item->list_owner == former_owner->identifier);
+    if(!chunk_size && !listed) return false;
+
+    //Update process memory usage, and the process' knowledge of which chunks it owns
+    former_owner->memory_usage-= chunk_size;
+    if(listed && !still_owner) {
+        owned_unlink(former_owner, chunk);
+    } else if(former_owner->shared_chunks) {
+        --(former_owner->shared_chunks);
+    }
+
+    //If chunk has no owners anymore, liberate it. A process which has given up all of its pages
+    //(see unshare_page) may still have it in its list of owned chunks, and it is then liberated
+    //once that process frees it.
+    if(!has_owners && !(chunk->owned_item)) chunk_liberator(chunk, cache_pages);
+
+    return true;
+}
+
+
+bool RamManager::chunk_split(RamChunk* piece, const size_t position) {
+    //split_chunk only gives the second half the first owner of the piece, and leaves it out of
+    //the chunk if the piece was its last one. Both are fixed here. The second half is not the
+    //first piece of the chunk, so it has no record of ownership and stays unmovable (see
+    //compact_window).
+    if(!split_chunk(piece, position)) return false;
+    RamChunk* second_half = piece->next_mapitem;
+    piece->next_buddy = second_half;
+    for(size_t index = 1; index < piece->owners.length(); ++index) {
+        if(!pids_add(second_half->owners, piece->owners[index])) {
+            pids_liberator(second_half->owners);
+            merge_with_next(piece);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool RamManager::compact(RamZone& zone,
+                         const size_t size,
+                         const size_t alignment,
+                         RamManagerProcess* locked) {
+    RamChunk *item, *left_item, *isolated = NULL, *next_item;
+    size_t location;
+    int order, window_order = 0;
+    bool result = true;
+
+    if(!page_migrator) return false; //Used pages cannot be remapped
+
+    //Windows are aligned on the size of the smallest buddy block which holds them
+    while((window_order+1 < RAM_BUDDY_ORDERS) && (buddy_size(window_order) < size)) ++window_order;
+    if(!compact_window(zone, size, max(alignment, buddy_size(window_order)), location)) return false;
+
+    //Take the free blocks of the window out of the free lists, so that pages which are moved out
+    //of the window don't go there. They are chained using next_buddy.
+    for(item = map_index.find_containing(location); item && (item->location < location+size); item = item->next_mapitem) {
+        if(!(item->in_free_list)) continue;
+        order = 0;
+        while(buddy_size(order) < item->size) ++order;
+        freelist_remove(zone, item, order);
+        item->next_buddy = isolated;
+        isolated = item;
+    }
+
+    //Move used pages out of the window. The free map items which take their place join the
+    //isolated blocks.
+    for(item = map_index.find_containing(location); item && (item->location < location+size); item = item->next_mapitem) {
+        if(item->owners.first_pid == PID_INVALID) continue;
+        left_item = compact_migrate(item, window_order, locked);
+        if(!left_item) {
+            result = false;
+            break;
+        }
+        left_item->next_buddy = isolated;
+        isolated = left_item;
+        item = left_item;
+    }
+
+    //Give isolated memory back to the buddy allocator, where it's merged into larger blocks
+    while(isolated) {
+        next_item = isolated->next_buddy;
+        isolated->next_buddy = NULL;
+        buddy_free(isolated);
+        isolated = next_item;
+    }
+
+    return result;
+}
+
+
+RamChunk* RamManager::compact_migrate(RamChunk* page,
+                                      const int window_order,
+                                      RamManagerProcess* locked) {
+    RamZone& zone = find_zone(page->location);
+    const bool lowmem = (&zone == &lowmem_zone);
+    const PID owner = page->owners.first_pid;
+    RamManagerProcess* owner_process = NULL;
+    RamChunk* destination = NULL;
+
+    //Processes may free single pages without taking mmap_mutex (see free_chunk_batch), so the
+    //mutex of the page's owner must be held while it is moved. Unless the caller holds it, it can
+    //only be attempted, and the page must then be checked to still belong to that process.
+    if(!locked || (owner != locked->identifier)) {
+        owner_process = grab_process_attempt(owner);
+        if(!owner_process) return NULL;
+        if(page->owners.first_pid != owner) {
+            owner_process->mutex.release();
+            return NULL;
+        }
+    }
+
+    //Find a free page in the same kind of memory, as close as possible to the page. Blocks which
+    //are as large as the window are left alone, otherwise compaction could go on forever.
+    for(int index = 0; (index < (lowmem ? 1 : highmem_zone_amount)) && !destination; ++index) {
+        RamZone& candidate = lowmem ? lowmem_zone : *(zone_fallback[zone.node][index]);
+        for(int order = 0; order < window_order; ++order) {
+            if(candidate.free_blocks[order]) {
+                destination = buddy_alloc(candidate, 0, false);
+                break;
             }
         }
+    }
+    if(!destination) {
+        if(owner_process) owner_process->mutex.release();
+        return NULL;
+    }
+
+    //Owners of the page must not write in it while it is copied, so it is write-protected in
+    //their address spaces first. Once the copy is done, their mappings are pointed to it.
+    if(!page_migrator(page, 0)) {
+        buddy_free(destination);
+        if(owner_process) owner_process->mutex.release();
+        return NULL;
+    }
+    copy_memory(destination->location, page->location, PG_SIZE);
+    if(!page_migrator(page, destination->location)) panic(PANIC_MIGRATION_FAILED);
+
+    //The page and the free map item then trade places, so that the page's owners still find it.
+    //Its record is moved to its new location in the owner's tree of owned chunks too.
+    swap_mapitems(page, destination);
+    RamManagerProcess* const lister = owner_process ? owner_process : locked;
+    lister->owned_chunks.remove(page->owned_item);
+    page->owned_item->location = page->location;
+    lister->owned_chunks.insert(page->owned_item);
+    if(owner_process) owner_process->mutex.release();
+
+    return destination;
+}
 
-        //Free former_pids, if it exists
-        if(former_pids) {
-            former_pids = new(former_pids) PIDs;
-            former_pids->next_item = free_pids;
-            free_pids = former_pids;
+
+bool RamManager::compact_window(const RamZone& zone,
+                                const size_t size,
+                                const size_t stride,
+                                size_t& location) {
+    //Windows are made of free memory and single pages which may be moved. Those which are free
+    //already are of no use, and among others the first one where the least pages must be moved
+    //is chosen. Only single-page chunks which a process lists as owned and has never shared are
+    //moved, since pages of shared chunks may be mapped as part of large pages, which the page
+    //migrator cannot find.
+    size_t window, end, covered, moves, best_moves = 0;
+    RamChunk* item;
+    bool result = false;
+
+    end = bitmap_frames*PG_SIZE;
+    if(end <= zone.location) return false;
+    if(end-zone.location > zone.ready_size) end = zone.location+zone.ready_size;
+    for(window = align_up(zone.location, stride); (window < end) && (end-window >= size); window+= stride) {
+        moves = 0;
+        covered = window;
+        item = map_index.find_containing(window);
+        while(item && (covered < window+size)) {
+            if(item->location > covered) break; //Hole in the memory map
+            if(!(item->in_free_list)) {
+                if(!(item->allocatable) || (item->size != PG_SIZE)) break;
+                if((item->owners.first_pid == PID_INVALID) || item->has_owner(PID_KERNEL)) break;
+                if(!(item->owned_item) || item->owned_item->shared) break;
+                if(item->owners.length() > 1) break;
+                ++moves;
+            }
+            covered = item->location+item->size;
+            item = item->next_mapitem;
         }
+        if((covered < window+size) || !moves) continue;
 
-        //Go to next item in the buddy list
-        current_chunk = current_chunk->next_buddy;
+        if(!result || (moves < best_moves)) {
+            location = window;
+            best_moves = moves;
+            result = true;
+        }
     }
 
-    //Update process memory usage
-    former_owner->memory_usage-= chunk->size;
+    return result;
+}
+
+
+bool RamManager::deferred_init(RamZone& zone) {
+    //Memory is given to the buddy allocator in batches, going up from the beginning of the zone.
+    //Nothing else than free memory which is waiting for this lies beyond the zone's ready size,
+    //but such memory may also come from the end of the previous zone.
+    RamChunk *item, *next_item;
+    size_t start, end;
+
+    if(deferring || (zone.ready_size == zone.size)) return false;
+    start = zone.location+zone.ready_size;
+    end = bitmap_frames*PG_SIZE;
+    if(start >= end) {
+        zone.ready_size = zone.size;
+        return false;
+    }
+    if(end-start > RAM_DEFERRED_BATCH) end = start+RAM_DEFERRED_BATCH;
+    if(end-zone.location > zone.size) end = zone.location+zone.size;
+
+    //Map items which are needed in the meantime must not come from another batch
+    deferring = true;
+
+        bitmap_mark(start, end-start, false);
+        item = map_index.find_containing(start);
+        if(!item) item = ram_map;
+        while(item && (item->location < end)) {
+            next_item = item->next_mapitem;
+            if((item->location+item->size > start) && item->allocatable && item->has_owner(PID_INVALID)) {
+                //Cut the parts of the item which lie outside of the batch
+                if((item->location < start) || (item->size > end-item->location)) {
+                    if(!free_mapitems && !alloc_mapitems()) {
+                        //Memory is so full that the map items required to cut this item must be
+                        //taken from the item itself.
+                        store_mapitems(item->location, PG_SIZE);
+                        split_chunk(item, PG_SIZE);
+                        item->owners = PID_KERNEL;
+                        find_process(PID_KERNEL)->memory_usage+= PG_SIZE;
+                        item = item->next_mapitem;
+                        continue;
+                    }
+                    if(item->location < start) {
+                        split_chunk(item, start-item->location);
+                        item = item->next_mapitem;
+                        continue;
+                    }
+                    split_chunk(item, end-item->location);
+                    next_item = item->next_mapitem;
+                }
+                buddy_free(item);
+            }
+            item = next_item;
+        }
+        zone.ready_size = end-zone.location;
 
-    //If chunk has no owners anymore, liberate it
-    if(chunk->has_owner(PID_INVALID)) chunk_liberator(chunk);
+    deferring = false;
 
     return true;
 }
 
 
 void RamManager::discard_empty_chunks() {
-    //This function removes empty chunks from the memory map, keeping buddy groups intact.
-    //Run as part of RamManager initialization, it makes the following assumptions :
-    //  1/There is only one group of buddies, made of free map items
-    //  2/This group is sorted in chronological order
+    //This function removes empty chunks from the memory map, then indexes the remaining ones by
+    //address. It is run as part of RamManager initialization, before free memory is given to the
+    //buddy allocator.
 
-    RamChunk *deleted_item, *last_buddy_owner = NULL, *previous_item;
+    RamChunk *deleted_item, *previous_item;
 
     while(ram_map && (ram_map->size == 0)) {
         //Remove empty chunks at the beginning of the memory map
         deleted_item = ram_map;
         ram_map = ram_map->next_mapitem;
+        ram_map->previous_mapitem = NULL;
 
         //Free up the extracted map item.
         deleted_item = new(deleted_item) RamChunk;
@@ -389,22 +849,12 @@ void RamManager::discard_empty_chunks() {
     previous_item = ram_map;
 
     while(previous_item->next_mapitem) {
-        //Update last_buddy_owner, keeping track of the last known-good chunk that has buddies
-        if(previous_item->next_buddy) {
-            last_buddy_owner = previous_item;
-        }
-
         //Remove all empty chunks immediately after previous_item
-        //RamChunk*& current_item = previous_item->next_mapitem;
         while((previous_item->next_mapitem) && (previous_item->next_mapitem->size == 0)) {
             //Take current item out of the memory map
             deleted_item = previous_item->next_mapitem;
-            previous_item->next_mapitem = previous_item->next_mapitem->next_mapitem;
-
-            //Take care of buddies
-            if(previous_item->next_mapitem == last_buddy_owner->next_buddy) {
-                last_buddy_owner->next_buddy = previous_item->next_mapitem->next_buddy;
-            }
+            previous_item->next_mapitem = deleted_item->next_mapitem;
+            if(previous_item->next_mapitem) previous_item->next_mapitem->previous_mapitem = previous_item;
 
             //Free up the extracted map item
             deleted_item = new(deleted_item) RamChunk;
@@ -415,44 +865,31 @@ void RamManager::discard_empty_chunks() {
         //Move to next map item
         if(previous_item->next_mapitem) previous_item = previous_item->next_mapitem;
     }
+
+    //Index the memory map
+    map_index.clear();
+    for(previous_item = ram_map; previous_item; previous_item = previous_item->next_mapitem) {
+        map_index.insert(previous_item);
+    }
 }
 
 void RamManager::fill_mmap(const KernelInformation& kinfo) {
     size_t index;
-    RamChunk *current_item, *last_free = NULL, *previous_item;
+    RamChunk *current_item, *previous_item;
 
     //Generate the first memory map item
     index = 0;
     ram_map = generate_chunk(kinfo, index);
     previous_item = ram_map;
 
-    //If it is free, add it to the free memory pool
-    if(ram_map->has_owner(PID_INVALID) && ram_map->allocatable) {
-        if(last_free) {
-            last_free->next_buddy = ram_map;
-        } else {
-            free_lowmem = ram_map;
-        }
-        last_free = ram_map;
-    }
-
     //Continue to fill the memory map
     while(index < kinfo.kmmap_length) {
         //Create and append a chunk associated to the next kmmap item(s)
         current_item = generate_chunk(kinfo, index);
         fix_overlap(previous_item, current_item);
         previous_item->next_mapitem = current_item;
-
-        //If the new chunk is free, add it to the free memory pool
-        if(current_item->has_owner(PID_INVALID) && current_item->allocatable) {
-            if(last_free) {
-                last_free->next_buddy = current_item;
-            } else {
-                free_lowmem = current_item;
-            }
-            last_free = current_item;
-        }
-        previous_item = previous_item->next_mapitem;
+        current_item->previous_mapitem = previous_item;
+        previous_item = current_item;
     }
 }
 
@@ -497,6 +934,38 @@ void RamManager::fix_overlap(RamChunk* first_chunk, RamChunk* second_chunk) {
 }
 
 
+int RamManager::fragmentation(const RamZone& zone, const int order) {
+    const size_t free_memory = zone.free_memory();
+
+    if(!free_memory) return 0;
+    return ((free_memory-zone.free_memory(order))*1000)/free_memory;
+}
+
+
+void RamManager::freelist_add(RamZone& zone, RamChunk* block, const int order) {
+    block->in_free_list = true;
+    block->previous_buddy = NULL;
+    block->next_buddy = zone.free_lists[order];
+    if(block->next_buddy) block->next_buddy->previous_buddy = block;
+    zone.free_lists[order] = block;
+    ++zone.free_blocks[order];
+}
+
+
+void RamManager::freelist_remove(RamZone& zone, RamChunk* block, const int order) {
+    if(block->previous_buddy) {
+        block->previous_buddy->next_buddy = block->next_buddy;
+    } else {
+        zone.free_lists[order] = block->next_buddy;
+    }
+    if(block->next_buddy) block->next_buddy->previous_buddy = block->previous_buddy;
+    --zone.free_blocks[order];
+    block->in_free_list = false;
+    block->previous_buddy = NULL;
+    block->next_buddy = NULL;
+}
+
+
 RamChunk* RamManager::generate_chunk(const KernelInformation& kinfo, size_t& index) {
     //Called during RamManager initialization, this function generates a RamChunk from a set
     //of kmmap items, using these rules :
@@ -537,6 +1006,34 @@ RamChunk* RamManager::generate_chunk(const KernelInformation& kinfo, size_t& ind
 }
 
 
+RamManagerProcess* RamManager::grab_process_attempt(const PID target) {
+    RamManagerProcess* result;
+
+    //Process mutexes are normally grabbed before mmap_mutex, so waiting for them here could
+    //deadlock. Callers must give mmap_mutex back and try again, or give up, on failure.
+    if(!proclist_mutex.grab_attempt()) return NULL;
+
+        result = find_process(target);
+        if(result && !result->mutex.grab_attempt()) result = NULL;
+
+    proclist_mutex.release();
+
+    return result;
+}
+
+
+RamChunk* RamManager::highmem_alloc(const uint32_t node, const int order, const bool honour_reserves) {
+    RamZone** zones = zone_fallback[node];
+    RamChunk* result = NULL;
+
+    for(int index = 0; (index < highmem_zone_amount) && !result; ++index) {
+        result = buddy_alloc(*(zones[index]), order, honour_reserves);
+    }
+
+    return result;
+}
+
+
 bool RamManager::initialize_process_list() {
     //This function generates the "process list", which at this point only includes a kernel entry
     static RamManagerProcess kernel_process;
@@ -556,49 +1053,484 @@ bool RamManager::initialize_process_list() {
 
 
 void RamManager::killer(RamManagerProcess* target) {
-    RamChunk* parser = ram_map;
+    RamChunk* parser;
+    size_t last_location;
+
+    //Chunks which the process has allocated are found in its tree of owned chunks. Since they are
+    //all freed at once, their pages go straight back to the buddy allocator.
+    while(target->owned_chunks.top()) chunk_ownerdel(target, target->owned_chunks.top()->chunk, false);
+    if(!(target->shared_chunks)) return;
 
+    //Chunks which have been shared with it are found by scanning the memory map
+    parser = ram_map;
     while(parser) {
-        if(parser->has_owner(target->identifier)) chunk_ownerdel(target, parser);
-        parser = parser->next_mapitem;
+        if(!parser->has_owner(target->identifier)) {
+            parser = parser->next_mapitem;
+            continue;
+        }
+
+        //Freeing a chunk may merge map items together, so after doing so we must find our way
+        //back in the memory map using its index. The process may own the chunk several times, so
+        //it is looked at again.
+        last_location = parser->location;
+        chunk_ownerdel(target, parser, false);
+        parser = map_index.find_containing(last_location);
     }
+    target->shared_chunks = 0;
 }
 
 
-void RamManager::merge_with_next(RamChunk* first_item) {
-    RamChunk* next_item = first_item->next_mapitem;
+RamChunk* RamManager::magazine_alloc(RamManagerProcess* owner) {
+    RamMagazine& magazine = local_magazine();
+    RamChunk* result = NULL;
 
-    //Merging assumes that the first item and his neighbour are really identical.
-    first_item->size+= next_item->size;
-    first_item->next_mapitem = next_item->next_mapitem;
-    first_item->next_buddy = next_item->next_buddy;
+    //Check if we can allocate the requested memory without busting caps
+    if(owner->memory_usage + PG_SIZE > owner->memory_cap) return NULL;
 
-    //Once done, trash "next_mapitem" in our free_mapitems reservoir.
-    next_item = new(next_item) RamChunk();
-    next_item->next_mapitem = free_mapitems;
-    free_mapitems = next_item;
-}
+    //Most of the time, a page can be taken from the magazine without touching the memory map
+    magazine.mutex.grab_spin();
 
+        ++magazine.allocations;
+        if(magazine.length) {
+            ++magazine.hits;
+            result = magazine.pages[--magazine.length];
+        }
 
-void RamManager::pids_liberator(PIDs& target) {
-    PIDs *to_delete = target.next_item, *following_one;
+    magazine.mutex.release();
 
-    while(to_delete) {
-        following_one = to_delete->next_item;
-        to_delete = new(to_delete) PIDs;
-        to_delete->next_item = free_pids;
-        free_pids = to_delete;
-        to_delete = following_one;
-    }
-    target.next_item = NULL;
-}
+    //If the magazine is empty, refill it from the buddy allocator
+    if(!result) {
+        mmap_mutex.grab_spin();
+        magazine.mutex.grab_spin();
 
+            if(!magazine.length) magazine_refill(magazine);
+            if(!magazine.length) {
+                magazine_reclaim(&magazine, RAM_MAGAZINE_BATCH*PG_SIZE);
+                magazine_refill(magazine);
+            }
+            if(magazine.length) result = magazine.pages[--magazine.length];
 
-bool RamManager::split_chunk(RamChunk* chunk, const size_t position) {
-    //This function splits a free memory chunk in two halves at a specified position
+        magazine.mutex.release();
+        mmap_mutex.release();
 
-    //Allocate a new memory chunk
-    if(!free_mapitems) {
+        if(!result) return NULL; //Memory is full
+    }
+
+    //Give the page to its owner
+    if(!magazine_give(owner, &result, 1)) return NULL;
+
+    return result;
+}
+
+
+bool RamManager::magazine_alloc_batch(RamManagerProcess* owner,
+                                      RamChunk** pages,
+                                      const size_t amount) {
+    //Check if we can allocate the requested memory without busting caps
+    if(owner->memory_usage + amount*PG_SIZE > owner->memory_cap) return false;
+
+    //Take the pages, then give them to their owner
+    if(!magazine_take_batch(pages, amount)) return false;
+    return magazine_give(owner, pages, amount);
+}
+
+
+void RamManager::magazine_drain(RamMagazine& magazine, const int amount) {
+    //The oldest pages, at the bottom of the magazine, go back to the buddy allocator...
+    for(int index = 0; index < amount; ++index) buddy_free(magazine.pages[index]);
+
+    //...and the remaining ones are moved down
+    for(int index = amount; index < magazine.length; ++index) {
+        magazine.pages[index-amount] = magazine.pages[index];
+    }
+    magazine.length-= amount;
+    ++magazine.drains;
+}
+
+
+void RamManager::magazine_free(RamChunk* page) {
+    RamMagazine& magazine = local_magazine();
+
+    //Pages from other NUMA nodes go straight back to the buddy allocator
+    if(find_zone(page->location).node != magazine.node) {
+        buddy_free(page);
+        return;
+    }
+
+    magazine.mutex.grab_spin();
+
+        if(magazine.length == RAM_MAGAZINE_SIZE) magazine_drain(magazine, RAM_MAGAZINE_BATCH);
+        magazine.pages[magazine.length++] = page;
+
+    magazine.mutex.release();
+}
+
+
+bool RamManager::magazine_give(RamManagerProcess* owner, RamChunk** pages, const size_t amount) {
+    RamOwnedItem *items, *item;
+
+    //The pages can only be given once there are records for all of them in the owner's list of
+    //owned chunks. Otherwise, they are freed.
+    items = owneditems_take(amount, false);
+    if(!items) {
+        for(size_t index = 0; index < amount; ++index) {
+            if(magazine_put(pages[index])) continue;
+            mmap_mutex.grab_spin();
+                magazine_free(pages[index]);
+            mmap_mutex.release();
+        }
+        return false;
+    }
+
+    //Pages which are taken from magazines are not known to anyone else, and the owner's list of
+    //owned chunks is protected by its mutex, so the memory map's mutex is not needed here
+    for(size_t index = 0; index < amount; ++index) {
+        item = items;
+        items = item->next_item;
+        pages[index]->next_buddy = NULL;
+        pages[index]->owners = owner->identifier;
+        owned_link(owner, pages[index], item);
+    }
+    owner->memory_usage+= amount*PG_SIZE;
+
+    return true;
+}
+
+
+bool RamManager::magazine_put(RamChunk* page) {
+    RamMagazine& magazine = local_magazine();
+    bool result = false;
+
+    //Pages from other NUMA nodes and full magazines need the buddy allocator
+    if(find_zone(page->location).node != magazine.node) return false;
+
+    magazine.mutex.grab_spin();
+
+        if(magazine.length < RAM_MAGAZINE_SIZE) {
+            magazine.pages[magazine.length++] = page;
+            result = true;
+        }
+
+    magazine.mutex.release();
+
+    return result;
+}
+
+
+size_t RamManager::magazine_reclaim(const RamMagazine* spared_magazine,
+                                    const size_t amount,
+                                    const RamZone* zone) {
+    size_t result = 0;
+
+    for(int cpu = 0; (cpu < RAM_MAGAZINE_CPUS) && (result < amount); ++cpu) {
+        RamMagazine& magazine = magazines[cpu];
+        if(&magazine == spared_magazine) continue;
+        if(zone && (zone->node != magazine.node)) continue; //Magazines only hold local pages
+        magazine.mutex.grab_spin();
+
+            if(!zone) {
+                result+= magazine.length*PG_SIZE;
+                if(magazine.length) magazine_drain(magazine, magazine.length);
+            } else {
+                //Only pages of the zone are given back, oldest first
+                int kept = 0;
+                for(int index = 0; index < magazine.length; ++index) {
+                    RamChunk* page = magazine.pages[index];
+                    if((result < amount) && (&find_zone(page->location) == zone)) {
+                        buddy_free(page);
+                        result+= PG_SIZE;
+                    } else {
+                        magazine.pages[kept++] = page;
+                    }
+                }
+                if(kept < magazine.length) ++magazine.drains;
+                magazine.length = kept;
+            }
+
+        magazine.mutex.release();
+    }
+
+    //Free memory may also be waiting in the pool of zeroed pages, which is more expensive to refill
+    zeroed_mutex.grab_spin();
+
+        RamChunk** link = &zeroed_pages;
+        while(*link && (result < amount)) {
+            RamChunk* page = *link;
+            if(zone && (&find_zone(page->location) != zone)) {
+                link = &(page->next_buddy);
+                continue;
+            }
+            *link = page->next_buddy;
+            page->next_buddy = NULL;
+            buddy_free(page);
+            result+= PG_SIZE;
+            --zeroed_amount;
+        }
+
+    zeroed_mutex.release();
+
+    return result;
+}
+
+
+void RamManager::magazine_refill(RamMagazine& magazine) {
+    RamChunk* page;
+
+    while(magazine.length < RAM_MAGAZINE_BATCH) {
+        page = highmem_alloc(magazine.node, 0, true);
+        if(!page && !magazine.length) page = highmem_alloc(magazine.node, 0, false);
+        if(!page) break;
+        magazine.pages[magazine.length++] = page;
+    }
+    ++magazine.refills;
+}
+
+
+bool RamManager::magazine_take_batch(RamChunk** pages, const size_t amount) {
+    RamMagazine& magazine = local_magazine();
+    size_t allocated = 0;
+
+    //Take as many pages as possible from the magazine...
+    magazine.mutex.grab_spin();
+
+        magazine.allocations+= amount;
+        while(magazine.length && (allocated < amount)) {
+            ++magazine.hits;
+            pages[allocated++] = magazine.pages[--magazine.length];
+        }
+
+    magazine.mutex.release();
+
+    //...and take the other ones from the buddy allocator, under a single lock acquisition
+    if(allocated < amount) {
+        mmap_mutex.grab_spin();
+
+            bool reclaimed = false;
+            while(allocated < amount) {
+                pages[allocated] = highmem_alloc(magazine.node, 0, true);
+                if(!pages[allocated]) pages[allocated] = highmem_alloc(magazine.node, 0, false);
+                if(pages[allocated]) {
+                    ++allocated;
+                    continue;
+                }
+
+                //Free memory may be stuck in the magazines of other CPUs. If it is not, memory is
+                //full, so give back the pages which have been taken and abort.
+                if(!reclaimed) {
+                    magazine_reclaim(&magazine, (amount-allocated)*PG_SIZE);
+                    reclaimed = true;
+                    continue;
+                }
+                for(size_t index = 0; index < allocated; ++index) buddy_free(pages[index]);
+                break;
+            }
+
+        mmap_mutex.release();
+
+        if(allocated < amount) return false;
+    }
+
+    return true;
+}
+
+
+void RamManager::merge_with_next(RamChunk* first_item) {
+    RamChunk* next_item = first_item->next_mapitem;
+
+    //Merging assumes that the first item and his neighbour are really identical.
+    first_item->size+= next_item->size;
+    first_item->next_mapitem = next_item->next_mapitem;
+    if(first_item->next_mapitem) first_item->next_mapitem->previous_mapitem = first_item;
+    first_item->next_buddy = next_item->next_buddy;
+    map_index.remove(next_item);
+
+    //Once done, trash "next_mapitem" in our free_mapitems reservoir.
+    next_item = new(next_item) RamChunk();
+    next_item->next_mapitem = free_mapitems;
+    free_mapitems = next_item;
+}
+
+
+void RamManager::owned_link(RamManagerProcess* owner, RamChunk* chunk, RamOwnedItem* item) {
+    item->location = chunk->location;
+    item->chunk = chunk;
+    item->list_owner = owner->identifier;
+    item->shared = false;
+    item->next_item = NULL;
+    owner->owned_chunks.insert(item);
+    chunk->owned_item = item;
+}
+
+
+void RamManager::owned_unlink(RamManagerProcess* owner, RamChunk* chunk) {
+    RamOwnedItem* const item = chunk->owned_item;
+
+    owner->owned_chunks.remove(item);
+    chunk->owned_item = NULL;
+    owneditems_liberator(item);
+}
+
+
+RamChunk* RamManager::owned_page(RamManagerProcess* owner, const size_t location) {
+    //Chunks which the process lists as owned and has never shared are only modified by holders
+    //of its mutex, so they may be looked up without taking mmap_mutex
+    const RamOwnedItem* const item = owner->owned_chunks.find(location);
+    if(!item || item->shared) return NULL;
+    RamChunk* const page = item->chunk;
+    if((page->size != PG_SIZE) || page->next_buddy) return NULL;
+
+    //Pages of low memory are left alone, since they don't go to magazines
+    if(&find_zone(location) == &lowmem_zone) return NULL;
+
+    return page;
+}
+
+
+RamOwnedItem* RamManager::owneditems_take(const size_t amount, const bool mmap_locked) {
+    RamOwnedItem *result = NULL, *item;
+    size_t taken = 0;
+    bool refilled;
+
+    //When the pool runs dry, it is refilled from the buddy allocator. This requires mmap_mutex,
+    //which comes first in the locking order, so the pool's mutex is given back meanwhile.
+    owneditems_mutex.grab_spin();
+
+        while(taken < amount) {
+            if(!free_owneditems) {
+                owneditems_mutex.release();
+                if(!mmap_locked) mmap_mutex.grab_spin();
+                    refilled = alloc_owneditems();
+                if(!mmap_locked) mmap_mutex.release();
+                owneditems_mutex.grab_spin();
+                if(!refilled) break;
+                continue;
+            }
+            item = free_owneditems;
+            free_owneditems = item->next_item;
+            item->next_item = result;
+            result = item;
+            ++taken;
+        }
+
+    owneditems_mutex.release();
+
+    //Memory is full
+    if(taken < amount) {
+        if(result) owneditems_liberator(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+
+void RamManager::owneditems_liberator(RamOwnedItem* items) {
+    RamOwnedItem* last_item = items;
+
+    while(last_item->next_item) last_item = last_item->next_item;
+    owneditems_mutex.grab_spin();
+
+        last_item->next_item = free_owneditems;
+        free_owneditems = items;
+
+    owneditems_mutex.release();
+}
+
+
+void RamManager::pidarray_liberator(PIDArray* target) {
+    const int size_class = target->size_class;
+
+    target = new(target) PIDArray(size_class);
+    target->next_item = free_pidarrays[size_class];
+    free_pidarrays[size_class] = target;
+}
+
+
+bool RamManager::pids_add(PIDs& target, const PID new_pid) {
+    //Chunks without an owner store it inline
+    if(target.first_pid == PID_INVALID) {
+        target.first_pid = new_pid;
+        return true;
+    }
+
+    //Other owners spill in a sorted array, which is moved to the next size class when it's full
+    PIDArray* array = target.others;
+    if(!array || (array->length == array->capacity())) {
+        const int size_class = array ? array->size_class+1 : 0;
+        if(size_class == PIDARRAY_CLASSES) return false; //Too many owners
+        if(!free_pidarrays[size_class]) {
+            if(!alloc_pidarrays(size_class)) return false; //Memory is full
+        }
+        PIDArray* new_array = free_pidarrays[size_class];
+        free_pidarrays[size_class] = new_array->next_item;
+        new_array->next_item = NULL;
+
+        if(array) {
+            for(size_t index = 0; index < array->length; ++index) {
+                new_array->pids()[index] = array->pids()[index];
+            }
+            new_array->length = array->length;
+            pidarray_liberator(array);
+        }
+        target.others = new_array;
+        array = new_array;
+    }
+
+    //Insert the new owner at its place in the array
+    const size_t position = array->lower_bound(new_pid);
+    for(size_t index = array->length; index > position; --index) {
+        array->pids()[index] = array->pids()[index-1];
+    }
+    array->pids()[position] = new_pid;
+    ++(array->length);
+
+    return true;
+}
+
+
+void RamManager::pids_liberator(PIDs& target) {
+    if(target.others) pidarray_liberator(target.others);
+    target.others = NULL;
+}
+
+
+bool RamManager::pids_remove(PIDs& target, const PID former_pid) {
+    PIDArray* array = target.others;
+
+    if(target.first_pid == former_pid) {
+        //The inline owner is replaced by the last owner of the array, if there's one
+        if(array) {
+            target.first_pid = array->pids()[--(array->length)];
+        } else {
+            target.first_pid = PID_INVALID;
+        }
+    } else {
+        //Other owners are removed from the array
+        if(!array) return false;
+        const size_t position = array->lower_bound(former_pid);
+        if((position == array->length) || (array->pids()[position] != former_pid)) return false;
+        --(array->length);
+        for(size_t index = position; index < array->length; ++index) {
+            array->pids()[index] = array->pids()[index+1];
+        }
+    }
+
+    //Empty arrays are given back
+    if(array && !(array->length)) {
+        pidarray_liberator(array);
+        target.others = NULL;
+    }
+
+    return true;
+}
+
+
+bool RamManager::split_chunk(RamChunk* chunk, const size_t position) {
+    //This function splits a memory chunk which has at most one owner in two halves at a
+    //specified position. If the chunk is part of a noncontiguous chunk, so are both halves.
+
+    //Allocate a new memory chunk
+    if(!free_mapitems) {
         if(!alloc_mapitems()) return false; //Memory is full
     }
     RamChunk* new_chunk = free_mapitems;
@@ -607,8 +1539,13 @@ bool RamManager::split_chunk(RamChunk* chunk, const size_t position) {
     //Give it the right properties
     new_chunk->location = chunk->location + position;
     new_chunk->size = chunk->size - position;
+    new_chunk->owners = chunk->owners.first_pid;
+    new_chunk->allocatable = chunk->allocatable;
     new_chunk->next_mapitem = chunk->next_mapitem;
+    new_chunk->previous_mapitem = chunk;
     new_chunk->next_buddy = chunk->next_buddy;
+    if(new_chunk->next_mapitem) new_chunk->next_mapitem->previous_mapitem = new_chunk;
+    map_index.insert(new_chunk);
 
     //Set up the new properties of the old chunk
     chunk->size = position;
@@ -619,6 +1556,116 @@ bool RamManager::split_chunk(RamChunk* chunk, const size_t position) {
 }
 
 
+void RamManager::store_mapitems(const size_t location, const size_t size) {
+    RamChunk* const first_item = (RamChunk*) frame_pointer(location);
+    RamChunk* current_item = first_item;
+
+    for(size_t used_mem = sizeof(RamChunk); used_mem <= size; used_mem+= sizeof(RamChunk)) {
+        current_item = new(current_item) RamChunk();
+        current_item->next_mapitem = current_item+1;
+        ++current_item;
+    }
+    --current_item;
+    current_item->next_mapitem = free_mapitems;
+    free_mapitems = first_item;
+}
+
+
+void RamManager::swap_mapitems(RamChunk* first, RamChunk* second) {
+    RamChunk *first_previous = first->previous_mapitem, *first_next = first->next_mapitem;
+    RamChunk *second_previous = second->previous_mapitem, *second_next = second->next_mapitem;
+    const size_t first_location = first->location;
+
+    map_index.remove(first);
+    map_index.remove(second);
+    first->location = second->location;
+    second->location = first_location;
+
+    //Each item takes the neighbours of the other, unless they are neighbours themselves
+    if(first_next == second) {
+        first_next = first;
+        second_previous = second;
+    } else if(second_next == first) {
+        second_next = second;
+        first_previous = first;
+    }
+    second->previous_mapitem = first_previous;
+    second->next_mapitem = first_next;
+    first->previous_mapitem = second_previous;
+    first->next_mapitem = second_next;
+
+    //Update the neighbours and the beginning of the map
+    if(second->previous_mapitem) {
+        second->previous_mapitem->next_mapitem = second;
+    } else {
+        ram_map = second;
+    }
+    if(second->next_mapitem) second->next_mapitem->previous_mapitem = second;
+    if(first->previous_mapitem) {
+        first->previous_mapitem->next_mapitem = first;
+    } else {
+        ram_map = first;
+    }
+    if(first->next_mapitem) first->next_mapitem->previous_mapitem = first;
+    if(highmem_map == first) {
+        highmem_map = second;
+    } else if(highmem_map == second) {
+        highmem_map = first;
+    }
+
+    map_index.insert(first);
+    map_index.insert(second);
+}
+
+
+bool RamManager::zeroed_alloc_batch(RamManagerProcess* owner,
+                                    RamChunk** pages,
+                                    const size_t amount) {
+    size_t taken = 0;
+
+    //Check if we can allocate the requested memory without busting caps
+    if(owner->memory_usage + amount*PG_SIZE > owner->memory_cap) return false;
+
+    //Take as many pages as possible from the pool of zeroed pages...
+    zeroed_mutex.grab_spin();
+
+        while(zeroed_pages && (taken < amount)) {
+            pages[taken++] = zeroed_pages;
+            zeroed_pages = zeroed_pages->next_buddy;
+        }
+        zeroed_amount-= taken;
+
+    zeroed_mutex.release();
+
+    //...then take the other ones as usual, and zero them on the spot
+    if(taken < amount) {
+        if(!magazine_take_batch(pages+taken, amount-taken)) {
+            zeroed_insert(pages, taken);
+            return false;
+        }
+        for(size_t index = taken; index < amount; ++index) {
+            zero_memory(pages[index]->location, PG_SIZE, false);
+        }
+    }
+
+    //Give all the pages to their owner
+    return magazine_give(owner, pages, amount);
+}
+
+
+void RamManager::zeroed_insert(RamChunk** pages, const size_t amount) {
+    zeroed_mutex.grab_spin();
+
+        for(size_t index = 0; index < amount; ++index) {
+            pages[index]->next_buddy = zeroed_pages;
+            zeroed_pages = pages[index];
+        }
+        zeroed_amount+= amount;
+
+    zeroed_mutex.release();
+}
+
+
 bool RamManager::init_process(ProcessManager& procman) {
     //Initialize process management-related functionality here
     process_manager = &procman;
@@ -661,7 +1708,10 @@ void RamManager::remove_process(PID target) {
 }
 
 
-RamChunk* RamManager::alloc_chunk(const PID owner, const size_t size, bool contiguous) {
+RamChunk* RamManager::alloc_chunk(const PID owner,
+                                  const size_t size,
+                                  bool contiguous,
+                                  const RamAllocFlags flags) {
     RamChunk* result;
     RamManagerProcess* process;
 
@@ -677,15 +1727,60 @@ RamChunk* RamManager::alloc_chunk(const PID owner, const size_t size, bool conti
     process->mutex.grab_spin();
     proclist_mutex.release();
 
-        mmap_mutex.grab_spin();
+        if((align_pgup(size) == PG_SIZE) && !(flags & ~RAM_ALLOC_ZEROED)) {
+            //Single pages are taken from the current CPU's magazine, or from the pool of zeroed
+            //pages if zeroing is requested
+            if(flags & RAM_ALLOC_ZEROED) {
+                if(!zeroed_alloc_batch(process, &result, 1)) result = NULL;
+            } else {
+                result = magazine_alloc(process);
+            }
+        } else {
+            mmap_mutex.grab_spin();
+
+                //Allocate a chunk of memory, as close as possible to the current CPU
+                result = chunk_allocator(process,
+                                         align_pgup(size),
+                                         zone_fallback[local_node()],
+                                         highmem_zone_amount,
+                                         contiguous,
+                                         flags);
+
+            mmap_mutex.release();
+
+            //Larger chunks are zeroed on the spot if requested
+            if(flags & RAM_ALLOC_ZEROED) {
+                for(RamChunk* piece = result; piece; piece = piece->next_buddy) {
+                    zero_memory(piece->location, piece->size, false);
+                }
+            }
+        }
+
+    process->mutex.release();
+
+    return result;
+}
 
-            //Allocate a chunk of memory
-            result = chunk_allocator(process,
-                                     align_pgup(size),
-                                     free_mem,
-                                     contiguous);
 
-        mmap_mutex.release();
+RamChunk* RamManager::alloc_copy(const PID owner, const size_t source) {
+    RamChunk* result;
+    RamManagerProcess* process;
+
+    proclist_mutex.grab_spin();
+
+        //Find the RamManagerProcess associated to the requested PID
+        process = find_process(owner);
+        if(!process) {
+            proclist_mutex.release();
+            return NULL;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+        //Take a page from the current CPU's magazine, then fill it
+        result = magazine_alloc(process);
+        if(result) copy_memory(result->location, align_pgdown(source), PG_SIZE);
 
     process->mutex.release();
 
@@ -696,7 +1791,9 @@ RamChunk* RamManager::alloc_chunk(const PID owner, const size_t size, bool conti
 bool RamManager::share_chunk(const PID new_owner,
                               size_t chunk_beginning) {
     bool result;
-    RamManagerProcess* process;
+    RamManagerProcess *process, *list_owner = NULL;
+    RamChunk* chunk;
+    PID lister;
 
     proclist_mutex.grab_spin();
 
@@ -710,19 +1807,30 @@ bool RamManager::share_chunk(const PID new_owner,
     process->mutex.grab_spin();
     proclist_mutex.release();
 
-        mmap_mutex.grab_spin();
-
-            //Find the chunk that is to be shared
-            RamChunk* chunk = ram_map->find_thischunk(chunk_beginning);
-            if(!chunk) {
-                mmap_mutex.release();
-                return false;
+        //Find the chunk that is to be shared. If it has never been shared, the mutex of the
+        //process which lists it as owned must be held too (see owned_page). Since this is out of
+        //the usual locking order, mmap_mutex is given back until it can be grabbed.
+        while(true) {
+            mmap_mutex.grab_spin();
+            chunk = map_index.find(chunk_beginning);
+            if(!chunk || !(chunk->owned_item) || chunk->owned_item->shared) break;
+            lister = chunk->owned_item->list_owner;
+            if(lister == new_owner) break;
+            list_owner = grab_process_attempt(lister);
+            if(list_owner) {
+                //The chunk may have been freed before the mutex was grabbed
+                if(chunk->owned_item && (chunk->owned_item->list_owner == lister)) break;
+                list_owner->mutex.release();
+                list_owner = NULL;
             }
+            mmap_mutex.release();
+        }
 
             //Share the chunk with its new owner
-            result = chunk_owneradd(process, chunk);
+            result = chunk && chunk_owneradd(process, chunk);
 
         mmap_mutex.release();
+        if(list_owner) list_owner->mutex.release();
 
     process->mutex.release();
 
@@ -731,8 +1839,16 @@ bool RamManager::share_chunk(const PID new_owner,
 
 bool RamManager::free_chunk(const PID former_owner,
                                size_t chunk_beginning) {
+    //This is a batch of one chunk
+    return free_chunk_batch(former_owner, &chunk_beginning, 1);
+}
+
+
+bool RamManager::unshare_page(const PID former_owner,
+                              const size_t location) {
     bool result;
     RamManagerProcess* process;
+    const size_t page = align_pgdown(location);
 
     proclist_mutex.grab_spin();
 
@@ -748,15 +1864,25 @@ bool RamManager::free_chunk(const PID former_owner,
 
         mmap_mutex.grab_spin();
 
-            //Find the chunk that is to be shared
-            RamChunk* chunk = ram_map->find_thischunk(chunk_beginning);
-            if(!chunk) {
-                mmap_mutex.release();
-                return false;
+            //Find the piece of chunk which holds the page. Only pages which other processes keep
+            //sharing may be given up.
+            RamChunk* piece = map_index.find_containing(page);
+            result = piece && (piece->location+piece->size > page);
+            result = result && (piece->owners.length() > 1) && piece->has_owner(former_owner);
+
+            //Make the page a piece of its own, so that it may have its own owners...
+            if(result && (piece->location < page)) {
+                result = chunk_split(piece, page-piece->location);
+                piece = piece->next_mapitem;
             }
+            if(result && (piece->size > PG_SIZE)) result = chunk_split(piece, PG_SIZE);
 
-            //Free the chunk
-            result = chunk_ownerdel(process, chunk);
+            //...then remove the process from them. The page is freed along with the rest of the
+            //chunk, once it has no owners anymore.
+            if(result) {
+                pids_remove(piece->owners, former_owner);
+                process->memory_usage-= PG_SIZE;
+            }
 
         mmap_mutex.release();
 
@@ -766,6 +1892,196 @@ bool RamManager::free_chunk(const PID former_owner,
 }
 
 
+bool RamManager::alloc_chunk_batch(const PID owner,
+                                   RamChunk** pages,
+                                   const size_t amount,
+                                   const RamAllocFlags flags) {
+    bool result;
+    RamManagerProcess* process;
+
+    proclist_mutex.grab_spin();
+
+        //Find the RamManagerProcess associated to the requested PID
+        process = find_process(owner);
+        if(!process) {
+            proclist_mutex.release();
+            return false;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+        //Allocate the pages, taking as few locks as possible
+        if(flags & RAM_ALLOC_ZEROED) {
+            result = zeroed_alloc_batch(process, pages, amount);
+        } else {
+            result = magazine_alloc_batch(process, pages, amount);
+        }
+
+    process->mutex.release();
+
+    return result;
+}
+
+
+bool RamManager::free_chunk_batch(const PID former_owner,
+                                  const size_t* chunk_beginnings,
+                                  const size_t amount) {
+    bool result = true;
+    RamManagerProcess* process;
+
+    proclist_mutex.grab_spin();
+
+        //Find the RamManagerProcess associated to the requested PID
+        process = find_process(former_owner);
+        if(!process) {
+            proclist_mutex.release();
+            return false;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+        //Free all chunks, carrying on if some of them cannot be found. Single pages which only
+        //this process owns go to the current CPU's magazine without taking mmap_mutex, which is
+        //only taken once for the other chunks, if any.
+        bool mmap_locked = false;
+        for(size_t index = 0; index < amount; ++index) {
+            RamChunk* page = owned_page(process, chunk_beginnings[index]);
+            if(page) {
+                owned_unlink(process, page);
+                page->owners = PID_INVALID;
+                process->memory_usage-= PG_SIZE;
+                if(magazine_put(page)) continue;
+            }
+
+            if(!mmap_locked) {
+                mmap_mutex.grab_spin();
+                mmap_locked = true;
+            }
+            if(page) {
+                magazine_free(page);
+                continue;
+            }
+            RamChunk* chunk = map_index.find(chunk_beginnings[index]);
+            if(!chunk || !chunk_ownerdel(process, chunk)) result = false;
+        }
+        if(mmap_locked) mmap_mutex.release();
+
+    process->mutex.release();
+
+    return result;
+}
+
+
+size_t RamManager::shrink(const size_t amount) {
+    size_t result;
+
+    //Memory held in per-CPU magazines and the pool of zeroed pages goes back to the buddy allocator
+    mmap_mutex.grab_spin();
+
+        result = magazine_reclaim(NULL, amount);
+
+    mmap_mutex.release();
+
+    return result;
+}
+
+
+void RamManager::set_page_migrator(bool (*migrator)(const RamChunk* page, const size_t new_location)) {
+    mmap_mutex.grab_spin();
+
+        page_migrator = migrator;
+
+    mmap_mutex.release();
+}
+
+
+int RamManager::fragmentation_index(const int order) {
+    size_t free_memory = 0, usable_memory = 0;
+
+    mmap_mutex.grab_spin();
+
+        for(int index = 0; index < highmem_zone_amount; ++index) {
+            free_memory+= highmem_zones[index].free_memory();
+            usable_memory+= highmem_zones[index].free_memory(order);
+        }
+
+    mmap_mutex.release();
+
+    if(!free_memory) return 0;
+    return ((free_memory-usable_memory)*1000)/free_memory;
+}
+
+
+bool RamManager::init_deferred_memory() {
+    bool result = false;
+
+    mmap_mutex.grab_spin();
+
+        for(int index = 0; (index < highmem_zone_amount) && !result; ++index) {
+            result = deferred_init(highmem_zones[index]);
+        }
+
+    mmap_mutex.release();
+
+    return result;
+}
+
+
+bool RamManager::compact_memory() {
+    bool result = false;
+
+    //Zones where free memory is too fragmented for 2MB allocations are compacted, one window at
+    //a time
+    mmap_mutex.grab_spin();
+
+        for(int index = 0; (index < highmem_zone_amount) && !result; ++index) {
+            RamZone& zone = highmem_zones[index];
+            if(fragmentation(zone, RAM_ORDER_2M) < RAM_COMPACT_THRESHOLD) continue;
+            result = compact(zone, buddy_size(RAM_ORDER_2M), buddy_size(RAM_ORDER_2M), NULL);
+        }
+
+    mmap_mutex.release();
+
+    return result;
+}
+
+
+bool RamManager::zero_free_pages() {
+    RamChunk* pages[RAM_ZEROED_BATCH];
+    int amount = 0;
+
+    //Check if the pool of zeroed pages needs refilling
+    zeroed_mutex.grab_spin();
+
+        const bool pool_full = (zeroed_amount >= RAM_ZEROED_POOL);
+
+    zeroed_mutex.release();
+    if(pool_full) return false;
+
+    //Take some free pages, as close as possible to the current CPU. Reserves of large blocks are
+    //left alone, since memory would then be zeroed for nothing.
+    mmap_mutex.grab_spin();
+
+        const uint32_t node = local_node();
+        while(amount < RAM_ZEROED_BATCH) {
+            pages[amount] = highmem_alloc(node, 0, true);
+            if(!pages[amount]) break;
+            ++amount;
+        }
+
+    mmap_mutex.release();
+    if(!amount) return false;
+
+    //Zero them without holding any lock, then put them in the pool
+    for(int index = 0; index < amount; ++index) zero_memory(pages[index]->location, PG_SIZE, true);
+    zeroed_insert(pages, amount);
+
+    return true;
+}
+
+
 void RamManager::print_mmap() {
     mmap_mutex.grab_spin();
 
@@ -774,6 +2090,33 @@ void RamManager::print_mmap() {
     mmap_mutex.release();
 }
 
+void RamManager::print_magazines() {
+    for(int cpu = 0; cpu < RAM_MAGAZINE_CPUS; ++cpu) {
+        RamMagazine& magazine = magazines[cpu];
+        if(!magazine.allocations && !magazine.drains) continue;
+
+        magazine.mutex.grab_spin();
+
+            dbgout << "CPU " << cpu << " : " << magazine.length << " pages, ";
+            dbgout << magazine.hits << "/" << magazine.allocations << " hits, ";
+            dbgout << magazine.refills << " refills, " << magazine.drains << " drains" << endl;
+
+        magazine.mutex.release();
+    }
+}
+
+void RamManager::print_fragmentation() {
+    mmap_mutex.grab_spin();
+
+        for(int index = 0; index < highmem_zone_amount; ++index) {
+            const RamZone& zone = highmem_zones[index];
+            dbgout << "Zone " << index << " (node " << zone.node << ") : fragmentation index ";
+            dbgout << fragmentation(zone, RAM_ORDER_2M) << "/1000 for 2MB blocks" << endl;
+        }
+
+    mmap_mutex.release();
+}
+
 void RamManager::print_proclist() {
     proclist_mutex.grab_spin();
 
@@ -798,6 +2141,14 @@ void ram_manager_remove_process(PID target) {
     }
 }
 
+size_t ram_manager_shrink(const size_t amount) {
+    if(!ram_manager) {
+        return 0;
+    } else {
+        return ram_manager->shrink(amount);
+    }
+}
+
 /*PID ram_manager_update_process(PID old_process, PID new_process) {
     if(!ram_manager) {
         return PID_INVALID;
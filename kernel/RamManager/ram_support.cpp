@@ -19,56 +19,61 @@
 #include <ram_support.h>
 
 
-bool PIDs::has_pid(const PID& the_pid) const {
-    PIDs* parser = (PIDs*) this;
-
-    while(parser) {
-        if(parser->current_pid == the_pid) return true;
-        parser = parser->next_item;
+size_t PIDArray::lower_bound(const PID& the_pid) const {
+    //Binary search in the sorted array
+    size_t first = 0, last = length;
+
+    while(first < last) {
+        const size_t middle = first + (last-first)/2;
+        if(pids()[middle] < the_pid) {
+            first = middle+1;
+        } else {
+            last = middle;
+        }
     }
+    return first;
+}
+
+bool PIDArray::has_pid(const PID& the_pid) const {
+    const size_t index = lower_bound(the_pid);
+
+    return (index < length) && (pids()[index] == the_pid);
+}
+
+bool PIDs::has_pid(const PID& the_pid) const {
+    if(first_pid == the_pid) return true;
+    if(others) return others->has_pid(the_pid);
     return false;
 }
 
 size_t PIDs::length() const {
-    PIDs* parser = (PIDs*) this;
-    size_t result;
-
-    for(result = 0; parser; ++result, parser = parser->next_item);
-    return result;
+    if(first_pid == PID_INVALID) return 0;
+    if(others) return 1+others->length;
+    return 1;
 }
 
 PIDs& PIDs::operator=(const PID& param) {
-    current_pid = param;
+    first_pid = param;
 
     return *this;
 }
 
 
-bool PIDs::operator==(const PIDs& param) const {
-    PIDs *source, *dest;
-    //This function compares two lists of PIDs, checking if each element of one is in the other.
-    //(The algorithm is O(N^2), but sharing should not often occur between more than ~10 processes)
-
-    source = (PIDs*) this;
-    while(source) {
-        dest = (PIDs*) &param;
-        while(dest) {
-            if(dest->current_pid == source->current_pid) break;
-            dest = dest->next_item;
-        }
-        if(!dest) return false;
-        source = source->next_item;
-    }
+PID PIDs::operator[](const size_t index) const {
+    if(index) return others->pids()[index-1];
+    return first_pid;
+}
+
 
-    source = (PIDs*) &param;
-    while(source) {
-        dest = (PIDs*) this;
-        while(dest) {
-            if(dest->current_pid == source->current_pid) break;
-            dest = dest->next_item;
+bool PIDs::operator==(const PIDs& param) const {
+    //This function compares two sets of PIDs, checking if they are of the same size and if each
+    //element of one is in the other.
+    if(length() != param.length()) return false;
+    if(!param.has_pid(first_pid)) return false;
+    if(others) {
+        for(size_t index = 0; index < others->length; ++index) {
+            if(!param.has_pid(others->pids()[index])) return false;
         }
-        if(!dest) return false;
-        source = source->next_item;
     }
 
     return true;
@@ -151,6 +156,35 @@ bool RamChunk::operator==(const RamChunk& param) const {
     if(allocatable != param.allocatable) return false;
     if(next_buddy != param.next_buddy) return false;
     if(next_mapitem != param.next_mapitem) return false;
+    if(previous_mapitem != param.previous_mapitem) return false;
+    if(previous_buddy != param.previous_buddy) return false;
+    if(in_free_list != param.in_free_list) return false;
 
     return true;
 }
+
+bool RamZone::breaks_reserves(const int block_order, const int request_order) const {
+    if((block_order >= RAM_ORDER_1G) && (request_order < RAM_ORDER_1G)) {
+        if(free_blocks[RAM_ORDER_1G] <= RAM_RESERVE_1G) return true;
+    }
+
+    if((block_order >= RAM_ORDER_2M) && (request_order < RAM_ORDER_2M)) {
+        size_t free_2m_blocks = 0;
+        for(int order = RAM_ORDER_2M; order < RAM_BUDDY_ORDERS; ++order) {
+            free_2m_blocks+= free_blocks[order] << (order-RAM_ORDER_2M);
+        }
+        if(free_2m_blocks <= RAM_RESERVE_2M) return true;
+    }
+
+    return false;
+}
+
+size_t RamZone::free_memory(const int min_order) const {
+    size_t result = 0;
+
+    for(int order = min_order; order < RAM_BUDDY_ORDERS; ++order) {
+        result+= free_blocks[order]*buddy_size(order);
+    }
+
+    return result;
+}
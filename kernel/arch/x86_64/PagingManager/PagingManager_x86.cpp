@@ -20,6 +20,8 @@
 #include <kmath.h>
 #include <new.h>
 #include <PagingManager.h>
+#include <panic.h>
+#include <x86asm.h>
 #include <x86paging.h>
 #include <x86paging_parser.h>
 
@@ -29,10 +31,36 @@
 
 PagingManager* paging_manager = NULL;
 
+void PagingManager::alloc_pcid(PagingManagerProcess* target) {
+    PagingManagerProcess *process_parser, *victim = NULL;
+    size_t index;
+
+    //Look for a free PCID first
+    for(index = 0; index < x86paging::PCID_AMOUNT/64; ++index) {
+        if(~pcid_bitmap[index]) break;
+    }
+    if(index < x86paging::PCID_AMOUNT/64) {
+        target->pcid = index*64 + __builtin_ctzll(~pcid_bitmap[index]);
+        pcid_bitmap[index]|= ((uint64_t) 1) << (target->pcid%64);
+    } else {
+        //If there is none, take the PCID of the process which was switched to least recently. The
+        //kernel keeps PCID 0, so all others are owned by processes other than the target.
+        for(process_parser = process_list->next_item; process_parser; process_parser = process_parser->next_item) {
+            if(!(process_parser->pcid)) continue;
+            if(!victim || (process_parser->pcid_stamp < victim->pcid_stamp)) victim = process_parser;
+        }
+        target->pcid = victim->pcid;
+        victim->pcid = 0;
+    }
+
+    //The TLB may still hold entries of the PCID's previous owner
+    target->tlb_stale = true;
+}
+
 PageChunk* PagingManager::chunk_mapper_contig(PagingManagerProcess* target,
                                                 const RamChunk* ram_chunk,
                                                 const PageFlags flags) {
-    size_t total_size, offset, tmp;
+    size_t total_size, offset, alignment, tmp;
     RamChunk *chunk_parser;
     PageChunk *result;
 
@@ -44,34 +72,38 @@ PageChunk* PagingManager::chunk_mapper_contig(PagingManagerProcess* target,
         chunk_parser = chunk_parser->next_buddy;
     }
 
-    //Allocate a contiguous chunk of virtual address space to map our RAM chunk
-    result = alloc_virtual_address_space(target, total_size);
+    //Allocate a contiguous chunk of virtual address space to map our RAM chunk. Large chunks are
+    //aligned like large pages, so that those may be used to map them.
+    alignment = PG_SIZE;
+    if(total_size >= 0x200000) alignment = 0x200000;
+    if((total_size >= 0x40000000) && x86paging::has_1gpages()) alignment = 0x40000000;
+    result = alloc_virtual_address_space(target, total_size, NULL, alignment);
     if(!result) return NULL;
 
     //Finish setting up the allocated chunk
     result->flags = flags;
     result->points_to = (RamChunk*) ram_chunk;
 
-    //Allocate paging structures. For pages with the K flag enabled, also identity-map them.
-    //If allocation fails, don't forget to restore the map into a clean state before returning NULL.
-    tmp = x86paging::setup_4kpages(result->location,
-                                   result->size,
-                                   target->pml4t_location,
-                                   ram_manager);
-    if(!tmp) {
-        chunk_liberator(target, result);
-        return NULL;
-    }
-
-    //Fill those structures which we just allocated
+    //Allocate paging structures, then fill them, one part of the RAM chunk at a time since large
+    //pages may only be used where physical memory is suitably aligned. If allocation fails, don't
+    //forget to restore the map into a clean state before returning NULL.
     chunk_parser = (RamChunk*) ram_chunk;
     offset = 0;
     while(chunk_parser) {
-        x86paging::fill_4kpaging(chunk_parser->location,
-                                 result->location+offset,
-                                 chunk_parser->size,
-                                 x86flags(result->flags),
-                                 target->pml4t_location);
+        tmp = x86paging::setup_paging(chunk_parser->location,
+                                      result->location+offset,
+                                      chunk_parser->size,
+                                      target->pml4t_location,
+                                      &ptable_cache);
+        if(!tmp) {
+            chunk_liberator(target, result);
+            return NULL;
+        }
+        x86paging::fill_paging(chunk_parser->location,
+                               result->location+offset,
+                               chunk_parser->size,
+                               x86flags(result->flags),
+                               target->pml4t_location);
         offset+= chunk_parser->size;
         chunk_parser = chunk_parser->next_buddy;
     }
@@ -104,22 +136,45 @@ PageChunk* PagingManager::chunk_mapper_identity(PagingManagerProcess* target,
         current_pagechunk->flags = flags;
         current_pagechunk->points_to = chunk_parser;
 
-        //Allocate paging structures. For pages with the K flag enabled, also identity-map them.
-        tmp = x86paging::setup_4kpages(current_pagechunk->location,
-                                       current_pagechunk->size,
-                                       target->pml4t_location,
-                                       ram_manager);
+        //Allocate paging structures
+        tmp = x86paging::setup_paging(chunk_parser->location,
+                                      current_pagechunk->location,
+                                      current_pagechunk->size,
+                                      target->pml4t_location,
+                                      &ptable_cache);
         if(!tmp) {
             chunk_liberator(target, result);
             return NULL;
         }
 
         //Fill those structures which we just allocated
-        x86paging::fill_4kpaging(chunk_parser->location,
-                                 current_pagechunk->location,
-                                 chunk_parser->size,
-                                 x86flags(current_pagechunk->flags),
-                                 target->pml4t_location);
+        x86paging::fill_paging(chunk_parser->location,
+                               current_pagechunk->location,
+                               chunk_parser->size,
+                               x86flags(current_pagechunk->flags),
+                               target->pml4t_location);
+
+        //The kernel's K pages are also mapped in the kernel half which all address spaces share
+        if((target == process_list) && (flags & PAGE_FLAG_K)) {
+            if(current_pagechunk->location+current_pagechunk->size > x86paging::KERNEL_SPACE_END) {
+                tmp = 0;
+            } else {
+                tmp = x86paging::setup_paging(chunk_parser->location,
+                                              current_pagechunk->location,
+                                              current_pagechunk->size,
+                                              kernel_half,
+                                              &ptable_cache);
+            }
+            if(!tmp) {
+                chunk_liberator(target, result);
+                return NULL;
+            }
+            x86paging::fill_paging(chunk_parser->location,
+                                   current_pagechunk->location,
+                                   chunk_parser->size,
+                                   x86flags(current_pagechunk->flags),
+                                   kernel_half);
+        }
 
         //Go to next part of the RAM chunk
         chunk_parser = chunk_parser->next_buddy;
@@ -130,41 +185,38 @@ PageChunk* PagingManager::chunk_mapper_identity(PagingManagerProcess* target,
 
 bool PagingManager::chunk_liberator(PagingManagerProcess* target,
                                     PageChunk* chunk) {
-    PageChunk *current_mapitem, *current_item = chunk, *next_item;
+    PageChunk *current_item = chunk, *next_item;
+    x86paging::TlbBatch tlb_batch;
 
     //First, manage K pages : non-kernel processes cannot get rid of them, and if they
     //are ditched by the kernel they are ditched by all other processes too.
     if(chunk->flags & PAGE_FLAG_K) {
-        if(target->identifier != PID_KERNEL) {
-            if(target->may_free_kpages==0) return false;
-        } else {
-            unmap_k_chunk(chunk);
-        }
+        if(target->identifier != PID_KERNEL) return false;
+        unmap_k_chunk(chunk);
     }
 
     //Remove item from the map
     while(current_item) {
         next_item = current_item->next_buddy;
 
-        if(target->map_pointer == current_item) {
-            target->map_pointer = current_item->next_mapitem;
-        } else {
-            current_mapitem = target->map_pointer;
-            while(current_mapitem->next_mapitem) {
-                if(current_mapitem->next_mapitem == current_item) break;
-                current_mapitem = current_mapitem->next_mapitem;
-            }
-            if(current_mapitem->next_mapitem) {
-                current_mapitem->next_mapitem = current_mapitem->next_mapitem->next_mapitem;
-            }
-        }
+        map_remove(target, current_item);
 
-        //Manage impact on paging structures : delete page table entries, liberate unused paging
+        //Manage impact on paging structures : give memory which was allocated on demand or
+        //copied on write back to RamManager, delete page table entries, liberate unused paging
         //structures...
+        if(!(current_item->points_to) || (current_item->flags & PAGE_FLAG_C)) {
+            x86paging::release_frames(current_item->location,
+                                      current_item->size,
+                                      target->pml4t_location,
+                                      ram_manager,
+                                      target->identifier,
+                                      current_item->points_to);
+        }
         x86paging::remove_paging(current_item->location,
                                  current_item->size,
                                  target->pml4t_location,
-                                 ram_manager);
+                                 &ptable_cache,
+                                 tlb_batch);
 
         //Remove the rest
         current_item = new(current_item) PageChunk();
@@ -173,6 +225,9 @@ bool PagingManager::chunk_liberator(PagingManagerProcess* target,
         current_item = next_item;
     }
 
+    //Flush the removed translations from the TLB, all at once
+    tlb_flush(target, tlb_batch);
+
     return true;
 }
 
@@ -181,6 +236,8 @@ PageChunk* PagingManager::flag_adjust(PagingManagerProcess* target,
                                 const PageFlags flags,
                                 const PageFlags mask) {
     PageChunk* current_item;
+    x86paging::TlbBatch tlb_batch;
+    bool result = true;
 
     //Only the kernel may alter the status of K pages, and the only use case which is taken into
     //account for now is the loss of the K flag.
@@ -192,19 +249,64 @@ PageChunk* PagingManager::flag_adjust(PagingManagerProcess* target,
     //Adjust flags of the chunk itself
     chunk->flags = (flags & mask)+((chunk->flags) & (~mask));
 
-    //Adjust those flags in paging structures, too.
+    //Adjust those flags in paging structures, too, including the shared kernel half for K pages.
+    //Large pages may have to be split in the process, which fails if memory is full. Translations
+    //which have been modified until then must be flushed from the TLB either way.
     current_item = chunk;
     do {
-        x86paging::set_flags(current_item->location,
-                             current_item->size,
-                             x86flags(current_item->flags),
-                             target->pml4t_location);
+        result = x86paging::set_flags(current_item->location,
+                                      current_item->size,
+                                      x86flags(current_item->flags),
+                                      target->pml4t_location,
+                                      &ptable_cache,
+                                      tlb_batch);
+        if(result && (current_item->flags & PAGE_FLAG_K)) {
+            result = x86paging::set_flags(current_item->location,
+                                          current_item->size,
+                                          x86flags(current_item->flags),
+                                          kernel_half,
+                                          &ptable_cache,
+                                          tlb_batch);
+        }
         current_item = current_item->next_buddy;
-    } while(current_item);
+    } while(result && current_item);
+    tlb_flush(target, tlb_batch);
 
+    if(!result) return NULL;
     return chunk;
 }
 
+void PagingManager::free_pcid(PagingManagerProcess* target) {
+    if(!(target->pcid)) return;
+    pcid_bitmap[target->pcid/64]&= ~(((uint64_t) 1) << (target->pcid%64));
+    target->pcid = 0;
+}
+
+uint64_t PagingManager::lookup_page(PagingManagerProcess* target, const size_t vir_page) {
+    using namespace x86paging;
+
+    //Look the translation up in the cache first, then in paging structures. Only present pages of
+    //the process' own part of the address space are cached : those of the shared kernel half may
+    //be modified without its cache being flushed, and absent pages are mapped without a flush.
+    TranslationCache& tcache = target->tcache;
+    const int slot = tcache.slot(vir_page);
+    if(vir_page && (tcache.vir_pages[slot] == vir_page)) {
+        ++tcache.hits;
+        return tcache.phy_pages[slot]+tcache.flags[slot];
+    }
+    ++tcache.misses;
+    const uint64_t entry = find_lowestpaging(vir_page, target->pml4t_location);
+    if(!(entry & PBIT_PRESENT)) return entry;
+
+    //Large pages are described in terms of the 4KB page which is looked up
+    size_t phy_page = entry & 0x000ffffffffff000;
+    if(entry & PBIT_LARGEPAGE) phy_page = align_pgdown(get_target(vir_page, target->pml4t_location));
+    const uint64_t flags = entry & ~(0x000ffffffffff000 | PBIT_LARGEPAGE);
+    if(vir_page >= space_start(target)) tcache.store(vir_page, phy_page, flags);
+
+    return phy_page+flags;
+}
+
 bool PagingManager::map_kernel() {
     size_t phy_knl_rx_loc, phy_knl_r_loc, phy_knl_rw_loc;
     size_t vir_knl_rx_loc, vir_knl_r_loc, vir_knl_rw_loc, kernel_pml4t;
@@ -242,6 +344,129 @@ bool PagingManager::map_kernel() {
     return true;
 }
 
+bool PagingManager::map_physmem() {
+    RamChunk* ram_map;
+    PageChunk* physmap;
+    size_t ram_size = 0;
+
+    //Find out where physical memory ends
+    for(ram_map = ram_manager->dump_mmap(); ram_map; ram_map = ram_map->next_mapitem) {
+        ram_size = max(ram_size, ram_map->location+ram_map->size);
+    }
+
+    //Map it, then keep the kernel from putting anything else in the area of the physical map,
+    //which is shared by all address spaces
+    if(!x86paging::map_physical_memory(ram_size,
+                                       kernel_half,
+                                       process_list->pml4t_location,
+                                       &ptable_cache)) return false;
+    physmap = alloc_virtual_address_space(process_list,
+                                          x86paging::PHYSMAP_SIZE,
+                                          x86paging::PHYSMAP_START);
+    if(!physmap) return false;
+    physmap->flags = PAGE_FLAGS_RW + PAGE_FLAG_K;
+
+    return true;
+}
+
+bool PagingManager::page_copier(PagingManagerProcess* target,
+                                PageChunk* chunk,
+                                const size_t vir_addr) {
+    RamChunk *chunk_parser, *copy = NULL;
+    size_t frame, shared_frame;
+    x86paging::TlbBatch tlb_batch;
+
+    //The page may have been made writable since the fault occured
+    const uint64_t entry = lookup_page(target, vir_addr);
+    if(entry & x86paging::PBIT_WRITABLE) return true;
+
+    //Pages of the RAM chunk which are still shared must be copied. Pages which have been copied
+    //already, and pages of RAM chunks which are not shared anymore, are simply made writable.
+    frame = entry & 0x000ffffffffff000;
+    for(chunk_parser = chunk->points_to; chunk_parser; chunk_parser = chunk_parser->next_buddy) {
+        if((frame >= chunk_parser->location) && (frame < chunk_parser->location+chunk_parser->size)) break;
+    }
+    if(chunk_parser && (chunk_parser->owners.length() > 1)) {
+        copy = ram_manager->alloc_copy(target->identifier, frame);
+        if(!copy) return false;
+        shared_frame = frame;
+        frame = copy->location;
+    }
+
+    //Map the page writable, splitting large pages if needed, and flush the old translation
+    if(!x86paging::setup_paging(frame, vir_addr, PG_SIZE, target->pml4t_location, &ptable_cache)) {
+        if(copy) ram_manager->free_chunk(target->identifier, copy->location);
+        return false;
+    }
+    x86paging::fill_paging(frame,
+                           vir_addr,
+                           PG_SIZE,
+                           x86flags(chunk->flags & ~PAGE_FLAG_C),
+                           target->pml4t_location);
+    tlb_batch.add(vir_addr, PG_SIZE, false);
+    tlb_flush(target, tlb_batch);
+
+    //The process has no use for the shared page anymore, so it stops owning it. Once a single
+    //process is left sharing it, that process may write to it in place. If this fails, the page
+    //simply stays shared.
+    if(copy) ram_manager->unshare_page(target->identifier, shared_frame);
+
+    return true;
+}
+
+void PagingManager::page_remapper(PagingManagerProcess* target,
+                                  const RamChunk* page,
+                                  const size_t new_location,
+                                  const bool read_only) {
+    PageChunk* map_parser;
+    RamChunk* chunk_parser;
+    size_t offset, vir_addr;
+    x86paging::TlbBatch tlb_batch;
+    const PageFlags removed_flags = read_only ? PAGE_FLAG_W : 0;
+
+    //Find the page chunks where the page is mapped, along with its offset in them. Memory which
+    //is allocated on demand or copied on write is not fully described by a RAM chunk, so paging
+    //structures must be searched instead.
+    for(map_parser = target->map_pointer; map_parser; map_parser = map_parser->next_mapitem) {
+        if(!(map_parser->points_to) || (map_parser->flags & PAGE_FLAG_C)) {
+            vir_addr = target->tcache.find_frame(page->location, map_parser->location, map_parser->size);
+            if(!vir_addr) {
+                vir_addr = x86paging::find_frame(page->location,
+                                                 map_parser->location,
+                                                 map_parser->size,
+                                                 target->pml4t_location);
+            }
+            if(!vir_addr) continue;
+        } else {
+            offset = 0;
+            chunk_parser = map_parser->points_to;
+            while(chunk_parser && (chunk_parser != page) && (offset < map_parser->size)) {
+                offset+= chunk_parser->size;
+                chunk_parser = chunk_parser->next_buddy;
+            }
+            if(!chunk_parser || (offset >= map_parser->size)) continue;
+            vir_addr = map_parser->location+offset;
+        }
+
+        //Point the page table entry to the new location of the page. The old translation must
+        //also be flushed from the TLB.
+        x86paging::fill_paging(new_location,
+                               vir_addr,
+                               PG_SIZE,
+                               x86flags(map_parser->flags & ~removed_flags),
+                               target->pml4t_location);
+        if(map_parser->flags & PAGE_FLAG_K) {
+            x86paging::fill_paging(new_location,
+                                   vir_addr,
+                                   PG_SIZE,
+                                   x86flags(map_parser->flags & ~removed_flags),
+                                   kernel_half);
+        }
+        tlb_batch.add(vir_addr, PG_SIZE, map_parser->flags & PAGE_FLAG_K);
+    }
+    tlb_flush(target, tlb_batch);
+}
+
 bool PagingManager::remove_all_paging(PagingManagerProcess* target) {
     using namespace x86paging;
 
@@ -249,11 +474,23 @@ bool PagingManager::remove_all_paging(PagingManagerProcess* target) {
     total_address_space*= PTABLE_LENGTH; //Size of a PD
     total_address_space*= PTABLE_LENGTH; //Size of a PDPT
     total_address_space*= PTABLE_LENGTH; //Size of the whole PML4T
-    return remove_paging(0, total_address_space, target->pml4t_location, ram_manager);
+
+    //This is only done to dying processes, which don't have a PCID anymore and won't be switched
+    //to again, so paging structures are freed all at once and the TLB can be left alone. Their
+    //kernel half is shared, and is only unlinked.
+    bool result = free_paging(KERNEL_SPACE_END,
+                              total_address_space-KERNEL_SPACE_END,
+                              target->pml4t_location,
+                              ram_manager);
+    for(int index = 0; index < KERNEL_PML4_ENTRIES; ++index) {
+        phys_to_virt(target->pml4t_location)[index] = 0;
+    }
+    return result;
 }
 
 bool PagingManager::remove_pid(PID target) {
     PagingManagerProcess *deleted_item, *previous_item;
+    PageChunk *current_item, *next_item;
 
     //target can't be the first item of the map list, as this item is the kernel. One can't kill the kernel.
     previous_item = process_list;
@@ -265,13 +502,30 @@ bool PagingManager::remove_pid(PID target) {
     if(!deleted_item) return false;
     previous_item->next_item = deleted_item->next_item;
 
-    //Since the target is currently being freed, allow the liberation of K pages
-    deleted_item->may_free_kpages = 1;
+    //Take its PCID back first : TLB entries tagged with it are flushed before the PCID is used
+    //again, so there's no need to flush them one by one as its chunks are freed.
+    free_pcid(deleted_item);
+
+    //Give the memory which is only known to paging structures back to RamManager and discard the
+    //map. Translations are not removed one by one : all paging structures are freed afterwards.
+    for(current_item = deleted_item->map_pointer; current_item; current_item = next_item) {
+        next_item = current_item->next_mapitem;
+        if(!(current_item->points_to) || (current_item->flags & PAGE_FLAG_C)) {
+            x86paging::release_frames(current_item->location,
+                                      current_item->size,
+                                      deleted_item->pml4t_location,
+                                      ram_manager,
+                                      deleted_item->identifier,
+                                      current_item->points_to);
+        }
+        current_item = new(current_item) PageChunk();
+        current_item->next_buddy = free_mapitems;
+        free_mapitems = current_item;
+    }
 
     //Free all its paging structures and its entry
-    while(deleted_item->map_pointer) chunk_liberator(deleted_item, deleted_item->map_pointer);
     remove_all_paging(deleted_item);
-    ram_manager->free_chunk(PID_KERNEL, deleted_item->pml4t_location);
+    ptable_cache.free(&(deleted_item->pml4t_location), 1); //It is empty by now
     deleted_item = new(deleted_item) PagingManagerProcess();
     deleted_item->next_item = free_process_descs;
     free_process_descs = deleted_item;
@@ -281,52 +535,81 @@ bool PagingManager::remove_pid(PID target) {
 
 PagingManagerProcess* PagingManager::setup_pid(PID target) {
     PagingManagerProcess* result;
-    RamChunk* pml4t_page;
+    uint64_t pml4t_location;
 
     //Allocate management structures
     if(!free_process_descs) {
         alloc_process_descs();
         if(!free_process_descs) return NULL;
     }
-    pml4t_page = ram_manager->alloc_chunk(PID_KERNEL);
-    if(!pml4t_page) return NULL;
+    pml4t_location = x86paging::create_pml4t(&ptable_cache, kernel_half);
+    if(!pml4t_location) return NULL;
 
     //Fill them
     result = free_process_descs;
     free_process_descs = free_process_descs->next_item;
     result->next_item = NULL;
     result->identifier = target;
-    result->pml4t_location = pml4t_page->location;
-    x86paging::create_pml4t(result->pml4t_location);
-
-    //Map K pages in the process' user space
-    bool tmp = map_k_chunks(result);
-    if(!tmp) {
-        result->next_item = process_list->next_item;
-        process_list->next_item = result;
-        remove_pid(result->identifier);
-        return NULL;
-    }
+    result->pml4t_location = pml4t_location;
 
     return result;
 }
 
+size_t PagingManager::space_start(PagingManagerProcess* target) {
+    //The kernel may use all of its address space save for the first page, which includes the
+    //NULL pointer. Other processes only have what lies above the shared kernel half.
+    if(target == process_list) return PG_SIZE;
+    return x86paging::KERNEL_SPACE_END;
+}
+
+void PagingManager::tlb_flush(PagingManagerProcess* target, x86paging::TlbBatch& tlb_batch) {
+    if(tlb_batch.empty()) return;
+
+    //Cached translations of the process go away along with its TLB entries. Batches which
+    //overflowed don't describe all modified translations, so they flush the whole cache.
+    TranslationCache& tcache = target->tcache;
+    if(tlb_batch.full_flush()) {
+        tcache.clear();
+    } else {
+        for(int range = 0; tcache.used && (range < tlb_batch.range_count); ++range) {
+            tcache.invalidate(tlb_batch.ranges[range].vaddr, tlb_batch.ranges[range].size);
+        }
+    }
+
+    //Translations of the current address space, and global ones which are shared by all address
+    //spaces, are flushed right away.
+    const bool current = (target->pml4t_location == x86paging::get_pml4t());
+    if(current || tlb_batch.global) x86paging::flush_tlb(tlb_batch);
+
+    //Other address spaces only keep translations in the TLB under their PCID, if they have one.
+    //INVPCID can flush them from there. Without it, the whole PCID is flushed when the process is
+    //next switched to.
+    if(!current && use_pcid && (target->pcid || (target == process_list))) {
+        if(x86paging::has_invpcid()) {
+            x86paging::flush_tlb_pcid(tlb_batch, target->pcid);
+        } else {
+            target->tlb_stale = true;
+        }
+    }
+
+    //TODO : Once other processors are running, send them the batch for TLB shootdown.
+}
+
 void PagingManager::unmap_k_chunk(PageChunk *chunk) {
-    PageChunk* k_chunk;
-    PagingManagerProcess* process_parser = process_list;
-
-    while(process_parser->next_item) {
-        //Find non-kernel processes which have the K chunk mapped in their address space.
-        process_parser = process_parser->next_item;
-        k_chunk = process_parser->map_pointer->find_thischunk(chunk->location);
-        if(!k_chunk) continue;
-
-        //Remove it from there.
-        uint16_t old_free_kpages = process_parser->may_free_kpages;
-        process_parser->may_free_kpages = 1;
-        chunk_liberator(process_parser, k_chunk);
-        process_parser->may_free_kpages = old_free_kpages;
+    PageChunk* current_item;
+    x86paging::TlbBatch tlb_batch;
+
+    //K pages are mapped in all non-kernel address spaces through the kernel half which they
+    //share, so removing them from there is enough. They are global pages, so the TLB flush
+    //reaches all address spaces too.
+    for(current_item = chunk; current_item; current_item = current_item->next_buddy) {
+        x86paging::remove_paging(current_item->location,
+                                 current_item->size,
+                                 kernel_half,
+                                 &ptable_cache,
+                                 tlb_batch);
     }
+    tlb_flush(process_list, tlb_batch);
 }
 
 uint64_t PagingManager::x86flags(PageFlags flags) {
@@ -335,7 +618,7 @@ uint64_t PagingManager::x86flags(PageFlags flags) {
     uint64_t result = PBIT_PRESENT + PBIT_USERACCESS + PBIT_NOEXECUTE;
 
     if(flags & PAGE_FLAG_A) result-= PBIT_PRESENT;
-    if(flags & PAGE_FLAG_W) result+= PBIT_WRITABLE;
+    if((flags & PAGE_FLAG_W) && !(flags & PAGE_FLAG_C)) result+= PBIT_WRITABLE;
     if(flags & PAGE_FLAG_X) result-= PBIT_NOEXECUTE;
     if(flags & PAGE_FLAG_K) {
         result+= PBIT_GLOBALPAGE;
@@ -348,7 +631,10 @@ uint64_t PagingManager::x86flags(PageFlags flags) {
 PagingManager::PagingManager(RamManager& ram_man) : ram_manager(&ram_man),
                                                     process_manager(NULL),
                                                     free_mapitems(NULL),
-                                                    free_process_descs(NULL) {
+                                                    free_process_descs(NULL),
+                                                    use_pcid(false),
+                                                    pcid_clock(0),
+                                                    ptable_cache(&ram_man) {
     //Allocate some data storage space.
     alloc_process_descs();
     alloc_mapitems();
@@ -360,11 +646,24 @@ PagingManager::PagingManager(RamManager& ram_man) : ram_manager(&ram_man),
     process_list->identifier = PID_KERNEL;
     process_list->pml4t_location = x86paging::get_pml4t();
 
-    //Map the kernel's virtual address space
+    //Set up the kernel half which non-kernel address spaces share, along with the map of all
+    //physical memory which it holds, then map the kernel's virtual address space. Without the
+    //physical map, other address spaces could not reach paging structures, so boot stops here.
+    kernel_half = x86paging::create_kernel_half(&ptable_cache);
+    if(!kernel_half) panic(PANIC_NO_KERNEL_HALF);
+    if(!map_physmem()) panic(PANIC_NO_PHYSMAP);
     map_kernel();
 
+    //Enable PCIDs if possible. The kernel's address space keeps PCID 0, which it already uses.
+    use_pcid = x86paging::enable_pcid();
+    for(size_t index = 0; index < x86paging::PCID_AMOUNT/64; ++index) pcid_bitmap[index] = 0;
+    pcid_bitmap[0] = 1;
+
     //Activate global paging management service
     paging_manager = this;
+
+    //Pages which are moved by memory compaction may now be remapped
+    ram_manager->set_page_migrator(paging_manager_migrate_page);
 }
 
 uint64_t PagingManager::cr3_value(const PID target) {
@@ -373,13 +672,126 @@ uint64_t PagingManager::cr3_value(const PID target) {
     proclist_mutex.grab_spin();
 
         PagingManagerProcess* list_item = find_pid(target);
-        if(list_item) result = list_item->pml4t_location;
+        if(list_item) {
+            list_item->mutex.grab_spin();
+
+                result = list_item->pml4t_location;
+
+                //With PCIDs, the TLB entries of the address space are kept unless they are stale.
+                //The kernel always has PCID 0, other processes get one when first switched to.
+                if(use_pcid) {
+                    if((list_item != process_list) && !(list_item->pcid)) alloc_pcid(list_item);
+                    list_item->pcid_stamp = ++pcid_clock;
+                    result+= list_item->pcid;
+                    if(!(list_item->tlb_stale)) result+= x86paging::CR3_NOFLUSH;
+                    list_item->tlb_stale = false;
+                }
+
+            list_item->mutex.release();
+        }
 
     proclist_mutex.release();
 
     return result;
 }
 
+bool PagingManager::handle_page_fault(const PID target, const size_t address, const bool write) {
+    PagingManagerProcess* process;
+    PageChunk* chunk;
+    RamChunk* frame;
+    uint64_t entry;
+    const size_t vir_addr = align_pgdown(address);
+    bool result = false;
+
+    proclist_mutex.grab_spin();
+
+        process = find_pid(target);
+        if(!process) {
+            proclist_mutex.release();
+            return false;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+        //Only faults in chunks which are allocated on demand, and write faults in writable chunks
+        //which are copied on write, may be resolved. Elsewhere, in pages which are explicitly
+        //absent, or when writing to chunks which are not writable, they are access violations.
+        chunk = process->map_index.find_containing(address);
+        if(chunk && (chunk->location+chunk->size <= address)) chunk = NULL;
+        if(chunk && (chunk->flags & PAGE_FLAG_A)) chunk = NULL;
+        if(chunk && write && !(chunk->flags & PAGE_FLAG_W)) chunk = NULL;
+        entry = 0;
+        if(chunk) entry = lookup_page(process, vir_addr);
+        if(chunk && write && (entry & x86paging::PBIT_WRITABLE)) {
+            //The page has been made writable since the fault occured, as happens once memory
+            //compaction is done moving it
+            result = true;
+        } else if(chunk && write && (entry & x86paging::PBIT_PRESENT) && (chunk->flags & PAGE_FLAG_C)) {
+            result = page_copier(process, chunk, vir_addr);
+        } else if(chunk && !(chunk->points_to)) {
+            if(entry & x86paging::PBIT_PRESENT) {
+                //The page has been mapped since the fault occured
+                result = true;
+            } else {
+                //Allocate a zeroed page of RAM and map it. Page table entries which were not
+                //present can't be in the TLB, so nothing needs to be flushed.
+                frame = ram_manager->alloc_chunk(target, PG_SIZE, false, RAM_ALLOC_ZEROED);
+                if(frame) {
+                    if(x86paging::setup_paging(frame->location,
+                                               vir_addr,
+                                               PG_SIZE,
+                                               process->pml4t_location,
+                                               &ptable_cache)) {
+                        x86paging::fill_paging(frame->location,
+                                               vir_addr,
+                                               PG_SIZE,
+                                               x86flags(chunk->flags),
+                                               process->pml4t_location);
+                        result = true;
+                    } else {
+                        ram_manager->free_chunk(target, frame->location);
+                    }
+                }
+            }
+        }
+
+    process->mutex.release();
+
+    return result;
+}
+
+size_t PagingManager::shrink(const size_t amount) {
+    //Pages of paging structures which are kept in the page table cache are given back
+    return ptable_cache.shrink(amount);
+}
+
+size_t PagingManager::translate(const PID target, const size_t vir_addr) {
+    PagingManagerProcess* process;
+    const size_t vir_page = align_pgdown(vir_addr);
+    size_t phy_page;
+
+    proclist_mutex.grab_spin();
+
+        process = find_pid(target);
+        if(!process) {
+            proclist_mutex.release();
+            return NULL;
+        }
+
+    process->mutex.grab_spin();
+    proclist_mutex.release();
+
+        //Look the translation up, going through the process' translation cache
+        const uint64_t entry = lookup_page(process, vir_page);
+        phy_page = (entry & x86paging::PBIT_PRESENT) ? (entry & 0x000ffffffffff000) : NULL;
+
+    process->mutex.release();
+
+    if(!phy_page) return NULL;
+    return phy_page+vir_addr%PG_SIZE;
+}
+
 void PagingManager::print_pml4t(PID owner) {
     PagingManagerProcess* list_item;
 
@@ -417,6 +829,30 @@ void paging_manager_remove_process(PID target) {
     }
 }
 
+bool paging_manager_page_fault(const PID target, const size_t address, const bool write) {
+    if(!paging_manager) {
+        return false;
+    } else {
+        return paging_manager->handle_page_fault(target, address, write);
+    }
+}
+
+bool paging_manager_migrate_page(const RamChunk* page, const size_t new_location) {
+    if(!paging_manager) {
+        return false;
+    } else {
+        return paging_manager->migrate_page(page, new_location);
+    }
+}
+
+size_t paging_manager_shrink(const size_t amount) {
+    if(!paging_manager) {
+        return 0;
+    } else {
+        return paging_manager->shrink(amount);
+    }
+}
+
 /*PID paging_manager_update_process(PID old_process, PID new_process) {
     if(!paging_manager) {
         return PID_INVALID;
@@ -20,25 +20,66 @@
 #include <x86paging.h>
 #include <x86paging_parser.h>
 #include <x86asm.h>
+#include <x86cpu.h>
 
 namespace x86paging {
-    void create_pml4t(uint64_t location) {
-        uint64_t* pointer = (uint64_t*) location;
-        for(int i=0; i<512; ++i) pointer[i] = 0;
+    uint64_t physmap_offset = 0;
+
+    uint64_t create_kernel_half(PageTableCache* ptable_cache) {
+        size_t tables[KERNEL_PML4_ENTRIES+1];
+        if(!ptable_cache->alloc(tables, KERNEL_PML4_ENTRIES+1)) return 0;
+
+        uint64_t* pml4t = phys_to_virt(tables[KERNEL_PML4_ENTRIES]);
+        for(int index = 0; index < KERNEL_PML4_ENTRIES; ++index) {
+            pml4t[index] = tables[index] + PBIT_PRESENT       //All paging protections
+                                         + PBIT_WRITABLE      //are disabled at this
+                                         + PBIT_USERACCESS;   //level of paging structs.
+        }
+        return tables[KERNEL_PML4_ENTRIES];
     }
 
-    void fill_4kpaging(const uint64_t phy_addr,
-                       uint64_t vir_addr,
-                       const uint64_t size,
-                       uint64_t flags,
-                       uint64_t pml4t_location) {
-        uint64_t additional_params[3] = {phy_addr, flags, 0};
-        paging_parser(vir_addr,
-                      size,
-                      PML4T_LEVEL,
-                      (uint64_t*) pml4t_location,
-                      &fill_4kpaging_handler,
-                      additional_params);
+    uint64_t create_pml4t(PageTableCache* ptable_cache, const uint64_t kernel_half) {
+        size_t pml4t_page;
+        if(!ptable_cache->alloc(&pml4t_page, 1)) return 0;
+
+        if(kernel_half) {
+            for(int index = 0; index < KERNEL_PML4_ENTRIES; ++index) {
+                phys_to_virt(pml4t_page)[index] = phys_to_virt(kernel_half)[index];
+            }
+        }
+        return pml4t_page;
+    }
+
+    bool enable_pcid() {
+        uint64_t cr3, cr4;
+
+        //CR4.PCIDE may only be set when the current PCID is 0
+        if(!has_pcid()) return false;
+        rdcr3(cr3);
+        if(cr3 & 0xfff) return false;
+
+        rdcr4(cr4);
+        cr4|= CR4_PCIDE;
+        wrcr4(cr4);
+        return true;
+    }
+
+    void fill_paging(const uint64_t phy_addr,
+                     uint64_t vir_addr,
+                     const uint64_t size,
+                     uint64_t flags,
+                     uint64_t pml4t_location) {
+        FillPagingHandler handler(phy_addr, flags);
+        walk_paging(vir_addr, size, pml4t_location, handler);
+    }
+
+    uint64_t find_frame(const uint64_t phy_addr,
+                        const uint64_t vir_addr,
+                        const uint64_t size,
+                        const uint64_t pml4t_location) {
+        FindFrameHandler handler(phy_addr);
+        walk_paging(vir_addr, size, pml4t_location, handler);
+        return handler.vir_addr;
     }
 
     uint64_t find_lowestpaging(const uint64_t vaddr, const uint64_t pml4t_location) {
@@ -48,7 +89,7 @@ namespace x86paging {
         pde* pd;
         pte* pt;
 
-        pml4 = (pml4e*) pml4t_location;
+        pml4 = (pml4e*) phys_to_virt(pml4t_location);
 
         //We assume 4KB paging first. Things will be then adjusted as needed.
         tmp = vaddr/0x1000;
@@ -62,24 +103,76 @@ namespace x86paging {
 
         //Check that PML4 entry exists, if not the address is invalid.
         if(!(pml4[pml4_index] & PBIT_PRESENT)) return 0;
-        pdpt = (pdp*) (pml4[pml4_index] & 0x000ffffffffff000);
+        pdpt = (pdp*) phys_to_virt(pml4[pml4_index] & 0x000ffffffffff000);
 
         //If 1GB pages are on, we have reached the lowest level of paging hierarchy, return the PDP.
         if(pdpt[pdpt_index] & PBIT_LARGEPAGE) return (uint64_t) pdpt[pdpt_index];
         //Else check that PDPT entry exists, if it does go to the next level
         if(!(pdpt[pdpt_index] & PBIT_PRESENT)) return 0;
-        pd = (pde*) (pdpt[pdpt_index] & 0x000ffffffffff000);
+        pd = (pde*) phys_to_virt(pdpt[pdpt_index] & 0x000ffffffffff000);
 
         //If 2MB pages are on, we have reached the lowest level of paging hierarchy, return the PDE.
         if(pd[pd_index] & PBIT_LARGEPAGE) return (uint64_t) pd[pd_index];
         //Else check that PD entry exists, if it does go to the next level
         if(!(pd[pd_index] & PBIT_PRESENT)) return 0;
-        pt = (pte*) (pd[pd_index] & 0x000ffffffffff000);
+        pt = (pte*) phys_to_virt(pd[pd_index] & 0x000ffffffffff000);
 
         //Return the PTE
         return (uint64_t) pt[pt_index];
     }
 
+    void flush_tlb(const TlbBatch& batch) {
+        uint64_t cr3, cr4;
+
+        //Small batches are flushed one TLB entry at a time
+        if(!batch.full_flush()) {
+            for(int index = 0; index < batch.range_count; ++index) {
+                const TlbRange& range = batch.ranges[index];
+                for(uint64_t vaddr = range.vaddr; vaddr < range.vaddr+range.size; vaddr+= range.entry_size) {
+                    invlpg(vaddr);
+                }
+            }
+            return;
+        }
+
+        //Larger ones flush the whole TLB. Reloading CR3 flushes all translations of the current
+        //address space save for global ones, which are only flushed by toggling global pages.
+        rdcr4(cr4);
+        if(batch.global && (cr4 & CR4_PGE)) {
+            wrcr4(cr4 - CR4_PGE);
+            wrcr4(cr4);
+        } else {
+            rdcr3(cr3);
+            wrcr3(cr3);
+        }
+    }
+
+    void flush_tlb_pcid(const TlbBatch& batch, const uint16_t pcid) {
+        if(batch.full_flush()) {
+            invpcid(1, pcid, 0);
+            return;
+        }
+        for(int index = 0; index < batch.range_count; ++index) {
+            const TlbRange& range = batch.ranges[index];
+            for(uint64_t vaddr = range.vaddr; vaddr < range.vaddr+range.size; vaddr+= range.entry_size) {
+                invpcid(0, pcid, vaddr);
+            }
+        }
+    }
+
+    bool free_paging(const uint64_t vir_addr,
+                     const uint64_t size,
+                     uint64_t pml4t_location,
+                     RamManager* ram_manager) {
+        FreePagingHandler handler(ram_manager);
+        bool result = walk_paging(vir_addr, size, pml4t_location, handler);
+
+        //Free the paging structures which remain in the stash
+        if(handler.stashed) ram_manager->free_chunk_batch(PID_KERNEL, handler.stash, handler.stashed);
+
+        return result;
+    }
+
     uint64_t get_target(const uint64_t vaddr, const uint64_t pml4t_location) {
         uint64_t tmp, pt_index, pd_index, pdpt_index, pml4_index;
         pml4e* pml4;
@@ -87,7 +180,7 @@ namespace x86paging {
         pde* pd;
         pte* pt;
 
-        pml4 = (pml4e*) pml4t_location;
+        pml4 = (pml4e*) phys_to_virt(pml4t_location);
 
         //We assume 4KB paging first. Things will be then adjusted as needed.
         tmp = vaddr/0x1000;
@@ -101,7 +194,7 @@ namespace x86paging {
 
         //Check that PML4 entry exists, if not the address is invalid.
         if(!(pml4[pml4_index] & PBIT_PRESENT)) return 0;
-        pdpt = (pdp*) (pml4[pml4_index] & 0x000ffffffffff000);
+        pdpt = (pdp*) phys_to_virt(pml4[pml4_index] & 0x000ffffffffff000);
 
         //If 1GB pages are on, we have reached the lowest level of paging hierarchy
         if(pdpt[pdpt_index] & PBIT_LARGEPAGE) {
@@ -109,7 +202,7 @@ namespace x86paging {
         }
         //Else check that PDPT entry exists, if it does go to the next level
         if(!(pdpt[pdpt_index] & PBIT_PRESENT)) return 0;
-        pd = (pde*) (pdpt[pdpt_index] & 0x000ffffffffff000);
+        pd = (pde*) phys_to_virt(pdpt[pdpt_index] & 0x000ffffffffff000);
 
         //If 2MB pages are on, we have reached the lowest level of paging hierarchy
         if(pd[pd_index] & PBIT_LARGEPAGE) {
@@ -117,7 +210,7 @@ namespace x86paging {
         }
         //Else check that PD entry exists, if it does go to the next level
         if(!(pd[pd_index] & PBIT_PRESENT)) return 0;
-        pt = (pte*) (pd[pd_index] & 0x000ffffffffff000);
+        pt = (pte*) phys_to_virt(pd[pd_index] & 0x000ffffffffff000);
 
         //Return the physical address
         return (uint64_t) ((pt[pt_index] & 0x000ffffffffff000) + (vaddr & 0xfff));
@@ -129,39 +222,244 @@ namespace x86paging {
         return cr3 & 0x000ffffffffff000;
     }
 
+    bool has_1gpages() {
+        //The answer comes from CPUID, which is slow, so it is only asked once
+        static int supported = -1;
+        if(supported < 0) {
+            uint32_t eax, ebx, ecx, edx;
+            cpuid(0x80000001, eax, ebx, ecx, edx);
+            supported = (edx >> 26) & 1;
+        }
+        return supported;
+    }
+
+    bool has_invpcid() {
+        static int supported = -1;
+        if(supported < 0) {
+            uint32_t eax, ebx, ecx, edx;
+            cpuid(0, eax, ebx, ecx, edx);
+            if(eax < 7) {
+                supported = 0;
+            } else {
+                cpuid_count(7, 0, eax, ebx, ecx, edx);
+                supported = (ebx >> 10) & 1;
+            }
+        }
+        return supported;
+    }
+
+    bool has_pcid() {
+        static int supported = -1;
+        if(supported < 0) {
+            uint32_t eax, ebx, ecx, edx;
+            cpuid(1, eax, ebx, ecx, edx);
+            supported = (ecx >> 17) & 1;
+        }
+        return supported;
+    }
+
+    bool map_physical_memory(const uint64_t ram_size,
+                             const uint64_t kernel_half,
+                             const uint64_t pml4t_location,
+                             PageTableCache* ptable_cache) {
+        //Memory is mapped whole large pages at a time, 1GB ones if the processor has them, and
+        //only the kernel may access it
+        const PagingLevel map_level = has_1gpages() ? PDPT_LEVEL : PD_LEVEL;
+        const uint64_t map_size = align_up(ram_size, (uint64_t) 1 << map_level);
+        const uint64_t flags = PBIT_PRESENT + PBIT_WRITABLE + PBIT_GLOBALPAGE + PBIT_NOEXECUTE;
+        if(map_size > PHYSMAP_SIZE) return false;
+
+        if(!setup_paging(0, PHYSMAP_START, map_size, kernel_half, ptable_cache)) return false;
+        fill_paging(0, PHYSMAP_START, map_size, flags, kernel_half);
+
+        //The kernel's own address space, which does not share the kernel half's PDPTs otherwise,
+        //shares those of the physical map. Its PML4 entries there are unused at this point.
+        for(uint64_t index = PHYSMAP_START >> PML4T_LEVEL; index < KERNEL_PML4_ENTRIES; ++index) {
+            phys_to_virt(pml4t_location)[index] = phys_to_virt(kernel_half)[index];
+        }
+
+        //From now on, physical memory is accessed through the physical map
+        physmap_offset = PHYSMAP_START;
+        return true;
+    }
+
+    void release_frames(const uint64_t vir_addr,
+                        const uint64_t size,
+                        uint64_t pml4t_location,
+                        RamManager* ram_manager,
+                        const PID owner,
+                        const RamChunk* mapped_chunk) {
+        ReleaseFramesHandler handler(ram_manager, owner, mapped_chunk);
+        walk_paging(vir_addr, size, pml4t_location, handler);
+        if(handler.stashed) ram_manager->free_chunk_batch(owner, handler.stash, handler.stashed);
+    }
+
     bool remove_paging(uint64_t vir_addr,
                        const uint64_t size,
                        uint64_t pml4t_location,
-                       RamManager* ram_manager) {
-        uint64_t additional_params[1] = {(uint64_t) ram_manager};
-        return paging_parser(vir_addr,
-                            size,
-                            PML4T_LEVEL,
-                            (uint64_t*) pml4t_location,
-                            &remove_paging_handler,
-                            additional_params);
-    }
-
-    uint64_t setup_4kpages(uint64_t vir_addr,
-                           const uint64_t size,
-                           uint64_t pml4t_location,
-                           RamManager* ram_manager) {
-        uint64_t additional_params[1] = {(uint64_t) ram_manager};
-        return paging_parser(vir_addr,
-                            size,
-                            PML4T_LEVEL,
-                            (uint64_t*) pml4t_location,
-                            &setup_4kpages_handler,
-                            additional_params);
-    }
-
-    void set_flags(uint64_t vaddr, const uint64_t size, uint64_t flags, uint64_t pml4t_location) {
-        uint64_t additional_params[1] = {flags};
-        paging_parser(vaddr,
-                      size,
-                      PML4T_LEVEL,
-                      (uint64_t*) pml4t_location,
-                      &set_flags_handler,
-                      additional_params);
+                       PageTableCache* ptable_cache,
+                       TlbBatch& batch) {
+        RemovePagingHandler handler(ptable_cache, batch);
+        bool result = walk_paging(vir_addr, size, pml4t_location, handler);
+
+        //Free the paging structures which remain in the stash
+        if(handler.stashed) ptable_cache->free(handler.stash, handler.stashed);
+
+        return result;
+    }
+
+    uint64_t setup_paging(const uint64_t phy_addr,
+                          uint64_t vir_addr,
+                          const uint64_t size,
+                          uint64_t pml4t_location,
+                          PageTableCache* ptable_cache) {
+        //Count the paging structures which have to be allocated, so that this may be done in
+        //batches instead of one page at a time
+        const uint64_t delta = phy_addr-vir_addr;
+        CountPagingHandler counter(delta);
+        if(!walk_paging(vir_addr, size, pml4t_location, counter)) return 0;
+        if(!counter.count) return 1;
+
+        //Set up paging structures
+        SetupPagingHandler handler(ptable_cache, counter.count, delta);
+        uint64_t result = walk_paging(vir_addr, size, pml4t_location, handler);
+
+        //If setup has failed, some preallocated pages may not have been used
+        if(handler.stashed) ptable_cache->free(handler.stash, handler.stashed);
+
+        return result;
+    }
+
+    bool set_flags(uint64_t vaddr,
+                   const uint64_t size,
+                   uint64_t flags,
+                   uint64_t pml4t_location,
+                   PageTableCache* ptable_cache,
+                   TlbBatch& batch) {
+        SetFlagsHandler handler(flags, ptable_cache, batch);
+        return walk_paging(vaddr, size, pml4t_location, handler);
+    }
+
+    bool PageTableCache::alloc(size_t* pages, const uint64_t amount) {
+        PageTableFront& front = local_front();
+        uint64_t allocated = 0;
+
+        front.mutex.grab_spin();
+
+            while(allocated < amount) {
+                if(!front.length && !refill(front)) break;
+                pages[allocated++] = front.pages[--front.length];
+            }
+
+        front.mutex.release();
+
+        //If there's not enough memory, give back what has been allocated
+        if(allocated < amount) {
+            if(allocated) free(pages, allocated);
+            return false;
+        }
+
+        return true;
+    }
+
+    void PageTableCache::drain(PageTableFront& front) {
+        int pooled;
+
+        //The oldest pages, which are at the bottom of the front stock, go to the shared pool, or
+        //back to RamManager if it is full
+        pool_mutex.grab_spin();
+
+            pooled = min(PTABLE_BATCH, PTABLE_POOL_SIZE-pool_length);
+            for(int index = 0; index < pooled; ++index) pool[pool_length++] = front.pages[index];
+
+        pool_mutex.release();
+
+        if(pooled < PTABLE_BATCH) {
+            ram_manager->free_chunk_batch(PID_KERNEL, front.pages+pooled, PTABLE_BATCH-pooled);
+        }
+
+        //Move the remaining pages down
+        front.length-= PTABLE_BATCH;
+        for(int index = 0; index < front.length; ++index) {
+            front.pages[index] = front.pages[index+PTABLE_BATCH];
+        }
+    }
+
+    void PageTableCache::free(const size_t* pages, const uint64_t amount) {
+        PageTableFront& front = local_front();
+
+        front.mutex.grab_spin();
+
+            for(uint64_t index = 0; index < amount; ++index) {
+                if(front.length == PTABLE_FRONT_SIZE) drain(front);
+                front.pages[front.length++] = pages[index];
+            }
+
+        front.mutex.release();
+    }
+
+    PageTableFront& PageTableCache::local_front() {
+        //CPUs are told apart by the dense index in their local data, as APIC IDs may be sparse
+        return fronts[x86cpu::cpu_local()->index % PTABLE_CACHE_CPUS];
+    }
+
+    bool PageTableCache::refill(PageTableFront& front) {
+        RamChunk* allocd_pages[PTABLE_BATCH];
+        int amount;
+
+        //Take a batch of pages from the shared pool...
+        pool_mutex.grab_spin();
+
+            amount = min(PTABLE_BATCH, pool_length);
+            for(int index = 0; index < amount; ++index) front.pages[front.length++] = pool[--pool_length];
+
+        pool_mutex.release();
+
+        if(amount) return true;
+
+        //...or from RamManager if it's empty, asking for a single page if memory is short
+        amount = PTABLE_BATCH;
+        if(!ram_manager->alloc_chunk_batch(PID_KERNEL, allocd_pages, amount, RAM_ALLOC_ZEROED)) {
+            amount = 1;
+            if(!ram_manager->alloc_chunk_batch(PID_KERNEL, allocd_pages, amount, RAM_ALLOC_ZEROED)) {
+                return false;
+            }
+        }
+        for(int index = 0; index < amount; ++index) {
+            front.pages[front.length++] = allocd_pages[index]->location;
+        }
+
+        return true;
+    }
+
+    size_t PageTableCache::shrink(const size_t amount) {
+        size_t result = 0;
+        int batch;
+
+        //Empty the shared pool first, then the front stocks of CPUs
+        pool_mutex.grab_spin();
+
+            while(pool_length && (result < amount)) {
+                batch = min(PTABLE_BATCH, pool_length);
+                pool_length-= batch;
+                ram_manager->free_chunk_batch(PID_KERNEL, pool+pool_length, batch);
+                result+= batch*PG_SIZE;
+            }
+
+        pool_mutex.release();
+
+        for(int cpu = 0; (cpu < PTABLE_CACHE_CPUS) && (result < amount); ++cpu) {
+            fronts[cpu].mutex.grab_spin();
+
+                if(fronts[cpu].length) {
+                    ram_manager->free_chunk_batch(PID_KERNEL, fronts[cpu].pages, fronts[cpu].length);
+                    result+= fronts[cpu].length*PG_SIZE;
+                    fronts[cpu].length = 0;
+                }
+
+            fronts[cpu].mutex.release();
+        }
+
+        return result;
     }
 }
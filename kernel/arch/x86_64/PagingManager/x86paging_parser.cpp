@@ -1,4 +1,4 @@
- /* Function parsing x86's multilevel page tables
+ /* Support functions for parsing x86's multilevel page tables
 
     Copyright (C) 2011-2013  Hadrien Grasland
 
@@ -23,224 +23,42 @@
 #include <x86paging_parser.h>
 
 namespace x86paging {
-    //As these constants can have the value we want, we give them the value of the bitshift
-    //which must be applied to a virtual address or length in order to get the index in the relevant
-    //table.
-    const PagingLevel PML4T_LEVEL = 39;
-    const PagingLevel PDPT_LEVEL = 30;
-    const PagingLevel PD_LEVEL = 21;
-    const PagingLevel PT_LEVEL = 12;
-    const PagingLevel LVL_DECREMENT = 9; //Substract this from the current level to go to the next
-                                         //level
-
-    uint64_t paging_parser(uint64_t vaddr,
-                           const uint64_t size,
-                           const PagingLevel level,
-                           uint64_t* page_table,
-                           uint64_t (*item_handler)(uint64_t vaddr,
-                                                    const uint64_t size,
-                                                    const PagingLevel level,
-                                                    uint64_t &table_item,
-                                                    uint64_t* additional_params),
-                           uint64_t* additional_params) {
-        //The size of the virtual address space covered by each item of our table.
-        const uint64_t ITEM_SIZE = 1 << level;
-
-        //The first item which we're going to parse in the table
-        const int first_index = (vaddr >> level)%PTABLE_LENGTH;
-
-        //The number of items which we're going to parse
-        int parsed_length = size >> level;
-        if(size % ITEM_SIZE) {
-            ++parsed_length;
-        }
-        //Check that the requested size does not imply overflowing the table. If it does, abort.
-        if(parsed_length > PTABLE_LENGTH-first_index) return 0;
-
-        //To make the job of el_handler easier, we will adjust the values of vaddr and the size it
-        //receives, so that they are aligned on a table item boundary. Here, we define some
-        //constants used for that
-        const uint64_t vaddr_base = align_down(vaddr, ITEM_SIZE);
-        const uint64_t size_first = min(size, align_up(vaddr, ITEM_SIZE)-vaddr);
-        const uint64_t size_middle = ITEM_SIZE;
-        uint64_t size_last = (size-size_first)%ITEM_SIZE;
-        if(!size_last) size_last = ITEM_SIZE;
-
-        //Parse the table. Make sure result is nonzero for a success even if size is zero.
-        uint64_t result = 1;
-        for(int table_parser = 0; table_parser < parsed_length; ++table_parser) {
-            //Adjust values of vaddr and size sent to el_handler
-            uint64_t eff_vaddr;
-            uint64_t eff_size;
-            if(table_parser == 0) {
-                eff_vaddr = vaddr;
-                eff_size = size_first;
-            } else {
-                eff_vaddr = vaddr_base+table_parser*ITEM_SIZE;
-                if(table_parser == 1) eff_size = size_middle;
-                if(table_parser == parsed_length-1) eff_size = size_last;
-            }
-
-            //Call item_handler on each table item
-            result = item_handler(eff_vaddr,
-                                  eff_size,
-                                  level,
-                                  page_table[first_index+table_parser],
-                                  additional_params);
-            if(!result) return 0; //item_handler has failed ! Abort.
-        }
-
-        return result;
+    bool fits_largepage(const uint64_t size,
+                        const PagingLevel level,
+                        const uint64_t phy_addr,
+                        const uint64_t table_item) {
+        const uint64_t item_size = (uint64_t) 1 << level;
+
+        if(!largepage_level(level)) return false;
+        if((size != item_size) || (phy_addr % item_size)) return false;
+        return !(table_item & 0x000ffffffffff000) || (table_item & PBIT_LARGEPAGE);
     }
 
-    uint64_t dummy_handler(uint64_t vaddr,
-                           const uint64_t size,
-                           const PagingLevel level,
-                           uint64_t &table_item,
-                           uint64_t* additional_params) {
-        //On which level are we ?
-        switch(level) {
-            case PT_LEVEL:
-                //We have reached the page table level, return first additional parameter
-                return additional_params[0];
-            default:
-                //Extract where the next table should be located (if there's one)
-                uint64_t* next_table = (uint64_t*) (table_item & 0x000ffffffffff000);
-
-                //Check if we've reached the lowest accessible level, return 0 in that case
-                if((table_item & PBIT_PRESENT) == 0) return 0;
-                if(!next_table) return 0;
-
-                //Otherwise, parse to the next level
-                return paging_parser(vaddr,
-                                     size,
-                                     level-LVL_DECREMENT,
-                                     next_table,
-                                     &dummy_handler,
-                                     additional_params);
-        }
+    bool largepage_level(const PagingLevel level) {
+        return (level == PD_LEVEL) || ((level == PDPT_LEVEL) && has_1gpages());
     }
 
-    uint64_t fill_4kpaging_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params) {
-        //Have we reached the page table level ? If so, setup a page translation.
-        if(level == PT_LEVEL) {
-            table_item = (additional_params[0]&0x000ffffffffff000)      //Physical base address
-                          + additional_params[2]                        //Offset
-                          + additional_params[1];                       //Flags
-            additional_params[2]+= 0x1000; //Make "offset" move one 4KB page forward
-            return 1;
-        }
+    bool split_largepage(uint64_t& table_item, const PagingLevel level, PageTableCache* ptable_cache) {
+        const uint64_t lower_size = (uint64_t) 1 << (level-LVL_DECREMENT);
+        uint64_t phy_addr, flags;
 
-        //Otherwise, move to the next level of paging structures
-        uint64_t* next_table = (uint64_t*) (table_item & 0x000ffffffffff000);
-        return paging_parser(vaddr,
-                                size,
-                                level-LVL_DECREMENT,
-                                next_table,
-                                &fill_4kpaging_handler,
-                                additional_params);
-    }
+        size_t table_page;
+        if(!ptable_cache->alloc(&table_page, 1)) return false;
+        uint64_t* table = phys_to_virt(table_page);
 
-    uint64_t set_flags_handler(uint64_t vaddr,
-                               const uint64_t size,
-                               const PagingLevel level,
-                               uint64_t &table_item,
-                               uint64_t* additional_params) {
-        //Are we at the lowest level of paging structures ?
-        //If so, overwrite flags and quit.
-        if((level == PT_LEVEL) || (table_item & PBIT_LARGEPAGE)) {
-            table_item = (table_item & 0x000ffffffffff000) + additional_params[0];
-            return 1;
-        }
-
-        //Otherwise, move to the next level of paging structures
-        uint64_t* next_table = (uint64_t*) (table_item & 0x000ffffffffff000);
-        return paging_parser(vaddr,
-                             size,
-                             level-LVL_DECREMENT,
-                             next_table,
-                             &set_flags_handler,
-                             additional_params);
-    }
-
-    uint64_t setup_4kpages_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params) {
-        //Check if next level of paging structures is available.
-        uint64_t* next_table = (uint64_t*) (table_item & 0x000ffffffffff000);
-        if(!next_table) {
-            //If not, allocate paging structures
-            RamManager* ram_manager = (RamManager*) additional_params[0];
-            RamChunk* allocd_page = ram_manager->alloc_chunk(PID_KERNEL);
-            if(!allocd_page) return 0;
-            next_table = (uint64_t*) allocd_page->location;
-
-            //These should be zeroed out before use, to prevent errors and security exploits in
-            //case they aren't initialized properly later.
-            for(int index = 0; index < PTABLE_LENGTH; ++index) next_table[index] = 0;
-
-            //Now we can use them
-            table_item = allocd_page->location + PBIT_PRESENT       //All paging protections
-                                               + PBIT_WRITABLE      //are disabled at this
-                                               + PBIT_USERACCESS;   //level of paging structs.
-        }
-
-        //If we're at the PD level, we're done with our allocation job. Otherwise, move to the next
-        //level of paging structures.
-        if(level == PD_LEVEL) return 1;
-        return paging_parser(vaddr,
-                             size,
-                             level-LVL_DECREMENT,
-                             next_table,
-                             &setup_4kpages_handler,
-                             additional_params);
-    }
-
-    uint64_t remove_paging_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params) {
-        //Have we reached the lowest level of paging structures ?
-        //If so, clear any existing page translation.
-        if((level == PT_LEVEL) || (table_item & PBIT_LARGEPAGE)) {
-            table_item = 0;
-            return 1;
-        }
-
-        //Otherwise, if the next level of paging structures is already nonexistent, skip it
-        if(!table_item) return 1;
-
-        //Parse the next level of paging structures
-        uint64_t* next_table = (uint64_t*) (table_item & 0x000ffffffffff000);
-        uint64_t result = paging_parser(vaddr,
-                                        size,
-                                        level-LVL_DECREMENT,
-                                        next_table,
-                                        &remove_paging_handler,
-                                        additional_params);
-        if(!result) return 0;
-
-        //If the previously parsed table is now empty, free it
-        bool is_empty = true;
+        //The lower-level items map the same memory with the same flags. Only PDEs may still be large
+        //pages, and in large pages bit 12 is used for caching purposes instead of being part of the
+        //physical address.
+        phy_addr = table_item & 0x000fffffffffe000;
+        flags = table_item & (PBIT_NOEXECUTE + 0xfff);
+        if(level-LVL_DECREMENT == PT_LEVEL) flags-= PBIT_LARGEPAGE;
         for(int index = 0; index < PTABLE_LENGTH; ++index) {
-            if(next_table[index]) {
-                is_empty = false;
-                break;
-            }
-        }
-        if(is_empty) {
-            RamManager* ram_manager = (RamManager*) additional_params[0];
-            table_item = 0;
-            ram_manager->free_chunk(PID_KERNEL, (uint64_t) next_table);
+            table[index] = phy_addr + index*lower_size + flags;
         }
 
-        return result;
+        table_item = table_page + PBIT_PRESENT       //All paging protections
+                                + PBIT_WRITABLE      //are disabled at this
+                                + PBIT_USERACCESS;   //level of paging structs.
+        return true;
     }
 }
@@ -16,65 +16,34 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA    02110-1301    USA */
 
+#include <kmath.h>
 #include <new.h>
+#include <panic.h>
 #include <RamManager.h>
+#include <x86asm.h>
+#include <x86cpu.h>
+#include <x86paging.h>
 
 #include <dbgstream.h>
 
 
-bool RamManager::chunk_liberator(RamChunk* chunk) {
-    RamChunk *current_chunk, *next_chunk = chunk;
-
-    do {
-        //Keep track of the next memory map item in the chunk
-        current_chunk = next_chunk;
-        next_chunk = current_chunk->next_buddy;
-
-        //Free current item from its owners and buddies. For non-allocatable items, that's all.
-        pids_liberator(current_chunk->owners);
-        current_chunk->next_buddy = NULL;
-        if(!(current_chunk->allocatable)) continue;
-
-        //For allocatable items, find out which region of memory they belong to...
-        RamChunk** current_free_mem_ptr;
-        if(current_chunk->location >= 0x100000) {
-            current_free_mem_ptr = &free_mem;
-        } else {
-            current_free_mem_ptr = &free_lowmem;
-        }
-        RamChunk*& current_free_mem = *current_free_mem_ptr;
-
-        //...then add them to the appropriate list of free chunks, at the right place.
-        if(current_free_mem == NULL) {
-            current_free_mem = current_chunk;
-            continue;
-        }
-        if(current_free_mem->location > current_chunk->location) {
-            current_chunk->next_buddy = current_free_mem;
-            current_free_mem = current_chunk;
-        } else {
-            RamChunk* previous_free_chunk = current_free_mem;
-            while(previous_free_chunk->next_buddy) {
-                if(previous_free_chunk->next_buddy->location > current_chunk->location) break;
-                previous_free_chunk = previous_free_chunk->next_buddy;
-            }
-            current_chunk->next_buddy = previous_free_chunk->next_buddy;
-            previous_free_chunk->next_buddy = current_chunk;
-        }
-    } while(next_chunk);
-
-    return true;
-}
-
 RamManager::RamManager(const KernelInformation& kinfo) : process_manager(NULL),
+                                                          page_migrator(NULL),
                                                           ram_map(NULL),
                                                           highmem_map(NULL),
-                                                          free_lowmem(NULL),
-                                                          free_mem(NULL),
+                                                          lowmem_zone(0, 0x100000),
+                                                          highmem_zone_amount(0),
+                                                          node_amount(0),
+                                                          bitmap_location(0),
+                                                          bitmap_frames(0),
+                                                          deferring(false),
+                                                          zeroed_pages(NULL),
+                                                          zeroed_amount(0),
                                                           process_list(NULL),
                                                           free_mapitems(NULL),
-                                                          free_pids(NULL),
-                                                          free_procitems(NULL) {
+                                                          free_pidarrays(),
+                                                          free_procitems(NULL),
+                                                          free_owneditems(NULL) {
     //This function...
     //  1/Determines the amount of memory necessary to store the management structures
     //  2/Find this amount of free space in the memory map
@@ -82,29 +51,56 @@ RamManager::RamManager(const KernelInformation& kinfo) : process_manager(NULL),
     //      -Mark reserved memory as non-allocatable
     //      -Pages of nature Bootstrap and Kernel belong to the kernel
     //      -Pages of nature Free and Reserved belong to nobody (PID_INVALID)
+    //  4/Give free memory below RAM_EAGER_INIT to the buddy allocator. The rest is given later.
 
-    size_t mapitems_location, mapitems_size, storage_index;
+    size_t mapitems_location, mapitems_size, bitmap_size, storage_size, storage_index, ram_end;
     const KernelMMapItem* kmmap = kinfo.kmmap;
-    RamChunk *current_item, *last_free = NULL;
+    RamChunk *current_item, *next_item;
 
     //Find out how much map items we will need, at most, to store our memory map items
-    mapitems_size = align_pgup((kinfo.kmmap_length+2)*sizeof(RamChunk));
+    mapitems_size = align_pgup((kinfo.kmmap_length+3)*sizeof(RamChunk));
 
-    //Find an empty chunk of high memory large enough to store our mess... We assume there's one.
+    //Find out how large the bitmap of free memory must be to cover all usable memory
+    ram_end = 0;
+    for(storage_index=0; storage_index<kinfo.kmmap_length; ++storage_index) {
+        if(kmmap[storage_index].nature == NATURE_RES) continue;
+        ram_end = max(ram_end, kmmap[storage_index].location+kmmap[storage_index].size);
+    }
+    bitmap_frames = align_up(align_pgup(ram_end)/PG_SIZE, 64);
+    bitmap_size = align_pgup(bitmap_frames/8);
+    storage_size = mapitems_size+bitmap_size;
+
+    //Find an empty chunk of high memory large enough to store our mess. If there is none, memory
+    //management cannot work.
     for(storage_index=0; storage_index<kinfo.kmmap_length; ++storage_index) {
         if(kmmap[storage_index].location < 0x100000) continue;
         if(kmmap[storage_index].nature != NATURE_FRE) continue;
-        if(kmmap[storage_index].location+kmmap[storage_index].size-align_pgup(kmmap[storage_index].location) >= mapitems_size) {
+        if(kmmap[storage_index].location+kmmap[storage_index].size-align_pgup(kmmap[storage_index].location) >= storage_size) {
             break;
         }
     }
+    if(storage_index == kinfo.kmmap_length) panic(PANIC_NO_MM_STORAGE);
     mapitems_location = align_pgup(kmmap[storage_index].location);
 
-    //Allocate map items in this space
-    RamChunk mapitems_storage;
-    mapitems_storage.location = mapitems_location;
-    mapitems_storage.size = mapitems_size;
-    alloc_mapitems(&mapitems_storage);
+    //Split memory in zones, following the NUMA topology of the system
+    initialize_zones(kinfo);
+    for(int index = 0; index < highmem_zone_amount; ++index) {
+        RamZone& zone = highmem_zones[index];
+        if(zone.location >= RAM_EAGER_INIT) {
+            zone.ready_size = 0;
+        } else if(zone.size > RAM_EAGER_INIT-zone.location) {
+            zone.ready_size = RAM_EAGER_INIT-zone.location;
+        }
+    }
+
+    //Allocate map items and the bitmap of free memory in this space. The rest of the bitmap is
+    //cleared as memory is given to the buddy allocator.
+    store_mapitems(mapitems_location, mapitems_size);
+    bitmap_location = mapitems_location+mapitems_size;
+    uint64_t* const frame_bitmap = (uint64_t*) frame_pointer(bitmap_location);
+    for(size_t index = 0; index < min(bitmap_frames, RAM_EAGER_INIT/PG_SIZE)/64; ++index) {
+        frame_bitmap[index] = 0;
+    }
 
     //Fill the memory map using information from the kinfo structure
     fill_mmap(kinfo);
@@ -114,54 +110,44 @@ RamManager::RamManager(const KernelInformation& kinfo) : process_manager(NULL),
 
     //Locate the beginning of high memory
     current_item = ram_map;
-    last_free = NULL;
-    while(current_item->location < 0x100000) {
-        if(current_item->has_owner(PID_INVALID) && current_item->allocatable) {
-            last_free = current_item;
-        }
-        current_item = current_item->next_mapitem;
-    }
-    free_mem = last_free->next_buddy;
-    last_free->next_buddy = NULL;
+    while(current_item->location < 0x100000) current_item = current_item->next_mapitem;
     highmem_map = current_item;
 
-    //Find the region where we have allocated our map items...
-    last_free = NULL;
+    //Find the region where we have allocated our map items and bitmap...
     while(current_item->location+current_item->size <= mapitems_location) {
-        if(current_item->has_owner(PID_INVALID) && current_item->allocatable) {
-            last_free = current_item;
-        }
         current_item = current_item->next_mapitem;
     }
 
     //...to mark it as allocated (taking into account free space before and after)
     if(current_item->location < mapitems_location) {
         split_chunk(current_item, mapitems_location-current_item->location);
-        last_free = current_item;
         current_item = current_item->next_mapitem;
     }
-    RamChunk* new_free;
-    if(current_item->size > mapitems_size) {
-        split_chunk(current_item, mapitems_size);
-        new_free = current_item->next_mapitem;
-    } else {
-        new_free = current_item->next_buddy;
-    }
-    if(last_free) {
-        last_free->next_buddy = new_free;
-    } else {
-        free_mem = new_free;
-    }
+    if(current_item->size > storage_size) split_chunk(current_item, storage_size);
     current_item->owners = PID_KERNEL;
-    current_item->next_buddy = NULL;
 
     //Startup process management services
     initialize_process_list();
 
-    //Allocate extra map items and PIDs right away
+    //Give free memory below RAM_EAGER_INIT to the buddy allocator
+    current_item = ram_map;
+    while(current_item && (current_item->location < RAM_EAGER_INIT)) {
+        next_item = current_item->next_mapitem;
+        if(current_item->has_owner(PID_INVALID) && current_item->allocatable) {
+            if(current_item->size > RAM_EAGER_INIT-current_item->location) {
+                split_chunk(current_item, RAM_EAGER_INIT-current_item->location);
+                next_item = current_item->next_mapitem;
+            }
+            buddy_free(current_item);
+        }
+        current_item = next_item;
+    }
+
+    //Allocate extra map items, process descriptors and records of owned chunks right away. Arrays
+    //of PIDs are only needed once chunks are shared, so they are allocated on demand.
     alloc_mapitems();
-    alloc_pids();
     alloc_procitems();
+    alloc_owneditems();
 
     //Activate global RAM memory management service
     ram_manager = this;
@@ -171,8 +157,9 @@ RamManager::RamManager(const KernelInformation& kinfo) : process_manager(NULL),
 RamChunk* RamManager::alloc_lowchunk(const PID initial_owner,
                                      const size_t size,
                                      bool contiguous) {
-    RamChunk *result, *lowmem_end = ram_map;
+    RamChunk* result;
     RamManagerProcess* process;
+    RamZone* zone = &lowmem_zone;
 
     proclist_mutex.grab_spin();
 
@@ -188,20 +175,13 @@ RamChunk* RamManager::alloc_lowchunk(const PID initial_owner,
 
         mmap_mutex.grab_spin();
 
-            //Find the end of low memory
-            while(lowmem_end->next_mapitem!=highmem_map) lowmem_end = lowmem_end->next_mapitem;
-
-            //Temporarily make high memory disappear
-            lowmem_end->next_mapitem = NULL;
-
             //Do the allocation job
             result = chunk_allocator(process,
                                      align_pgup(size),
-                                     free_lowmem,
-                                     contiguous);
-
-            //Make high memory come back
-            lowmem_end->next_mapitem = highmem_map;
+                                     &zone,
+                                     1,
+                                     contiguous,
+                                     0);
 
         mmap_mutex.release();
 
@@ -210,6 +190,183 @@ RamChunk* RamManager::alloc_lowchunk(const PID initial_owner,
     return result;
 }
 
+
+void* RamManager::frame_pointer(const size_t location) {
+    //Once PagingManager has mapped all physical memory in the kernel half, it is accessed there,
+    //so that it may be reached from any address space. Before that, the bootstrap code's identity
+    //mapping is used.
+    return x86paging::phys_to_virt(location);
+}
+
+
+void RamManager::copy_memory(const size_t destination, const size_t source, const size_t size) {
+    //Vector registers are not saved by the kernel yet, so only general-purpose registers are used
+    uint64_t to = (uint64_t) frame_pointer(destination), from = (uint64_t) frame_pointer(source);
+    uint64_t count = size/sizeof(uint64_t);
+    __asm__ volatile("rep movsq"
+                     : "+D"(to), "+S"(from), "+c"(count)
+                     :
+                     : "memory");
+}
+
+
+RamZone& RamManager::find_zone(const size_t location) {
+    if(location < 0x100000) return lowmem_zone;
+
+    for(int index = highmem_zone_amount-1; index > 0; --index) {
+        if(location >= highmem_zones[index].location) return highmem_zones[index];
+    }
+    return highmem_zones[0];
+}
+
+
+void RamManager::initialize_zones(const KernelInformation& kinfo) {
+    //This function...
+    //  1/Finds out the NUMA node of each CPU
+    //  2/Splits high memory in zones following NUMA memory ranges. Each zone extends up to the
+    //    beginning of the next one, so that the whole of high memory is covered.
+    //  3/Sorts zones by distance from each node, so that allocations can fall back on the
+    //    closest memory when memory is exhausted on the local node.
+    //Without NUMA topology information, there's only one node and one zone of high memory.
+
+    const KernelNumaInfo& numa_info = kinfo.numa_info;
+    size_t range_index, zone_start, previous_start;
+    uint32_t zone_node = 0, node;
+    const KernelNumaRange* next_range;
+    int index;
+
+    //Find out the NUMA node of each CPU
+    node_amount = min(max(numa_info.node_amount, 1u), (uint32_t) RAM_MAX_NODES);
+    for(index = 0; index < x86cpu::MAX_CPUS; ++index) apic_nodes[index] = 0;
+    for(range_index = 0; range_index < numa_info.cpu_amount; ++range_index) {
+        const KernelNumaCPU& cpu = numa_info.cpus[range_index];
+        if((cpu.apic_id >= (uint32_t) x86cpu::MAX_CPUS) || (cpu.node >= node_amount)) continue;
+        apic_nodes[cpu.apic_id] = cpu.node;
+    }
+
+    //Bind the CPUs which are already running to their node and magazine, in startup order
+    for(uint32_t cpu = 0; cpu < x86cpu::cpu_amount; ++cpu) {
+        for(index = 0; index < x86cpu::MAX_CPUS; ++index) {
+            x86cpu::CpuLocal& local = x86cpu::cpu_locals[index];
+            if(local.self && (local.index == cpu)) bind_cpu(local);
+        }
+    }
+
+    //Find out the relative distance between nodes. If it's unknown, all remote nodes are
+    //considered to be equally far away.
+    for(node = 0; node < node_amount; ++node) {
+        for(uint32_t other_node = 0; other_node < node_amount; ++other_node) {
+            if(numa_info.distances) {
+                node_distances[node][other_node] = numa_info.distances[node*numa_info.node_amount+other_node];
+            } else {
+                node_distances[node][other_node] = (node == other_node) ? 10 : 20;
+            }
+        }
+    }
+
+    //Find the node of the beginning of high memory
+    next_range = NULL;
+    for(range_index = 0; range_index < numa_info.range_amount; ++range_index) {
+        const KernelNumaRange& range = numa_info.ranges[range_index];
+        if(range.node >= node_amount) continue;
+        if((range.location <= 0x100000) && (range.location+range.size > 0x100000)) {
+            next_range = &range;
+            break;
+        }
+        if(!next_range || (range.location < next_range->location)) next_range = &range;
+    }
+    if(next_range) zone_node = next_range->node;
+
+    //Split high memory in zones, going through memory ranges in address order
+    zone_start = previous_start = 0x100000;
+    while(highmem_zone_amount < RAM_MAX_ZONES-1) {
+        next_range = NULL;
+        for(range_index = 0; range_index < numa_info.range_amount; ++range_index) {
+            const KernelNumaRange& range = numa_info.ranges[range_index];
+            if((range.node >= node_amount) || (range.location <= previous_start)) continue;
+            if(!next_range || (range.location < next_range->location)) next_range = &range;
+        }
+        if(!next_range) break;
+        previous_start = next_range->location;
+        if(next_range->node == zone_node) continue;
+
+        highmem_zones[highmem_zone_amount] = RamZone(zone_start, next_range->location-zone_start, zone_node);
+        ++highmem_zone_amount;
+        zone_start = next_range->location;
+        zone_node = next_range->node;
+    }
+    highmem_zones[highmem_zone_amount] = RamZone(zone_start, MAX_RAM_ADDRESS-zone_start+1, zone_node);
+    ++highmem_zone_amount;
+
+    //Sort zones by distance from each node
+    for(node = 0; node < node_amount; ++node) {
+        RamZone** zones = zone_fallback[node];
+        for(index = 0; index < highmem_zone_amount; ++index) {
+            //Insertion sort, keeping zones of equal distance in address order
+            uint8_t distance = node_distances[node][highmem_zones[index].node];
+            int position = index;
+            while((position > 0) && (node_distances[node][zones[position-1]->node] > distance)) {
+                zones[position] = zones[position-1];
+                --position;
+            }
+            zones[position] = &highmem_zones[index];
+        }
+    }
+}
+
+void RamManager::bind_cpu(x86cpu::CpuLocal& cpu) {
+    cpu.node = apic_nodes[cpu.apic_id];
+
+    //The first CPUs to start get a magazine of their own
+    if(cpu.index < (uint32_t) RAM_MAGAZINE_CPUS) {
+        cpu.magazine = cpu.index;
+        magazines[cpu.index].node = cpu.node;
+        return;
+    }
+
+    //Others share the magazine of a CPU of the same node, as magazines only hold local pages.
+    //If there's none, their frees go to the buddy allocator, which is slower but still correct.
+    cpu.magazine = cpu.index % RAM_MAGAZINE_CPUS;
+    for(int index = 0; index < RAM_MAGAZINE_CPUS; ++index) {
+        if(magazines[index].node == cpu.node) {
+            cpu.magazine = index;
+            break;
+        }
+    }
+}
+
+
+uint32_t RamManager::local_node() {
+    //Each CPU keeps its node in its local data, so that CPUID does not have to be asked
+    return x86cpu::cpu_local()->node;
+}
+
+
+RamMagazine& RamManager::local_magazine() {
+    return magazines[x86cpu::cpu_local()->magazine];
+}
+
+
+void RamManager::zero_memory(const size_t location, const size_t size, const bool nontemporal) {
+    //Vector registers are not saved by the kernel yet, so only general-purpose registers are used
+    uint64_t* const start = (uint64_t*) frame_pointer(location);
+    if(nontemporal) {
+        //Memory which is zeroed in advance won't be used soon, so it should not evict useful data
+        //from the CPU caches
+        for(uint64_t* pointer = start; pointer < start+size/sizeof(uint64_t); ++pointer) {
+            __asm__ volatile("movnti %1, %0" : "=m"(*pointer) : "r"((uint64_t) 0));
+        }
+        __asm__ volatile("sfence" : : : "memory");
+    } else {
+        uint64_t destination = (uint64_t) start, count = size/sizeof(uint64_t);
+        __asm__ volatile("rep stosq"
+                         : "+D"(destination), "+c"(count)
+                         : "a"((uint64_t) 0)
+                         : "memory");
+    }
+}
+
+
 void RamManager::print_highmmap() {
     mmap_mutex.grab_spin();
 
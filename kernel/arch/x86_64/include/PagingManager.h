@@ -25,9 +25,10 @@
 #include <pid.h>
 #include <synchronization.h>
 #include <paging_support.h>
+#include <x86paging.h>
 
 
-const int PAGINGMANAGER_VERSION = 3; //Increase this when deep changes require a modification of
+const int PAGINGMANAGER_VERSION = 4; //Increase this when deep changes require a modification of
                                       //the testing protocol
 
 class ProcessManager;
@@ -43,13 +44,22 @@ class PagingManager {
         PageChunk* free_mapitems; //A collection of ready to use paging memory map items
                                   //(chained using next_buddy)
         PagingManagerProcess* free_process_descs; //A collection of ready to use process descriptors
+        bool use_pcid; //Whether address spaces are given PCIDs, so that switching them does not
+                       //flush the TLB
+        uint64_t pcid_bitmap[x86paging::PCID_AMOUNT/64]; //PCIDs which are currently assigned
+        uint64_t pcid_clock; //Incremented on each address space switch, used to stamp processes
+        x86paging::PageTableCache ptable_cache; //Free pages for paging structures
+        uint64_t kernel_half; //PML4T whose kernel half is shared by all non-kernel address spaces
 
         //Support methods
         bool alloc_mapitems(); //Get some memory map storage space
+        void alloc_pcid(PagingManagerProcess* target); //Give a PCID to a process, recycling the least
+                                                       //recently used one if none is free
         bool alloc_process_descs(); //Get some map list storage space
-        PageChunk* alloc_virtual_address_space(PagingManagerProcess* target,
-                                               size_t size,
-                                               size_t location = NULL);
+        PageChunk* alloc_virtual_address_space(PagingManagerProcess* target, //Without a given
+                                               size_t size,                  //location, chunks
+                                               size_t location = NULL,       //are aligned as
+                                               const size_t alignment = PG_SIZE); //requested
         PageChunk* chunk_mapper(PagingManagerProcess* target,
                                 const RamChunk* ram_chunk,
                                 const PageFlags flags,
@@ -63,18 +73,37 @@ class PagingManager {
                                          size_t offset);
         bool chunk_liberator(PagingManagerProcess* target,
                              PageChunk* chunk);
+        PageChunk* find_gap(PageChunk* subtree,   //Find the lowest map item of a subtree of the map
+                            const size_t size,    //index before which there's a hole where a chunk
+                            const size_t alignment); //of that size and alignment fits
         PagingManagerProcess* find_pid(const PID target); //Find the map list entry associated to this PID,
                                                           //return NULL if it does not exist.
         PageChunk* flag_adjust(PagingManagerProcess* target, //Adjust the paging flags associated with a chunk
                                  PageChunk* chunk,
                                  const PageFlags flags,
                                  const PageFlags mask);
-        bool map_k_chunks(PagingManagerProcess* target); //Maps K chunks in a newly created address space
+        void free_pcid(PagingManagerProcess* target); //Take a process' PCID back, if it has one
+        uint64_t lookup_page(PagingManagerProcess* target, //Lowest-level paging entry of a page,
+                             const size_t vir_page);       //as a 4KB page table entry, using the
+                                                           //process' translation cache
+        void map_insert(PagingManagerProcess* target, PageChunk* item); //Put an item in the map, at its location
         bool map_kernel(); //Maps the kernel's initial address space during initialization
+        bool map_physmem(); //Maps all physical memory in the kernel half during initialization
+        void map_remove(PagingManagerProcess* target, PageChunk* item); //Take an item out of the map
+        bool page_copier(PagingManagerProcess* target, //Makes a page of a copy-on-write chunk
+                         PageChunk* chunk,             //writable, copying it first if it is
+                         const size_t vir_addr);       //still shared
+        void page_remapper(PagingManagerProcess* target, //Points the mappings of a page of RAM to
+                           const RamChunk* page,         //its new location, write-protecting
+                           const size_t new_location,    //them if requested
+                           const bool read_only = false);
         bool remove_all_paging(PagingManagerProcess* target);
         bool remove_pid(PID target); //Discards management structures for this PID
         PagingManagerProcess* setup_pid(PID target); //Create management structures for a new PID
-        void unmap_k_chunk(PageChunk* chunk); //Removes K pages from the address space of non-kernel processes.
+        size_t space_start(PagingManagerProcess* target); //Lowest address where chunks may be put
+        void tlb_flush(PagingManagerProcess* target, //Flushes modified translations of an address
+                       x86paging::TlbBatch& tlb_batch); //space from the TLB
+        void unmap_k_chunk(PageChunk* chunk); //Removes K pages from the shared kernel half
         uint64_t x86flags(PageFlags flags); //Converts PageFlags to x86 paging flags
     public:
         PagingManager(RamManager& ram_manager);
@@ -98,14 +127,40 @@ class PagingManager {
                                         const PageFlags flags,
                                         const PageFlags mask);
 
+        //Demand paging : reserve a page chunk in the target address space without mapping any RAM
+        //in it. Pages of RAM are then allocated and mapped one at a time, when they are first
+        //accessed and the resulting page fault is given to handle_page_fault(), which returns false
+        //if the fault can't be resolved. Not available to the kernel, which is identity-mapped.
+        //Write faults in chunks which are copied on write (PAGE_FLAG_C) are resolved there too.
+        PageChunk* reserve_chunk(const PID target,
+                                 const size_t size,
+                                 const PageFlags flags = PAGE_FLAGS_RW);
+        bool handle_page_fault(const PID target, const size_t address, const bool write);
+
+        //Memory compaction support : remap a page of RAM which is moved by RamManager in all the
+        //address spaces of its owners. A first call with a new location of 0 write-protects the
+        //page, so that it may be copied, and keeps those address spaces locked until a second
+        //call maps the copy. The first call gives up and returns false if one of them is busy.
+        //The second call always succeeds, since the page was already mapped at those addresses.
+        bool migrate_page(const RamChunk* page, const size_t new_location);
+
+        //Address translation : get the physical address where a virtual address of a process is
+        //mapped, or NULL if it isn't. Recent translations are kept in a per-process cache.
+        size_t translate(const PID target, const size_t vir_addr);
+
         //x86_64 specific.
-        //Prepare for a context switch by giving the CR3 value to load before jumping
+        //Prepare for a context switch by giving the CR3 value to load before jumping. Where the
+        //processor supports it, this value includes a PCID and asks not to flush the TLB.
         uint64_t cr3_value(const PID target);
+        //Memory reclamation : give the pages of paging structures which are kept in cache back to
+        //RamManager, return how much memory was liberated, in bytes.
+        size_t shrink(const size_t amount);
 
         //Debug methods. Will go out in final release.
         void print_maplist();
         void print_mmap(PID owner);
         void print_pml4t(PID owner);
+        void print_tcache(PID owner); //Translation cache statistics
 };
 
 //Global shortcuts to PagingManager's process management functions
@@ -113,4 +168,13 @@ class PagingManager {
 void paging_manager_remove_process(PID target);
 //TODO : PID paging_manager_update_process(PID old_process, PID new_process);
 
+//Global shortcut to PagingManager's page fault handler, to be called on page faults
+bool paging_manager_page_fault(const PID target, const size_t address, const bool write);
+
+//Global shortcut to PagingManager's page migration function, used by RamManager's memory compaction
+bool paging_manager_migrate_page(const RamChunk* page, const size_t new_location);
+
+//Global shortcut to PagingManager's memory reclamation function, used as a MemAllocator shrinker
+size_t paging_manager_shrink(const size_t amount);
+
 #endif
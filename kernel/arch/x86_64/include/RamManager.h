@@ -26,8 +26,9 @@
 #include <pid.h>
 #include <process_support.h>
 #include <synchronization.h>
+#include <x86cpu.h>
 
-const int RAMMANAGER_VERSION = 3; //Increase this when changes require a modification of
+const int RAMMANAGER_VERSION = 4; //Increase this when changes require a modification of
                                    //the testing protocol
 
 class ProcessManager;
@@ -35,13 +36,40 @@ class RamManager {
     private:
         //Link to other kernel functionality
         ProcessManager* process_manager;
+        bool (*page_migrator)(const RamChunk* page,        //Updates the mappings of pages which
+                              const size_t new_location); //are moved by memory compaction (see
+                                                          //PagingManager::migrate_page)
 
         //Map of Ram (and its mutex)
         OwnerlessMutex mmap_mutex;
         RamChunk* ram_map; //A map of the whole memory
         RamChunk* highmem_map; //A map of high memory (addresses >0x100000)
-        RamChunk* free_lowmem; //A noncontiguous chunk representing free low memory
-        RamChunk* free_mem; //A noncontiguous chunk representing free high memory
+        AddressTree<RamChunk> map_index; //Index of the memory map by address
+        RamZone lowmem_zone; //Buddy allocator free lists for low memory
+        RamZone highmem_zones[RAM_MAX_ZONES]; //...and for high memory, sorted by address
+        int highmem_zone_amount;
+
+        //NUMA topology
+        uint32_t node_amount;
+        uint8_t apic_nodes[x86cpu::MAX_CPUS]; //NUMA node of each CPU, indexed by APIC ID
+        uint8_t node_distances[RAM_MAX_NODES][RAM_MAX_NODES]; //Relative distance between nodes
+        RamZone* zone_fallback[RAM_MAX_NODES][RAM_MAX_ZONES]; //For each node, high memory zones
+                                                             //sorted by increasing distance
+
+        //Bitmap of free memory, with one bit per page which is set when the page is free in the
+        //buddy allocator. It is used to find runs of free memory spanning several buddy blocks.
+        //It's only valid in the part of each zone which has been given to the buddy allocator.
+        size_t bitmap_location; //Physical address of the bitmap (see frame_pointer)
+        size_t bitmap_frames; //Amount of pages covered by the bitmap
+        bool deferring; //Set while deferred memory is being given to the buddy allocator
+
+        //Per-CPU stocks of free pages of high memory
+        RamMagazine magazines[RAM_MAGAZINE_CPUS];
+
+        //Pool of free pages of high memory which have been zeroed in advance, chained as buddies
+        OwnerlessMutex zeroed_mutex;
+        RamChunk* zeroed_pages;
+        size_t zeroed_amount;
 
         //Process management
         OwnerlessMutex proclist_mutex;
@@ -50,33 +78,159 @@ class RamManager {
         //Buffer of management structures
         RamChunk* free_mapitems; //A collection of spare RamChunk objects forming a dummy chunk,
                                  //ready for use in a memory map
-        PIDs* free_pids; //A collection of spare PIDs objects forming a dummy PIDs, ready for use
-                         //in a memory map
+        PIDArray* free_pidarrays[PIDARRAY_CLASSES]; //Spare arrays of PIDs of each size class, for
+                                                    //the owners of shared chunks
         RamManagerProcess* free_procitems; //A collection of space process descriptors forming a
                                            //dummy list, ready for use in the process list
+        OwnerlessMutex owneditems_mutex; //Spare records of owned chunks, ready for use in the
+        RamOwnedItem* free_owneditems;   //owned chunks of processes. Their mutex comes after
+                                         //mmap_mutex in the locking order.
+
+        //Bitmap of free memory
+        bool bitmap_find_run(const RamZone& zone,      //Find a run of free pages in a zone which
+                             const size_t size,        //is at least "size" large and begins on an
+                             const size_t alignment,   //"alignment" boundary
+                             size_t& location);
+        void bitmap_mark(const size_t location, //Mark a region of memory as free or not
+                         const size_t size,
+                         const bool free);
+
+        //Buddy allocator
+        RamChunk* buddy_alloc(RamZone& zone,       //Take a free block of that order from a zone,
+                              const int order,     //splitting larger ones. Reserves of large
+                              const bool honour_reserves); //blocks may be left untouched.
+        RamChunk* buddy_carve(RamZone& zone,        //Take a run of free memory spanning one or
+                              const size_t location, //more blocks out of the buddy allocator.
+                              const size_t size);    //Requires two spare map items.
+        void buddy_free(RamChunk* chunk); //Give a free chunk of any size to the buddy allocator
+        void buddy_insert(RamZone& zone, RamChunk* block, int order); //Put a block in a free list,
+                                                                      //merging it with its buddies
+        RamChunk* buddy_take(RamZone& zone,          //Remove the smallest free block of at
+                             const int min_order,    //least that order from a zone, without
+                             const bool honour_reserves); //splitting it
+        bool deferred_init(RamZone& zone); //Give the next batch of a zone's memory to the buddy
+                                           //allocator. Returns false if there's none left.
+        RamZone& find_zone(const size_t location);
+        RamChunk* highmem_alloc(const uint32_t node,       //Take a free block of high memory of
+                                const int order,           //that order, as close as possible to
+                                const bool honour_reserves); //a NUMA node
+        void initialize_zones(const KernelInformation& kinfo); //Set up zones and NUMA topology
+        uint32_t local_node(); //NUMA node of the current CPU
+        void bind_cpu(x86cpu::CpuLocal& cpu); //Give a CPU its NUMA node and page magazine. CPUs
+                                              //must be bound in startup order, and those which
+                                              //start after RamManager must be bound as they do.
+        void freelist_add(RamZone& zone, RamChunk* block, const int order);
+        void freelist_remove(RamZone& zone, RamChunk* block, const int order);
+
+        //Per-CPU page magazines
+        RamMagazine& local_magazine(); //Magazine of the current CPU
+        RamChunk* magazine_alloc(RamManagerProcess* owner); //Allocate a single page
+        bool magazine_alloc_batch(RamManagerProcess* owner, //Allocate "amount" single pages, all
+                                  RamChunk** pages,         //or nothing
+                                  const size_t amount);
+        void magazine_drain(RamMagazine& magazine, //Give the oldest pages of a magazine back to the
+                            const int amount);     //buddy allocator. Requires mmap_mutex.
+        void magazine_free(RamChunk* page); //Put a free page in a magazine. Requires mmap_mutex.
+        bool magazine_put(RamChunk* page); //Put a free page in a magazine without taking mmap_mutex.
+                                           //Returns false if it must go through magazine_free.
+        bool magazine_give(RamManagerProcess* owner, //Give free single pages to a process.
+                           RamChunk** pages,         //Requires the process' mutex, but not
+                           const size_t amount);     //mmap_mutex. On failure, the pages are
+                                                     //freed.
+        size_t magazine_reclaim(const RamMagazine* spared_magazine, //Drain the magazines of other
+                                const size_t amount,                //CPUs, then the pool of zeroed
+                                const RamZone* zone = NULL);        //pages, until "amount" bytes
+                                                                    //are given back, only taking
+                                                                    //pages of "zone" if set.
+                                                                    //Returns how much was given
+                                                                    //back. Requires mmap_mutex.
+        bool magazine_take_batch(RamChunk** pages,     //Take "amount" free single pages, all or
+                                 const size_t amount); //nothing, without giving them to anyone
+
+        //Pool of pre-zeroed pages
+        void zero_memory(const size_t location, //Fill memory with zeroes. Non-temporal stores
+                         const size_t size,     //keep it out of the CPU caches.
+                         const bool nontemporal);
+        bool zeroed_alloc_batch(RamManagerProcess* owner, //Allocate "amount" zeroed single pages,
+                                RamChunk** pages,         //all or nothing
+                                const size_t amount);
+        void zeroed_insert(RamChunk** pages, const size_t amount); //Put zeroed pages in the pool
+        void magazine_refill(RamMagazine& magazine); //Requires mmap_mutex
+
+        //Memory compaction. Only single pages which are owned by processes other than the kernel,
+        //and have never been shared, are moved, since these are only accessed through paging.
+        bool compact(RamZone& zone,              //Move used pages out of the way until a run of
+                     const size_t size,          //free memory at least "size" large, beginning on
+                     const size_t alignment,     //an "alignment" boundary, exists. Requires
+                     RamManagerProcess* locked); //mmap_mutex, and the mutex of "locked" if any.
+        RamChunk* compact_migrate(RamChunk* page,            //Move a used page out of a window of
+                                  const int window_order,    //that order, return the free map
+                                  RamManagerProcess* locked); //item left at its place or NULL on
+                                                              //failure
+        bool compact_window(const RamZone& zone, //Find the window of memory of that size where
+                            const size_t size,   //the least pages must be moved to free it
+                            const size_t stride,
+                            size_t& location);
+        int fragmentation(const RamZone& zone, const int order); //Fragmentation index of a zone
+        void swap_mapitems(RamChunk* first, RamChunk* second); //Two map items of the same size
+                                                               //trade places in the memory map
 
         //Support methods used by public methods
-        bool alloc_mapitems(RamChunk* free_mem_override = NULL);
-        bool alloc_pids();
+        bool alloc_mapitems();
+        bool alloc_pidarrays(const int size_class);
+        bool alloc_owneditems(); //Requires mmap_mutex
         bool alloc_procitems();
         RamChunk* chunk_allocator(RamManagerProcess* owner,
                                   const size_t size,
-                                  RamChunk*& free_mem_used,
-                                  bool contiguous);
-        bool chunk_liberator(RamChunk* chunk);
+                                  RamZone** zones,       //Zones to allocate from, by order of
+                                  const int zone_amount, //preference
+                                  bool contiguous,
+                                  const RamAllocFlags flags);
+        void chunk_insert(RamChunk*& chunk, RamChunk* piece); //Add a piece to a noncontiguous chunk
+        bool chunk_liberator(RamChunk* chunk,               //Free pages may be kept in the
+                             const bool cache_pages = true); //current CPU's magazine
         bool chunk_owneradd(RamManagerProcess* new_owner, RamChunk* chunk);
-        bool chunk_ownerdel(RamManagerProcess* former_owner, RamChunk* chunk);
+        bool chunk_ownerdel(RamManagerProcess* former_owner,
+                            RamChunk* chunk,
+                            const bool cache_pages = true);
+        bool chunk_split(RamChunk* piece,         //Split a piece of a chunk in two, keeping all of
+                         const size_t position); //its owners and both halves in the chunk
+        void copy_memory(const size_t destination, //Copy "size" bytes of memory
+                         const size_t source,
+                         const size_t size);
         void discard_empty_chunks();
         void fill_mmap(const KernelInformation& kinfo);
         RamManagerProcess* find_process(const PID target);
         void fix_overlap(RamChunk* first_chunk, RamChunk* second_chunk);
         RamChunk* generate_chunk(const KernelInformation& kinfo, size_t& index);
+        RamManagerProcess* grab_process_attempt(const PID target); //Find a process and attempt to
+                                                                   //grab its mutex, while holding
+                                                                   //mmap_mutex. NULL on failure.
         bool initialize_process_list();
         void killer(RamManagerProcess* target);
         void merge_with_next(RamChunk* first_item); //Merge two consecutive elements of
                                                        //the memory map (in order to save space)
+        void owned_link(RamManagerProcess* owner, //Put a chunk in the tree of chunks owned by a
+                        RamChunk* chunk,          //process, using a record from owneditems_take
+                        RamOwnedItem* item);
+        void owned_unlink(RamManagerProcess* owner, RamChunk* chunk); //...or take it out. Both
+                                                                      //require the process' mutex.
+        RamChunk* owned_page(RamManagerProcess* owner, //Find a single page which only a process
+                             const size_t location);   //owns and has never shared, using its
+                                                       //tree of owned chunks. Requires the
+                                                       //process' mutex, but not mmap_mutex.
+        RamOwnedItem* owneditems_take(const size_t amount,     //Take "amount" spare records of
+                                      const bool mmap_locked); //owned chunks, all or nothing,
+                                                               //chained using next_item
+        void owneditems_liberator(RamOwnedItem* items); //Give such records back
+        void pidarray_liberator(PIDArray* target);
+        bool pids_add(PIDs& target, const PID new_pid); //Add an owner to a chunk's owners
         void pids_liberator(PIDs& target);
+        bool pids_remove(PIDs& target, const PID former_pid); //Remove an owner from a chunk's
+                                                              //owners
         bool split_chunk(RamChunk* chunk, const size_t position);
+        void store_mapitems(const size_t location, //Turn a region of memory into spare map items
+                            const size_t size);
     public:
         RamManager(const KernelInformation& kinfo);
 
@@ -91,12 +245,48 @@ class RamManager {
         //Page/chunk allocation, sharing and freeing functions
         RamChunk* alloc_chunk(const PID initial_owner,     //Allocates a chunk of memory which is
                               const size_t size = PG_SIZE, //at least "size" large. The
-                               bool contiguous = false);    //"contiguous" flag forces it to be
-                                                              //physically contiguous
+                               bool contiguous = false,     //"contiguous" flag forces it to be
+                              const RamAllocFlags flags = 0); //physically contiguous, "flags" may
+                                                              //request large frames or zeroing
+        RamChunk* alloc_copy(const PID initial_owner, //Allocates a single page which holds a copy
+                             const size_t source);    //of the page of memory at "source"
         bool share_chunk(const PID new_owner,  //Add owners to a chunk
                          size_t chunk_beginning);
         bool free_chunk(const PID former_owner,  //Free a chunk from a PID's grasp
                         size_t chunk_beginning); //(liberate it if it no longer has any owner)
+        bool unshare_page(const PID former_owner, //Give up a PID's share of a single page of a
+                          const size_t location); //chunk which others keep sharing, as happens
+                                                  //once it has its own copy of that page
+        bool alloc_chunk_batch(const PID initial_owner, //Allocates "amount" single pages at once,
+                               RamChunk** pages,        //storing them in "pages". Either all of
+                               const size_t amount,     //them are allocated, or none is.
+                               const RamAllocFlags flags = 0); //Only RAM_ALLOC_ZEROED is supported.
+        bool free_chunk_batch(const PID former_owner,         //Frees "amount" chunks at once.
+                              const size_t* chunk_beginnings, //Returns false if any of them could
+                              const size_t amount);           //not be freed.
+
+        //Physical memory access
+        void* frame_pointer(const size_t location); //Where the kernel may access physical memory
+
+        //Memory reclamation
+        size_t shrink(const size_t amount); //Give memory held in caches back, return how much
+
+        //Memory compaction. Moved pages are remapped by a "page migrator" function, which must not
+        //wait for locks. The first call of a migration may return false if the page cannot be
+        //remapped, but the second call, which maps the copy, must always succeed.
+        void set_page_migrator(bool (*migrator)(const RamChunk* page, const size_t new_location));
+        int fragmentation_index(const int order = RAM_ORDER_2M); //Share of free high memory, in
+                                                                 //thousandths, which is made of
+                                                                 //blocks smaller than that order
+
+        //Idle-time work, which may also be done by secondary CPUs
+        bool init_deferred_memory(); //Give memory which was left alone at boot time to the buddy
+                                     //allocator, a batch at a time. Returns false if there's
+                                     //nothing left to do.
+        bool compact_memory(); //Compact zones of high memory which are too fragmented. Returns
+                               //false if there's nothing left to do.
+        bool zero_free_pages(); //Zero some free pages in advance. Returns false if there's nothing
+                                //left to do.
 
         //x86_64-specific methods
         RamChunk* alloc_lowchunk(const PID initial_owner, //Allocate a chunk of low memory
@@ -114,6 +304,8 @@ class RamManager {
         void print_highmmap(); //Print a map of high memory (>=1MB)
         void print_lowmmap(); //Print a map of low memory (<1MB)
         void print_proclist(); //Print a list of processes along with their properties
+        void print_magazines(); //Print per-CPU page magazine statistics
+        void print_fragmentation(); //Print the fragmentation index of each zone
 };
 
 extern RamManager* ram_manager;
@@ -123,4 +315,7 @@ extern RamManager* ram_manager;
 void ram_manager_remove_process(PID target);
 //TODO: PID ram_manager_update_process(PID old_process, PID new_process);
 
+//Global shortcut to RamManager's memory reclamation function, used as a MemAllocator shrinker
+size_t ram_manager_shrink(const size_t amount);
+
 #endif
@@ -38,6 +38,19 @@
                     :"r"(code)\
                     :"%eax", "%ebx", "%ecx", "%edx")
 
+// CPUID instruction, for leaves which are divided in subleaves
+#define cpuid_count(code, subcode, eax, ebx, ecx, edx) \
+  __asm__ volatile ("mov %4, %%eax; \
+                     mov %5, %%ecx; \
+                     cpuid; \
+                     movl %%eax, %0; \
+                     movl %%ebx, %1;\
+                     movl %%ecx, %2;\
+                     movl %%edx, %3"\
+                    :"=m"(eax), "=m"(ebx), "=m"(ecx), "=m"(edx)\
+                    :"r"(code), "r"(subcode)\
+                    :"%eax", "%ebx", "%ecx", "%edx")
+
 //Read the CR3 register (for paging operation)
 #define rdcr3(cr3) \
   __asm__ volatile("mov %%cr3, %%rax;\
@@ -45,6 +58,51 @@
                    :"=m" (cr3)\
                    :\
                    :"%eax")
+
+//Write the CR3 register (switches address spaces, flushing the TLB unless PCIDs say otherwise)
+#define wrcr3(cr3) \
+  __asm__ volatile("mov %0, %%cr3"\
+                   :\
+                   :"r" (cr3)\
+                   :"memory")
+
+//Read and write the CR4 register (for enabling processor features)
+#define rdcr4(cr4) \
+  __asm__ volatile("mov %%cr4, %%rax;\
+                    mov %%rax, %0"\
+                   :"=m" (cr4)\
+                   :\
+                   :"%rax")
+#define wrcr4(cr4) \
+  __asm__ volatile("mov %0, %%cr4"\
+                   :\
+                   :"r" (cr4)\
+                   :"memory")
+
+//Write a model-specific register
+#define wrmsr(msr, value) \
+  __asm__ volatile("wrmsr"\
+                   :\
+                   :"c" ((uint32_t) (msr)), "a" ((uint32_t) (value)), "d" ((uint32_t) ((value) >> 32))\
+                   :"memory")
+
+//Invalidate the TLB entry of a page
+#define invlpg(address) \
+  __asm__ volatile("invlpg (%0)"\
+                   :\
+                   :"r" (address)\
+                   :"memory")
+
+//Invalidate TLB entries tagged with a PCID (type 0 : the entry of one page, type 1 : all entries
+//of the PCID save for global ones, types 2 and 3 : all entries of all PCIDs)
+#define invpcid(type, pcid, address) \
+  do { \
+    uint64_t _descriptor[2] = {(pcid), (address)}; \
+    __asm__ volatile("invpcid %0, %1"\
+                     :\
+                     :"m" (_descriptor), "r" ((uint64_t) (type))\
+                     :"memory"); \
+  } while(0)
  
 // Write a byte to an I/O port
 #define outb(value, port)                                       \
@@ -0,0 +1,50 @@
+ /* Per-CPU data
+
+      Copyright (C) 2010-2013  Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA */
+
+#ifndef _X86CPU_H_
+#define _X86CPU_H_
+
+#include <stdint.h>
+
+namespace x86cpu {
+    //Each CPU keeps a few facts about itself in a structure which its GS segment base points to,
+    //so that code which must know which CPU it runs on, such as per-CPU caches, does not have to
+    //ask CPUID. CPUID is serializing, and traps to the hypervisor in virtual machines.
+    const int MAX_CPUS = 256; //Initial APIC IDs are 8-bit wide
+    const uint32_t MSR_GS_BASE = 0xc0000101; //Model-specific register holding the GS segment base
+    struct CpuLocal {
+        CpuLocal* self; //Address of this structure, which is read through GS
+        uint32_t apic_id; //Initial APIC ID of the CPU, which identifies it
+        uint32_t index; //Dense index of the CPU, given in startup order. APIC IDs are often sparse
+                        //(e.g. each socket starting at a round number), so per-CPU arrays use this.
+        uint32_t node; //NUMA node of the CPU, set by RamManager (0 until then)
+        uint32_t magazine; //Page magazine of the CPU, set by RamManager (0 until then)
+    };
+    extern CpuLocal cpu_locals[MAX_CPUS]; //Data of each CPU, indexed by initial APIC ID
+    extern uint32_t cpu_amount; //Amount of CPUs which have run init_cpu_local
+
+    inline CpuLocal* cpu_local() { //Data of the current CPU (set up by init_cpu_local)
+        CpuLocal* result;
+        __asm__("mov %%gs:0, %0" : "=r"(result));
+        return result;
+    }
+}
+
+extern "C" void init_cpu_local(); //Set up the current CPU's data. Run once on each CPU, at startup.
+
+#endif
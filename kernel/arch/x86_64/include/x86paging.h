@@ -43,44 +43,196 @@ namespace x86paging {
     const uint64_t PBIT_NOEXECUTE = 0x8000000000000000; //Prevents execution of data referenced by
                                                         //this paging structure.
 
+    /* Process-context identifiers (PCIDs) tag TLB entries with the address space they belong to */
+    const uint64_t CR3_NOFLUSH = 0x8000000000000000; //Loading CR3 with this bit set keeps the TLB
+                                                     //entries tagged with the loaded PCID.
+    const uint64_t CR4_PCIDE = (1<<17); //Enables PCIDs, which are then found in the low bits of CR3
+    const int PCID_AMOUNT = 4096; //Number of distinct PCIDs
+    const uint64_t CR4_PGE = (1<<7); //Enables global pages, which the TLB keeps across switches
+
+    /* The kernel half of address spaces, where RAM is identity-mapped, covers their first PML4
+       entries. In all non-kernel address spaces, these point to the same PDPTs, which hold the
+       kernel's K pages and are allocated once and for all. K pages are thus mapped everywhere at
+       once, and user memory lies above the kernel half. */
+    const int KERNEL_PML4_ENTRIES = 8; //Amount of PML4 entries in the kernel half
+    const uint64_t KERNEL_SPACE_END = (uint64_t) KERNEL_PML4_ENTRIES << 39; //End of the kernel half
+
+    /* The upper part of the kernel half holds a linear map of all physical memory, made of large
+       pages, so that the kernel may access any frame (paging structures included) from any
+       address space. Until that map is set up, physical memory is accessed through the identity
+       mapping which the bootstrap code has left behind. */
+    const uint64_t PHYSMAP_START = KERNEL_SPACE_END/2; //Virtual address of the physical map
+    const uint64_t PHYSMAP_SIZE = KERNEL_SPACE_END-PHYSMAP_START; //Maximal amount of mapped memory
+    extern uint64_t physmap_offset; //Virtual address where physical address 0 is currently mapped
+    inline uint64_t* phys_to_virt(const uint64_t phy_addr) { //Where a frame may be accessed
+        return (uint64_t*) (phy_addr+physmap_offset);
+    }
+    inline uint64_t virt_to_phys(const void* vir_addr) { //Reverse of phys_to_virt
+        return (uint64_t) vir_addr-physmap_offset;
+    }
+
     /* Other useful data... */
     const int PTABLE_LENGTH = 512; //Size of a table/directory/... in entries
     const int PENTRY_SIZE = 8; //Size of a paging structure entry in bytes
-
-    void create_pml4t(uint64_t location); //Create an empty PML4T at that location
-
-    void fill_4kpaging(const uint64_t phy_addr,     //Have "length" bytes of RAM memory,
-                       uint64_t vir_addr,            //starting at phy_addr, be mapped in the
-                       const uint64_t size,         //virtual address space of a process,
-                       uint64_t flags,               //starting at vir_addr.
-                       uint64_t pml4t_location);     //(This function assumes that paging
-                                                      //structures are already allocated and
-                                                      //set up for 4k paging.)
+    const int PTABLE_BATCH = 32; //Paging structures are allocated and freed this many at a time
+    const int TLB_BATCH_RANGES = 16; //Amount of virtual address ranges in a TLB flush batch
+    const uint64_t TLB_FLUSH_THRESHOLD = 32; //Above this amount of TLB entries, flushing the whole
+                                             //TLB is cheaper than invalidating entries one by one
+
+    //Paging edits queue the translations which they modify in a TLB flush batch, which is then
+    //flushed all at once. TLB shootdown, once implemented, is to send the same batch to other
+    //processors. Translations are stored as ranges of entries of the same size (4KB or large
+    //page), and batches which overflow are flushed entirely.
+    struct TlbRange {
+        uint64_t vaddr;
+        uint64_t size;
+        uint64_t entry_size;
+    };
+    struct TlbBatch {
+        TlbRange ranges[TLB_BATCH_RANGES];
+        int range_count;
+        uint64_t entries; //Amount of TLB entries to be invalidated
+        bool global; //Whether some of these entries are global
+        TlbBatch() : range_count(0), entries(0), global(false) {}
+        void add(const uint64_t vaddr, const uint64_t entry_size, const bool global_entry) {
+            ++entries;
+            global = global || global_entry;
+            if(range_count) {
+                TlbRange& last = ranges[range_count-1];
+                if((last.entry_size == entry_size) && (last.vaddr+last.size == vaddr)) {
+                    last.size+= entry_size;
+                    return;
+                }
+            }
+            if(range_count == TLB_BATCH_RANGES) {
+                entries = TLB_FLUSH_THRESHOLD+1;
+                return;
+            }
+            ranges[range_count].vaddr = vaddr;
+            ranges[range_count].size = entry_size;
+            ranges[range_count].entry_size = entry_size;
+            ++range_count;
+        }
+        bool empty() const {return !entries;}
+        bool full_flush() const {return entries > TLB_FLUSH_THRESHOLD;}
+    };
+
+    //Pages of paging structures are allocated and freed all the time as memory is mapped and
+    //unmapped, so PagingManager keeps a cache of free ones instead of going to RamManager for each
+    //of them. Each CPU has a front stock of pages, which is refilled from and drained to a shared
+    //pool a batch at a time, and the pool is itself refilled from and drained to RamManager.
+    //Cached pages are always zeroed : paging structures must be empty when they are freed.
+    const int PTABLE_CACHE_CPUS = 64; //CPUs beyond this number share front stocks with other CPUs
+    const int PTABLE_FRONT_SIZE = 2*PTABLE_BATCH; //Maximal amount of pages in a front stock
+    const int PTABLE_POOL_SIZE = 16*PTABLE_BATCH; //Maximal amount of pages in the shared pool
+    struct PageTableFront {
+        OwnerlessMutex mutex;
+        int length;
+        size_t pages[PTABLE_FRONT_SIZE]; //Physical addresses of the pages, most recently freed on top
+        PageTableFront() : length(0) {}
+    };
+    class PageTableCache {
+        private:
+            RamManager* ram_manager;
+            PageTableFront fronts[PTABLE_CACHE_CPUS];
+            OwnerlessMutex pool_mutex; //Hold that mutex when manipulating the shared pool
+            int pool_length;
+            size_t pool[PTABLE_POOL_SIZE];
+            void drain(PageTableFront& front); //Give the oldest batch of pages of a front stock
+                                               //back. Requires the front's mutex.
+            PageTableFront& local_front(); //Front stock of the current CPU
+            bool refill(PageTableFront& front); //Put a batch of pages in a front stock, return
+                                                //false if there's no memory left. Requires the
+                                                //front's mutex.
+        public:
+            PageTableCache(RamManager* ram_man) : ram_manager(ram_man), pool_length(0) {}
+            bool alloc(size_t* pages, const uint64_t amount); //Get "amount" zeroed pages, or none
+            void free(const size_t* pages, const uint64_t amount); //Give empty paging structures back
+            size_t shrink(const size_t amount); //Give cached pages back to RamManager, return how
+                                                //much memory has been liberated, in bytes
+    };
+
+    uint64_t create_kernel_half(PageTableCache* ptable_cache); //Allocate a PML4T and the PDPTs of
+                                                               //its kernel half, return its
+                                                               //location or 0 if that failed
+
+    uint64_t create_pml4t(PageTableCache* ptable_cache,     //Allocate an empty PML4T, return its
+                          const uint64_t kernel_half = 0); //location or 0 if that failed. If the
+                                                           //PML4T from create_kernel_half is
+                                                           //given, its kernel half is linked.
+
+    bool enable_pcid(); //Enable PCIDs if the processor supports them, tell whether that worked
+
+    void fill_paging(const uint64_t phy_addr,     //Have "length" bytes of RAM memory,
+                     uint64_t vir_addr,           //starting at phy_addr, be mapped in the
+                     const uint64_t size,         //virtual address space of a process,
+                     uint64_t flags,              //starting at vir_addr, using large pages
+                     uint64_t pml4t_location);    //where possible. (This function assumes that
+                                                  //paging structures are already allocated and
+                                                  //set up by setup_paging.)
+
+    uint64_t find_frame(const uint64_t phy_addr,       //Find where a page of physical memory is
+                        const uint64_t vir_addr,       //mapped in a range of virtual addresses
+                        const uint64_t size,           //of a process, return 0 if it isn't.
+                        const uint64_t pml4t_location); //Only works with 4KB pages.
 
     uint64_t find_lowestpaging(const uint64_t vaddr,           //Find the lowest level of paging
                                const uint64_t pml4t_location); //structures associated with a linear
                                                                //address, return 0 if that address
                                                                //is invalid.
 
+    void flush_tlb(const TlbBatch& batch); //Flush a batch of translations of the current address
+                                           //space (or global ones) from the TLB
+
+    void flush_tlb_pcid(const TlbBatch& batch, //Flush a batch of translations of the address space
+                        const uint16_t pcid);  //tagged with "pcid" from the TLB (requires INVPCID)
+
+    bool free_paging(const uint64_t vir_addr,   //Free all paging structures in a range of virtual
+                     const uint64_t size,       //addresses made of whole PML4T entries, at once,
+                     uint64_t pml4t_location,   //without removing translations one by one nor
+                     RamManager* ram_manager);  //flushing the TLB. Only for dead address spaces.
+
     uint64_t get_target(const uint64_t vaddr,         //Get the physical memory address associated
                         const uint64_t pml4t_location); //with a linear address (if it does exist).
 
     uint64_t get_pml4t(); //Return address of the current PML4T
 
-    bool remove_paging(uint64_t vir_addr,  //Remove page translations in a virtual address range
-                       const uint64_t size,
-                       uint64_t pml4t_location,
-                       RamManager* ram_manager);
+    bool has_1gpages(); //Tells whether the processor supports 1GB pages
+
+    bool has_invpcid(); //Tells whether the processor supports the INVPCID instruction
+
+    bool has_pcid(); //Tells whether the processor supports PCIDs
 
-    uint64_t setup_4kpages(uint64_t vir_addr,          //Setup paging structures for 4KB paging in
-                           const uint64_t size,        //a virtual address range.
-                           uint64_t pml4t_location,
-                           RamManager* ram_manager);
+    bool map_physical_memory(const uint64_t ram_size,       //Map the first "ram_size" bytes of
+                             const uint64_t kernel_half,    //physical memory at PHYSMAP_START in
+                             const uint64_t pml4t_location, //the kernel half and in the kernel's
+                             PageTableCache* ptable_cache); //PML4T, then use that map from now on
 
-    void set_flags(uint64_t vaddr,         //Sets a whole linear address block's paging flags to
-                   const uint64_t size,    //"flags"
-                   uint64_t flags,
-                   uint64_t pml4t_location);
+    void release_frames(const uint64_t vir_addr,       //Give the pages of physical memory which
+                        const uint64_t size,           //are mapped in a range of virtual addresses
+                        uint64_t pml4t_location,       //back to RamManager, for memory which is
+                        RamManager* ram_manager,       //allocated on demand or copied on write.
+                        const PID owner,               //Pages of "mapped_chunk" and the
+                        const RamChunk* mapped_chunk); //translations themselves are left alone.
+
+    bool remove_paging(uint64_t vir_addr,  //Remove page translations in a virtual address range,
+                       const uint64_t size, //queuing them in a TLB flush batch
+                       uint64_t pml4t_location,
+                       PageTableCache* ptable_cache,
+                       TlbBatch& batch);
+
+    uint64_t setup_paging(const uint64_t phy_addr,     //Setup paging structures in a virtual
+                          uint64_t vir_addr,           //address range, where physical memory
+                          const uint64_t size,         //starting at phy_addr is going to be
+                          uint64_t pml4t_location,     //mapped. Large pages are used where
+                          PageTableCache* ptable_cache); //possible, 4KB paging elsewhere.
+
+    bool set_flags(uint64_t vaddr,         //Sets a whole linear address block's paging flags to
+                   const uint64_t size,    //"flags". Returns false if large pages had to be split
+                   uint64_t flags,         //and there was no memory left to do so.
+                   uint64_t pml4t_location, //Modified translations are queued in a TLB
+                   PageTableCache* ptable_cache, //flush batch.
+                   TlbBatch& batch);
 }
 
 #endif
@@ -1,6 +1,6 @@
  /* Functions for parsing x86 page tables
 
-      Copyright (C) 2011  Hadrien Grasland
+      Copyright (C) 2011-2013  Hadrien Grasland
 
     This program is free software; you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -19,104 +19,450 @@
 #ifndef _X86_PAGING_PARSER_H_
 #define _X86_PAGING_PARSER_H_
 
+#include <align.h>
+#include <kmath.h>
 #include <stdint.h>
+#include <RamManager.h>
+#include <x86paging.h>
 
 namespace x86paging {
     //This special integer type is used to describe at which level of the paging hierarchy we are.
+    //As levels can have the value we want, we give them the value of the bitshift which must be
+    //applied to a virtual address or length in order to get the index in the relevant table.
     typedef int PagingLevel;
-    extern const PagingLevel PML4T_LEVEL;
-    extern const PagingLevel PDPT_LEVEL;
-    extern const PagingLevel PD_LEVEL;
-    extern const PagingLevel PT_LEVEL;
-    extern const PagingLevel LVL_DECREMENT; //Substract this from the current level to go to the
-                                            //next level
+    const PagingLevel PML4T_LEVEL = 39;
+    const PagingLevel PDPT_LEVEL = 30;
+    const PagingLevel PD_LEVEL = 21;
+    const PagingLevel PT_LEVEL = 12;
+    const PagingLevel LVL_DECREMENT = 9; //Substract this from the current level to go to the next
+                                         //level
 
     //To parse a block of virtual memory in x86's multilevel paging structures requires the
-    //paging_parser function and an item_handler function. It works as follows :
-    //  -paging_parser parses the top-level page table (PML4T) and gives each relevant item of said
-    //    table to the provided item_hander function.
-    //  -item_handler applies the required modifications at this level of page table (if any), then
-    //    calls paging_parser at the lower level.
-    //  -Everything is repeated recursively until item_handler is called at the lowest level we
-    //    want to reach.
-    //  -If item_handler returns 0, paging_parser aborts its operation, since it means something has
-    //    failed. If item_handler returns anything else, paging_parser returns the value returned by
-    //    the last item_handler.
+    //PagingWalker template and a handler object. It works as follows :
+    //  -PagingWalker parses a table at a given level and gives each relevant item of said table,
+    //    along with the part of the virtual address block which it covers, to the handler's
+    //    enter<LEVEL>() method.
+    //  -enter() applies the required modifications at this level of page table (if any), then
+    //    tells the walker whether it should move to the next item (WALK_NEXT), parse the table
+    //    which this item points to first (WALK_DOWN), or abort (WALK_ABORT).
+    //  -Once a lower-level table has been parsed, the handler's leave<LEVEL>() method is called on
+    //    the item pointing to it. If it returns false, parsing is aborted.
+    //  -The walker returns false if parsing has been aborted, and true otherwise.
     //
-    //To do anything serious, item handlers requires more parameters than just the page table item.
-    //These additional parameters are provided in the form of an array of 64-bit unsigned integers,
-    //additional_params, which is passed to the paging_parser function and just transmitted as is to
-    //item handers.
-    uint64_t paging_parser(uint64_t vaddr,
-                           const uint64_t size,
-                           const PagingLevel level,
-                           uint64_t* page_table,
-                           uint64_t (*item_handler)(uint64_t vaddr,
-                                                    const uint64_t size,
-                                                    const PagingLevel level,
-                                                    uint64_t &table_item,
-                                                    uint64_t* additional_params),
-                           uint64_t* additional_params);
-
-    //Sample item handler : parses the paging structures down to the lowest accessible level,
-    //returns a given value if it's the page table level and 0 otherwise.
-    //
-    //additional_params contents :
-    //  0 - The returned value in case of a success
-    uint64_t dummy_handler(uint64_t vaddr,
-                           const uint64_t size,
-                           const PagingLevel level,
-                           uint64_t &table_item,
-                           uint64_t* additional_params);
-
-    //fill_4kpaging item handler : Maps a block of physical addresses at a designated area of the
-    //virtual address space of a process, using 4KB paging.
-    //We assume that the required structures are already allocated at the moment, so this function
-    //is in fact void, always returning 1.
-    //
-    //additional_params contents :
-    //  0 - Beginning of the block of physical addresses to be mapped
-    //  1 - Flags to be used at the page table level when mapping it
-    //  2 - "offset" integer, initially set to zero and incremented by the handler as time
-    //      passes to keep track of where it is.
-    uint64_t fill_4kpaging_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params);
-
-    //set_flags item handler : Sets the flags of a block of virtual addresses to a new value.
-    //
-    //additional_params contents :
-    //  0 - New flags to be set
-    uint64_t set_flags_handler(uint64_t vaddr,
-                               const uint64_t size,
-                               const PagingLevel level,
-                               uint64_t &table_item,
-                               uint64_t* additional_params);
-
-    //setup_4kpages item handler : Sets up a range of virtual addresses in a process' address space
-    //for 4KB paging, so that there's only physical addresses and flags at PT level left to fill.
-    //Allocates paging structures when they're not allocated yet.
-    //
-    //additional_params contents :
-    //  0 - Pointer to a PhyMemManager, used to allocate the nonexistent pages
-    uint64_t setup_4kpages_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params);
-
-    //remove_paging item handler : Removes all address translations in a range of virtual addresses,
-    //freeing paging structures if they're not used anymore.
-    //
-    //additional_params contents :
-    //  0 - Pointer to a PhyMemManager, used to free the useless paging structures
-    uint64_t remove_paging_handler(uint64_t vaddr,
-                                   const uint64_t size,
-                                   const PagingLevel level,
-                                   uint64_t &table_item,
-                                   uint64_t* additional_params);
+    //Both the handler type and the level are template parameters, so that the compiler may inline
+    //handlers and unroll the walk through the hierarchy. Handlers carry the state they need as
+    //members, and inherit the default behaviour of PagingHandler.
+    enum WalkStep {WALK_ABORT, WALK_NEXT, WALK_DOWN};
+
+    template<PagingLevel LEVEL, typename Handler>
+    struct PagingWalker {
+        static bool walk(uint64_t vaddr, uint64_t size, uint64_t* page_table, Handler& handler);
+    };
+
+    //Items of the page table level point to no table, so the walk stops there
+    template<typename Handler>
+    struct PagingWalker<PT_LEVEL-LVL_DECREMENT, Handler> {
+        static bool walk(uint64_t, uint64_t, uint64_t*, Handler&) {return false;}
+    };
+
+    template<typename Handler>
+    inline bool walk_paging(const uint64_t vaddr,            //Parse the paging structures of an
+                            const uint64_t size,             //address space in a range of virtual
+                            const uint64_t pml4t_location,   //addresses
+                            Handler& handler) {
+        return PagingWalker<PML4T_LEVEL, Handler>::walk(vaddr,
+                                                        size,
+                                                        phys_to_virt(pml4t_location),
+                                                        handler);
+    }
+
+    template<PagingLevel LEVEL, typename Handler>
+    inline bool PagingWalker<LEVEL, Handler>::walk(uint64_t vaddr,
+                                                   uint64_t size,
+                                                   uint64_t* page_table,
+                                                   Handler& handler) {
+        //The size of the virtual address space covered by each item of our table.
+        const uint64_t ITEM_SIZE = (uint64_t) 1 << LEVEL;
+
+        //The first item which we're going to parse in the table
+        int index = (vaddr >> LEVEL)%PTABLE_LENGTH;
+
+        //Check that the requested size does not imply overflowing the table. If it does, abort.
+        if(size > (PTABLE_LENGTH-index)*ITEM_SIZE-vaddr%ITEM_SIZE) return false;
+
+        //Parse the table. Handlers receive the part of the virtual address block which is covered
+        //by each item.
+        while(size) {
+            const uint64_t item_size = min(size, ITEM_SIZE-vaddr%ITEM_SIZE);
+            uint64_t& table_item = page_table[index];
+            switch(handler.template enter<LEVEL>(vaddr, item_size, table_item)) {
+                case WALK_ABORT:
+                    return false;
+                case WALK_DOWN:
+                    if(!PagingWalker<LEVEL-LVL_DECREMENT, Handler>::walk(
+                            vaddr,
+                            item_size,
+                            phys_to_virt(table_item & 0x000ffffffffff000),
+                            handler)) return false;
+                    if(!handler.template leave<LEVEL>(vaddr, item_size, table_item)) return false;
+                    break;
+                case WALK_NEXT:
+                    break;
+            }
+            vaddr+= item_size;
+            size-= item_size;
+            ++index;
+        }
+
+        return true;
+    }
+
+    //Large pages (2MB PDEs, and 1GB PDPEs on processors which support them) are used by the
+    //handlers below when a table item is fully covered by the virtual address range and physical
+    //memory is suitably aligned. Large pages which are only partly affected by an operation are
+    //split into a table of smaller pages first.
+    bool largepage_level(const PagingLevel level); //Tells whether items at this level of the
+                                                   //paging hierarchy may be large pages
+    bool fits_largepage(const uint64_t size,       //Tells whether a table item, of which "size"
+                        const PagingLevel level,   //bytes are covered by a virtual address range,
+                        const uint64_t phy_addr,   //may be a large page mapping physical memory
+                        const uint64_t table_item); //from phy_addr onwards. Existing tables below
+                                                    //it are never replaced.
+    bool split_largepage(uint64_t& table_item,     //Replaces a large page by a table of smaller
+                         const PagingLevel level,  //pages mapping the same memory. Returns false
+                         PageTableCache* ptable_cache); //if the table can't be allocated.
+
+    //Default handler behaviour : nothing is to be done once a lower-level table has been parsed
+    struct PagingHandler {
+        template<PagingLevel LEVEL>
+        bool leave(const uint64_t, const uint64_t, uint64_t&) {return true;}
+    };
+
+    //fill_paging handler : Maps a block of physical addresses at a designated area of the
+    //virtual address space of a process, using 4KB paging or large pages.
+    //We assume that the required structures are already allocated at the moment, so this handler
+    //never fails.
+    struct FillPagingHandler : PagingHandler {
+        uint64_t phy_addr; //Physical address to be mapped at the next page, moving forward
+        const uint64_t flags; //Flags to be used at the page table level
+
+        FillPagingHandler(const uint64_t phy_base,
+                          const uint64_t page_flags) : phy_addr(phy_base & 0x000ffffffffff000),
+                                                       flags(page_flags) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t, const uint64_t size, uint64_t& table_item) {
+            //Have we reached the page table level, or can this item be a large page ? If so,
+            //setup a page translation.
+            if(LEVEL == PT_LEVEL) {
+                table_item = phy_addr + flags;
+                phy_addr+= PG_SIZE;
+                return WALK_NEXT;
+            }
+            if(fits_largepage(size, LEVEL, phy_addr, table_item)) {
+                table_item = phy_addr + flags + PBIT_LARGEPAGE;
+                phy_addr+= size;
+                return WALK_NEXT;
+            }
+
+            //Otherwise, move to the next level of paging structures
+            return WALK_DOWN;
+        }
+    };
+
+    //set_flags handler : Sets the flags of a block of virtual addresses to a new value. Large pages
+    //are split using pages from the page table cache if needed. Translations which the TLB may have
+    //cached, that is present ones, are queued in a TLB flush batch.
+    struct SetFlagsHandler : PagingHandler {
+        const uint64_t flags;
+        PageTableCache* ptable_cache;
+        TlbBatch& batch;
+
+        SetFlagsHandler(const uint64_t new_flags,
+                        PageTableCache* ptables,
+                        TlbBatch& tlb_batch) : flags(new_flags),
+                                               ptable_cache(ptables),
+                                               batch(tlb_batch) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t vaddr, const uint64_t size, uint64_t& table_item) {
+            //Are we at the lowest level of paging structures ?
+            //If so, overwrite flags and quit. Pages which are not mapped yet, in memory which is
+            //allocated on demand, are left alone.
+            if(LEVEL == PT_LEVEL) {
+                if(!table_item) return WALK_NEXT;
+                if(table_item & PBIT_PRESENT) batch.add(vaddr, PG_SIZE, table_item & PBIT_GLOBALPAGE);
+                table_item = (table_item & 0x000ffffffffff000) + flags;
+                return WALK_NEXT;
+            }
+
+            //Large pages which are only partly affected must be split first
+            if(table_item & PBIT_LARGEPAGE) {
+                if(size == ((uint64_t) 1 << LEVEL)) {
+                    if(table_item & PBIT_PRESENT) batch.add(vaddr, size, table_item & PBIT_GLOBALPAGE);
+                    table_item = (table_item & 0x000fffffffffe000) + flags + PBIT_LARGEPAGE;
+                    return WALK_NEXT;
+                }
+                if(!split_largepage(table_item, LEVEL, ptable_cache)) return WALK_ABORT;
+            }
+
+            //Otherwise, move to the next level of paging structures, if there's one
+            if(!(table_item & 0x000ffffffffff000)) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+    };
+
+    //count_paging handler : Counts the paging structures which setup_paging would have to
+    //allocate in a range of virtual addresses, so that they may be allocated all at once.
+    struct CountPagingHandler : PagingHandler {
+        uint64_t count; //Paging structure counter, initially set to zero
+        const uint64_t delta; //Difference between the physical and virtual addresses of the range
+
+        CountPagingHandler(const uint64_t phy_delta) : count(0), delta(phy_delta) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t vaddr, const uint64_t size, uint64_t& table_item) {
+            //Items which are going to be large pages need no paging structure below them
+            if(fits_largepage(size, LEVEL, vaddr+delta, table_item)) return WALK_NEXT;
+
+            //If the next level of paging structures is missing, all the levels below it are
+            //missing too : we need one table at the next level, then one table per item of each
+            //level down to the PD level, save for the items which are fully covered by a large
+            //page.
+            if(!(table_item & 0x000ffffffffff000)) {
+                count+= 1;
+                for(PagingLevel lower_level = LEVEL-LVL_DECREMENT;
+                    lower_level >= PD_LEVEL;
+                    lower_level-= LVL_DECREMENT) {
+                    const uint64_t item_size = (uint64_t) 1 << lower_level;
+                    count+= (align_up(vaddr+size, item_size)-align_down(vaddr, item_size)) >> lower_level;
+                    if(!largepage_level(lower_level) || (delta % item_size)) continue;
+                    if(align_down(vaddr+size, item_size) <= align_up(vaddr, item_size)) continue;
+                    count-= (align_down(vaddr+size, item_size)-align_up(vaddr, item_size)) >> lower_level;
+                }
+                return WALK_NEXT;
+            }
+
+            //Otherwise, move to the next level of paging structures, unless we're at the PD
+            //level. Large pages which are only partly covered are split, which takes one more
+            //table.
+            if(table_item & PBIT_LARGEPAGE) {
+                count+= 1;
+                return WALK_NEXT;
+            }
+            if(LEVEL == PD_LEVEL) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+    };
+
+    //setup_paging handler : Sets up a range of virtual addresses in a process' address space, so
+    //that there's only physical addresses and flags at PT level (or large page level) left to
+    //fill. Allocates paging structures when they're not allocated yet, save where large pages are
+    //going to be used.
+    struct SetupPagingHandler : PagingHandler {
+        PageTableCache* ptable_cache; //Used to allocate the nonexistent pages
+        size_t stash[PTABLE_BATCH]; //Stash of preallocated pages
+        uint64_t stashed; //Amount of pages currently in the stash
+        uint64_t remaining; //Amount of pages which remain to be allocated, as given by
+                            //count_paging. The stash is refilled from it a batch at a time when
+                            //it runs dry.
+        const uint64_t delta; //Difference between the physical and virtual addresses of the range
+
+        SetupPagingHandler(PageTableCache* ptables,
+                           const uint64_t count,
+                           const uint64_t phy_delta) : ptable_cache(ptables),
+                                                       stashed(0),
+                                                       remaining(count),
+                                                       delta(phy_delta) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t vaddr, const uint64_t size, uint64_t& table_item) {
+            //Items which are going to be large pages need no paging structure below them, and
+            //existing large pages which aren't replaced must be split.
+            if(fits_largepage(size, LEVEL, vaddr+delta, table_item)) return WALK_NEXT;
+            if((table_item & PBIT_LARGEPAGE) && !split_largepage(table_item, LEVEL, ptable_cache)) {
+                return WALK_ABORT;
+            }
+
+            //Check if next level of paging structures is available.
+            if(!(table_item & 0x000ffffffffff000)) {
+                //If not, take paging structures from the stash, refilling it if it's empty. They
+                //should be zeroed out before use, to prevent errors and security exploits in case
+                //they aren't initialized properly later, which the page table cache takes care of.
+                if(!stashed) {
+                    const uint64_t batch = max(min(remaining, (uint64_t) PTABLE_BATCH), (uint64_t) 1);
+                    if(!ptable_cache->alloc(stash, batch)) return WALK_ABORT;
+                    stashed = batch;
+                    remaining-= min(remaining, batch);
+                }
+                const size_t allocd_page = stash[--stashed];
+
+                //Now we can use them
+                table_item = allocd_page + PBIT_PRESENT       //All paging protections
+                                         + PBIT_WRITABLE      //are disabled at this
+                                         + PBIT_USERACCESS;   //level of paging structs.
+            }
+
+            //If we're at the PD level, we're done with our allocation job. Otherwise, move to the
+            //next level of paging structures.
+            if(LEVEL == PD_LEVEL) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+    };
+
+    //remove_paging handler : Removes all address translations in a range of virtual addresses,
+    //freeing paging structures if they're not used anymore, save for the PDPTs of the kernel half.
+    //Useless paging structures are stashed until they are freed a batch at a time, and once
+    //parsing is over the remaining ones must be freed by the caller. Removed translations which
+    //were present are queued in a TLB flush batch.
+    struct RemovePagingHandler : PagingHandler {
+        PageTableCache* ptable_cache; //Used to free the useless paging structures
+        size_t stash[PTABLE_BATCH]; //Physical addresses of the stashed paging structures
+        uint64_t stashed; //Amount of paging structures currently in the stash
+        TlbBatch& batch;
+
+        RemovePagingHandler(PageTableCache* ptables,
+                            TlbBatch& tlb_batch) : ptable_cache(ptables),
+                                                   stashed(0),
+                                                   batch(tlb_batch) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t vaddr, const uint64_t size, uint64_t& table_item) {
+            //Have we reached the lowest level of paging structures ?
+            //If so, clear any existing page translation.
+            if(LEVEL == PT_LEVEL) {
+                if(table_item & PBIT_PRESENT) batch.add(vaddr, PG_SIZE, table_item & PBIT_GLOBALPAGE);
+                table_item = 0;
+                return WALK_NEXT;
+            }
+
+            //Large pages which are only partly removed must be split first
+            if(table_item & PBIT_LARGEPAGE) {
+                if(size == ((uint64_t) 1 << LEVEL)) {
+                    if(table_item & PBIT_PRESENT) batch.add(vaddr, size, table_item & PBIT_GLOBALPAGE);
+                    table_item = 0;
+                    return WALK_NEXT;
+                }
+                if(!split_largepage(table_item, LEVEL, ptable_cache)) return WALK_ABORT;
+            }
+
+            //Otherwise, if the next level of paging structures is already nonexistent, skip it
+            if(!table_item) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+        template<PagingLevel LEVEL>
+        bool leave(const uint64_t vaddr, const uint64_t, uint64_t& table_item) {
+            //PDPTs of the kernel half may be shared by several address spaces, and stay there
+            if((LEVEL == PML4T_LEVEL) && (vaddr < KERNEL_SPACE_END)) return true;
+
+            //If the previously parsed table is now empty, free it
+            uint64_t* next_table = phys_to_virt(table_item & 0x000ffffffffff000);
+            for(int index = 0; index < PTABLE_LENGTH; ++index) {
+                if(next_table[index]) return true;
+            }
+
+            //Freeing is deferred until a whole batch of paging structures has been gathered
+            table_item = 0;
+            stash[stashed++] = virt_to_phys(next_table);
+            if(stashed == PTABLE_BATCH) {
+                ptable_cache->free(stash, PTABLE_BATCH);
+                stashed = 0;
+            }
+            return true;
+        }
+    };
+
+    //free_paging handler : Frees the paging structures of an address space which is not used
+    //anymore, walking down the hierarchy only once. Lower-level tables are freed before the tables
+    //which point to them, page tables without being parsed, and only the entries of the PML4T are
+    //cleared. The freed tables are thus not zeroed, and go back to RamManager instead of the page
+    //table cache, a batch at a time. Once parsing is over, the remaining ones must be freed by the
+    //caller.
+    struct FreePagingHandler : PagingHandler {
+        RamManager* ram_manager;
+        size_t stash[PTABLE_BATCH]; //Physical addresses of the stashed paging structures
+        uint64_t stashed; //Amount of paging structures currently in the stash
+
+        FreePagingHandler(RamManager* ram_man) : ram_manager(ram_man),
+                                                 stashed(0) {}
+        void stash_table(const uint64_t table_item) {
+            stash[stashed++] = table_item & 0x000ffffffffff000;
+            if(stashed == PTABLE_BATCH) {
+                ram_manager->free_chunk_batch(PID_KERNEL, stash, PTABLE_BATCH);
+                stashed = 0;
+            }
+        }
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t, const uint64_t, uint64_t& table_item) {
+            if(!table_item || (table_item & PBIT_LARGEPAGE) || (LEVEL == PT_LEVEL)) return WALK_NEXT;
+            if(LEVEL == PD_LEVEL) {
+                stash_table(table_item);
+                return WALK_NEXT;
+            }
+            return WALK_DOWN;
+        }
+        template<PagingLevel LEVEL>
+        bool leave(const uint64_t, const uint64_t, uint64_t& table_item) {
+            stash_table(table_item);
+            if(LEVEL == PML4T_LEVEL) table_item = 0;
+            return true;
+        }
+    };
+
+    //find_frame handler : Looks for the virtual address at which a page of physical memory is
+    //mapped in a range of virtual addresses. Memory which is allocated on demand, which this is
+    //used on, is always mapped using 4KB pages.
+    struct FindFrameHandler : PagingHandler {
+        const uint64_t phy_addr; //Physical address of the page which is looked for
+        uint64_t vir_addr; //Virtual address where it has been found, if it has
+
+        FindFrameHandler(const uint64_t frame) : phy_addr(frame & 0x000ffffffffff000),
+                                                 vir_addr(0) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t vaddr, const uint64_t, uint64_t& table_item) {
+            if(!table_item) return WALK_NEXT;
+            if(LEVEL == PT_LEVEL) {
+                if((table_item & 0x000ffffffffff000) != phy_addr) return WALK_NEXT;
+                vir_addr = vaddr;
+                return WALK_ABORT;
+            }
+            if(table_item & PBIT_LARGEPAGE) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+    };
+
+    //release_frames handler : Gives the pages of physical memory which are mapped in a range of
+    //virtual addresses back to RamManager, as memory which is allocated on demand or copied on
+    //write is only known to paging structures. Pages of the RAM chunk which the range maps, if
+    //any, are left alone. Pages are stashed and freed a batch at a time, and once parsing is over
+    //the remaining ones must be freed by the caller.
+    struct ReleaseFramesHandler : PagingHandler {
+        RamManager* ram_manager;
+        const PID owner; //Process which the pages have been allocated to
+        const RamChunk* kept_chunk; //RAM chunk whose pages are not to be freed
+        size_t stash[PTABLE_BATCH]; //Physical addresses of the stashed pages
+        uint64_t stashed; //Amount of pages currently in the stash
+
+        ReleaseFramesHandler(RamManager* ram_man,
+                             const PID frame_owner,
+                             const RamChunk* mapped_chunk) : ram_manager(ram_man),
+                                                             owner(frame_owner),
+                                                             kept_chunk(mapped_chunk),
+                                                             stashed(0) {}
+        template<PagingLevel LEVEL>
+        WalkStep enter(const uint64_t, const uint64_t, uint64_t& table_item) {
+            if(!table_item) return WALK_NEXT;
+            if(LEVEL == PT_LEVEL) {
+                const uint64_t frame = table_item & 0x000ffffffffff000;
+                for(const RamChunk* piece = kept_chunk; piece; piece = piece->next_buddy) {
+                    if((frame >= piece->location) && (frame < piece->location+piece->size)) return WALK_NEXT;
+                }
+                stash[stashed++] = frame;
+                if(stashed == PTABLE_BATCH) {
+                    ram_manager->free_chunk_batch(owner, stash, PTABLE_BATCH);
+                    stashed = 0;
+                }
+                return WALK_NEXT;
+            }
+            if(table_item & PBIT_LARGEPAGE) return WALK_NEXT;
+            return WALK_DOWN;
+        }
+    };
 }
 
 #endif
@@ -17,6 +17,9 @@ kinit:
   mov   %rcx, (tmp_rcx)
   mov   %rdx, (tmp_rdx)
   mov   %rsp, %rbp
+
+  /* Set up the data of this CPU, which memory management needs */
+  call init_cpu_local
   
   /* Run constructors */
   mov  $start_ctors, %rbx
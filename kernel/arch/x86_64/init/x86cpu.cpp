@@ -0,0 +1,46 @@
+ /* Per-CPU data
+
+    Copyright (C) 2010-2013  Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA */
+
+#include <x86asm.h>
+#include <x86cpu.h>
+
+namespace x86cpu {
+    CpuLocal cpu_locals[MAX_CPUS];
+    uint32_t cpu_amount = 0;
+}
+
+extern "C" void init_cpu_local() {
+    using namespace x86cpu;
+
+    //CPUs are told apart by their initial APIC ID, which CPUID gives, once and for all
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, eax, ebx, ecx, edx);
+    CpuLocal& local = cpu_locals[ebx >> 24];
+    local.self = &local;
+    local.apic_id = ebx >> 24;
+    local.node = 0;
+    local.magazine = 0;
+
+    //CPUs may start concurrently, so their dense index is taken atomically
+    uint32_t index = 1;
+    __asm__ volatile("lock xaddl %0, %1" : "+r"(index), "+m"(cpu_amount) : : "memory");
+    local.index = index;
+
+    //From now on, this CPU finds its data through GS
+    wrmsr(MSR_GS_BASE, (uint64_t) &local);
+}
@@ -24,7 +24,7 @@
 namespace x86paging {
     void dbg_print_pd(const uint64_t location) {
         uint64_t mask; //Mask used to separate physical addresses from control bits
-        pde* pd = (pde*) location;  
+        pde* pd = (pde*) phys_to_virt(location);  
         pde current_el;
         uint64_t address;
         
@@ -65,7 +65,7 @@ namespace x86paging {
 
     void dbg_print_pdpt(const uint64_t location) {
         uint64_t mask; //Mask used to separate physical addresses from control bits
-        pdp* pdpt = (pdp*) location;  
+        pdp* pdpt = (pdp*) phys_to_virt(location);  
         pdp current_el;
         uint64_t address;
       
@@ -107,7 +107,7 @@ namespace x86paging {
     void dbg_print_pml4t(const uint64_t cr3_value) {
         const uint64_t mask = (1<<12)-1+PBIT_NOEXECUTE; //Mask used to eliminate the control bits of CR3
         uint64_t pml4t_location = cr3_value - (cr3_value & mask);
-        pml4e* pml4t = (pml4e*) pml4t_location;  
+        pml4e* pml4t = (pml4e*) phys_to_virt(pml4t_location);  
         pml4e current_el;
         uint64_t address;
         
@@ -138,7 +138,7 @@ namespace x86paging {
 
     void dbg_print_pt(const uint64_t location) {
         const uint64_t mask = (1<<12)-1+PBIT_NOEXECUTE; //Mask used to separate control bits from adresses
-        pte* pt = (pte*) location;  
+        pte* pt = (pte*) phys_to_virt(location);  
         pte current_el;
         uint64_t address;
         
@@ -20,6 +20,8 @@
 #include <fake_syscall.h>
 #include <stdint.h>
 #include <synchronization.h>
+#include <x86asm.h>
+#include <x86paging.h>
 
 void fake_syscall() {
     OwnerlessMutex mutex;
@@ -33,9 +35,12 @@ void fake_syscall() {
 }
 
 void fake_context_switch() {
-    uint64_t fake_registers[130];
-    //A TLB flush
-    __asm__ volatile ("mov %%cr3, %%rax; mov %%rax, %%cr3":::"rax");
+    uint64_t fake_registers[130], cr3, cr4;
+    //An address space switch, which flushes the TLB unless PCIDs are enabled
+    rdcr3(cr3);
+    rdcr4(cr4);
+    if(cr4 & x86paging::CR4_PCIDE) cr3+= x86paging::CR3_NOFLUSH;
+    __asm__ volatile ("mov %0, %%cr3"::"r" (cr3):"memory");
     //Emulate thread switch by register copy
     for(int i = 0; i<130; ++i) fake_registers[0] = fake_registers[i];
 }
@@ -0,0 +1,56 @@
+ /* Benchmark code used to measure the performance of x86 page table manipulation
+
+      Copyright (C) 2013  Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA */
+
+#ifndef _PAGINGBENCH_H_
+#define _PAGINGBENCH_H_
+
+#include <stdint.h>
+
+namespace Tests {
+    //To run it, build with Ftests=1 and call it from kmain() once memory management is set up.
+    //Like other benchmarks, it is timed by hand between the prompts of bench_start() and
+    //bench_stop(), and only the relative timings of the two page mapping tests are meaningful.
+    void benchmark_paging(); //Paging performance benchmark
+
+    //Individual tests. They all work on a private address space, which is never loaded in CR3.
+    void paging_fill_bench(); //Used to evaluate the time taken to map memory using 4KB pages
+    void paging_reference_bench(); //Same job, using the function pointer-based page table parser
+                                   //which x86paging used before page table walks were templated
+    void paging_map_bench(); //Used to evaluate the time taken by a whole mapping/flag
+                             //change/unmapping cycle
+
+    //Auxiliary functions
+    // * Reference function pointer-based page table parser and its page mapping handler
+    uint64_t reference_parser(uint64_t vaddr,
+                              const uint64_t size,
+                              const int level,
+                              uint64_t* page_table,
+                              uint64_t (*item_handler)(uint64_t vaddr,
+                                                       const uint64_t size,
+                                                       const int level,
+                                                       uint64_t &table_item,
+                                                       uint64_t* additional_params),
+                              uint64_t* additional_params);
+    uint64_t reference_fill_handler(uint64_t vaddr,
+                                    const uint64_t size,
+                                    const int level,
+                                    uint64_t &table_item,
+                                    uint64_t* additional_params);
+}
+
+#endif
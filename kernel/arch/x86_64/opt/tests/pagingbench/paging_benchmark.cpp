@@ -0,0 +1,229 @@
+ /* Benchmark code used to measure the performance of x86 page table manipulation
+
+      Copyright (C) 2013  Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA */
+
+#include <align.h>
+#include <kmath.h>
+#include <paging_benchmark.h>
+#include <RamManager.h>
+#include <test_display.h>
+#include <x86paging.h>
+#include <x86paging_parser.h>
+
+
+namespace Tests {
+    //Benchmark parameters. Physical memory is never accessed, and it is not aligned like large
+    //pages so that 4KB paging is always used.
+    const uint64_t BENCH_VADDR = 0x100000000000;
+    const uint64_t BENCH_PHY_ADDR = 0x1000;
+    const uint64_t BENCH_SIZE = 0x4000000;
+    const uint64_t BENCH_FLAGS = x86paging::PBIT_PRESENT + x86paging::PBIT_WRITABLE;
+
+    //Paging structures are allocated from a page table cache, as PagingManager does
+    x86paging::PageTableCache* bench_ptables;
+
+    void benchmark_paging() {
+        test_beginning("Paging performance");
+        static x86paging::PageTableCache ptable_cache(ram_manager);
+        bench_ptables = &ptable_cache;
+
+        reset_title();
+        test_title("Page mapping, templated page table walker");
+        paging_fill_bench();
+
+        test_title("Page mapping, function pointer-based page table parser");
+        paging_reference_bench();
+
+        test_title("Mapping, flag change and unmapping cycle");
+        paging_map_bench();
+
+        //Give the cached paging structures back to RamManager
+        ptable_cache.shrink(BENCH_SIZE);
+    }
+
+    void paging_fill_bench() {
+        //Define benchmark parameters here
+        const unsigned int NUMBER_OF_FILLS = 5000;
+
+        const uint64_t pml4t_location = x86paging::create_pml4t(bench_ptables);
+        if(!pml4t_location) {
+            test_failure("Could not allocate a PML4T");
+            return;
+        }
+        if(!x86paging::setup_paging(BENCH_PHY_ADDR,
+                                    BENCH_VADDR,
+                                    BENCH_SIZE,
+                                    pml4t_location,
+                                    bench_ptables)) {
+            test_failure("Could not set up paging structures");
+            bench_ptables->free(&pml4t_location, 1);
+            return;
+        }
+
+        bench_start();
+
+        for(unsigned int i = 0; i < NUMBER_OF_FILLS; ++i) {
+            x86paging::fill_paging(BENCH_PHY_ADDR,
+                                   BENCH_VADDR,
+                                   BENCH_SIZE,
+                                   BENCH_FLAGS,
+                                   pml4t_location);
+        }
+
+        bench_stop();
+
+        x86paging::TlbBatch tlb_batch; //This address space is never used, so its TLB is left alone
+        x86paging::remove_paging(BENCH_VADDR, BENCH_SIZE, pml4t_location, bench_ptables, tlb_batch);
+        bench_ptables->free(&pml4t_location, 1);
+    }
+
+    void paging_reference_bench() {
+        //Define benchmark parameters here
+        const unsigned int NUMBER_OF_FILLS = 5000;
+
+        const uint64_t pml4t_location = x86paging::create_pml4t(bench_ptables);
+        if(!pml4t_location) {
+            test_failure("Could not allocate a PML4T");
+            return;
+        }
+        if(!x86paging::setup_paging(BENCH_PHY_ADDR,
+                                    BENCH_VADDR,
+                                    BENCH_SIZE,
+                                    pml4t_location,
+                                    bench_ptables)) {
+            test_failure("Could not set up paging structures");
+            bench_ptables->free(&pml4t_location, 1);
+            return;
+        }
+
+        bench_start();
+
+        for(unsigned int i = 0; i < NUMBER_OF_FILLS; ++i) {
+            uint64_t additional_params[3] = {BENCH_PHY_ADDR, BENCH_FLAGS, 0};
+            reference_parser(BENCH_VADDR,
+                             BENCH_SIZE,
+                             x86paging::PML4T_LEVEL,
+                             x86paging::phys_to_virt(pml4t_location),
+                             &reference_fill_handler,
+                             additional_params);
+        }
+
+        bench_stop();
+
+        x86paging::TlbBatch tlb_batch; //This address space is never used, so its TLB is left alone
+        x86paging::remove_paging(BENCH_VADDR, BENCH_SIZE, pml4t_location, bench_ptables, tlb_batch);
+        bench_ptables->free(&pml4t_location, 1);
+    }
+
+    void paging_map_bench() {
+        //Define benchmark parameters here
+        const unsigned int NUMBER_OF_CYCLES = 1000;
+
+        const uint64_t pml4t_location = x86paging::create_pml4t(bench_ptables);
+        if(!pml4t_location) {
+            test_failure("Could not allocate a PML4T");
+            return;
+        }
+
+        bench_start();
+
+        for(unsigned int i = 0; i < NUMBER_OF_CYCLES; ++i) {
+            if(!x86paging::setup_paging(BENCH_PHY_ADDR,
+                                        BENCH_VADDR,
+                                        BENCH_SIZE,
+                                        pml4t_location,
+                                        bench_ptables)) {
+                test_failure("Could not set up paging structures");
+                break;
+            }
+            x86paging::fill_paging(BENCH_PHY_ADDR,
+                                   BENCH_VADDR,
+                                   BENCH_SIZE,
+                                   BENCH_FLAGS,
+                                   pml4t_location);
+            x86paging::TlbBatch tlb_batch; //Modified translations are queued, as PagingManager does
+            x86paging::set_flags(BENCH_VADDR,
+                                 BENCH_SIZE,
+                                 x86paging::PBIT_PRESENT,
+                                 pml4t_location,
+                                 bench_ptables,
+                                 tlb_batch);
+            x86paging::remove_paging(BENCH_VADDR, BENCH_SIZE, pml4t_location, bench_ptables, tlb_batch);
+        }
+
+        bench_stop();
+
+        bench_ptables->free(&pml4t_location, 1);
+    }
+
+    uint64_t reference_parser(uint64_t vaddr,
+                              const uint64_t size,
+                              const int level,
+                              uint64_t* page_table,
+                              uint64_t (*item_handler)(uint64_t vaddr,
+                                                       const uint64_t size,
+                                                       const int level,
+                                                       uint64_t &table_item,
+                                                       uint64_t* additional_params),
+                              uint64_t* additional_params) {
+        //Parse each relevant item of the table, adjusting the virtual address and size given to
+        //the handler so that they only cover this item
+        const uint64_t ITEM_SIZE = (uint64_t) 1 << level;
+        const int first_index = (vaddr >> level)%x86paging::PTABLE_LENGTH;
+        const uint64_t vaddr_base = align_down(vaddr, ITEM_SIZE);
+        const int parsed_length = (align_up(vaddr+size, ITEM_SIZE)-vaddr_base) >> level;
+        if(parsed_length > x86paging::PTABLE_LENGTH-first_index) return 0;
+
+        uint64_t result = 1;
+        for(int table_parser = 0; table_parser < parsed_length; ++table_parser) {
+            const uint64_t item_start = max(vaddr, vaddr_base+table_parser*ITEM_SIZE);
+            const uint64_t item_end = min(vaddr+size, vaddr_base+(table_parser+1)*ITEM_SIZE);
+            result = item_handler(item_start,
+                                  item_end-item_start,
+                                  level,
+                                  page_table[first_index+table_parser],
+                                  additional_params);
+            if(!result) return 0;
+        }
+
+        return result;
+    }
+
+    uint64_t reference_fill_handler(uint64_t vaddr,
+                                    const uint64_t size,
+                                    const int level,
+                                    uint64_t &table_item,
+                                    uint64_t* additional_params) {
+        //additional_params contains the physical base address, the page flags, and the offset
+        //from the physical base address of the next page to be mapped.
+        if(level == x86paging::PT_LEVEL) {
+            table_item = (additional_params[0]&0x000ffffffffff000)
+                          + additional_params[2]
+                          + additional_params[1];
+            additional_params[2]+= 0x1000;
+            return 1;
+        }
+
+        uint64_t* next_table = x86paging::phys_to_virt(table_item & 0x000ffffffffff000);
+        return reference_parser(vaddr,
+                                size,
+                                level-x86paging::LVL_DECREMENT,
+                                next_table,
+                                &reference_fill_handler,
+                                additional_params);
+    }
+}
@@ -0,0 +1,198 @@
+ /* Balanced tree indexing memory map items by address
+
+      Copyright (C) 2013  Hadrien Grasland
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA */
+
+#ifndef _ADDRESS_TREE_H_
+#define _ADDRESS_TREE_H_
+
+#include <address.h>
+#include <kmath.h>
+
+//Memory maps are chained lists, which are slow to search. AddressTree is an AVL tree which
+//indexes the items of such a map by their "location" member, so that an item may be found in
+//O(log(n)) time. It is intrusive : indexed items must have a "tree_node" member of type
+//AddressTreeNode, and the tree allocates no memory by itself.
+template <class Item> struct AddressTreeNode {
+    Item* left;
+    Item* right;
+    Item* parent;
+    int height;
+
+    AddressTreeNode() : left(NULL),
+                        right(NULL),
+                        parent(NULL),
+                        height(0) {}
+};
+
+//Trees may also keep track of some information about each subtree, such as the largest free
+//space in it, which is computed from an item and its children. To do so, they are given an
+//"Augment" class whose static update() method computes that information for an item, given that
+//its children are up to date.
+template <class Item> struct AddressTreeNoAugment {
+    static void update(Item*) {}
+};
+
+template <class Item, class Augment = AddressTreeNoAugment<Item> > class AddressTree {
+  private:
+    Item* root;
+
+    //AVL tree balancing
+    static int height(const Item* item) {return item ? item->tree_node.height : 0;}
+    static void update_height(Item* item) {
+        item->tree_node.height = 1+max(height(item->tree_node.left), height(item->tree_node.right));
+        Augment::update(item);
+    }
+    void replace_child(Item* parent, Item* old_child, Item* new_child) {
+        if(!parent) {
+            root = new_child;
+        } else if(parent->tree_node.left == old_child) {
+            parent->tree_node.left = new_child;
+        } else {
+            parent->tree_node.right = new_child;
+        }
+        if(new_child) new_child->tree_node.parent = parent;
+    }
+    Item* rotate_left(Item* item) {
+        Item* pivot = item->tree_node.right;
+        replace_child(item->tree_node.parent, item, pivot);
+        item->tree_node.right = pivot->tree_node.left;
+        if(item->tree_node.right) item->tree_node.right->tree_node.parent = item;
+        pivot->tree_node.left = item;
+        item->tree_node.parent = pivot;
+        update_height(item);
+        update_height(pivot);
+        return pivot;
+    }
+    Item* rotate_right(Item* item) {
+        Item* pivot = item->tree_node.left;
+        replace_child(item->tree_node.parent, item, pivot);
+        item->tree_node.left = pivot->tree_node.right;
+        if(item->tree_node.left) item->tree_node.left->tree_node.parent = item;
+        pivot->tree_node.right = item;
+        item->tree_node.parent = pivot;
+        update_height(item);
+        update_height(pivot);
+        return pivot;
+    }
+    void rebalance(Item* item) {
+        //Walk up to the root, fixing heights and rotating unbalanced subtrees on the way
+        while(item) {
+            update_height(item);
+            Item *left = item->tree_node.left, *right = item->tree_node.right;
+            const int balance = height(left)-height(right);
+            if(balance > 1) {
+                if(height(left->tree_node.left) < height(left->tree_node.right)) rotate_left(left);
+                item = rotate_right(item);
+            } else if(balance < -1) {
+                if(height(right->tree_node.right) < height(right->tree_node.left)) rotate_right(right);
+                item = rotate_left(item);
+            }
+            item = item->tree_node.parent;
+        }
+    }
+  public:
+    AddressTree() : root(NULL) {}
+
+    //Tree manipulation
+    void clear() {root = NULL;} //Forget about all items (they are left as is)
+    void insert(Item* item) {
+        Item *parent = NULL, *parser = root;
+        while(parser) {
+            parent = parser;
+            if(item->location < parser->location) {
+                parser = parser->tree_node.left;
+            } else {
+                parser = parser->tree_node.right;
+            }
+        }
+
+        item->tree_node = AddressTreeNode<Item>();
+        item->tree_node.parent = parent;
+        if(!parent) {
+            root = item;
+        } else if(item->location < parent->location) {
+            parent->tree_node.left = item;
+        } else {
+            parent->tree_node.right = item;
+        }
+        rebalance(item);
+    }
+    void remove(Item* item) {
+        AddressTreeNode<Item>& node = item->tree_node;
+        Item* rebalance_from;
+
+        if(node.left && node.right) {
+            //Items with two children are replaced by their successor, which has no left child
+            Item* successor = node.right;
+            while(successor->tree_node.left) successor = successor->tree_node.left;
+            AddressTreeNode<Item>& successor_node = successor->tree_node;
+            if(successor_node.parent == item) {
+                rebalance_from = successor;
+            } else {
+                rebalance_from = successor_node.parent;
+                replace_child(successor_node.parent, successor, successor_node.right);
+                successor_node.right = node.right;
+                successor_node.right->tree_node.parent = successor;
+            }
+            replace_child(node.parent, item, successor);
+            successor_node.left = node.left;
+            successor_node.left->tree_node.parent = successor;
+        } else {
+            //Other items are replaced by their only child, if any
+            rebalance_from = node.parent;
+            replace_child(node.parent, item, node.left ? node.left : node.right);
+        }
+
+        node = AddressTreeNode<Item>();
+        rebalance(rebalance_from);
+    }
+    void update(Item* item) {rebalance(item);} //Refresh the subtree information of an item and its
+                                               //ancestors after the item has been modified
+
+    //Lookup
+    Item* top() const {return root;} //Root of the tree, for custom searches
+    Item* last() const { //Find the item with the highest location
+        Item* parser = root;
+        while(parser && parser->tree_node.right) parser = parser->tree_node.right;
+        return parser;
+    }
+    Item* find(const size_t location) const { //Find the item which begins at "location"
+        Item* parser = root;
+        while(parser && (parser->location != location)) {
+            if(location < parser->location) {
+                parser = parser->tree_node.left;
+            } else {
+                parser = parser->tree_node.right;
+            }
+        }
+        return parser;
+    }
+    Item* find_containing(const size_t location) const { //Find the last item which begins at or
+        Item *parser = root, *result = NULL;              //before "location"
+        while(parser) {
+            if(location < parser->location) {
+                parser = parser->tree_node.left;
+            } else {
+                result = parser;
+                parser = parser->tree_node.right;
+            }
+        }
+        return result;
+    }
+};
+
+#endif
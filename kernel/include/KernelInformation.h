@@ -49,11 +49,35 @@ struct KernelMMapItem {
                 //Kernel and modules are called by their GRUB modules names
 } __attribute__ ((packed));
 
+//NUMA topology, as described by the ACPI SRAT and SLIT. When they are not available, node_amount
+//is zero and memory access is considered to be uniform.
+struct KernelNumaRange {
+  size_t location;
+  size_t size;
+  uint32_t node;
+} __attribute__ ((packed));
+
+struct KernelNumaCPU {
+  uint32_t apic_id;
+  uint32_t node;
+} __attribute__ ((packed));
+
+struct KernelNumaInfo {
+  uint32_t node_amount; //Number of NUMA nodes
+  size_t range_amount;
+  KernelNumaRange* ranges; //Node of each range of memory
+  size_t cpu_amount;
+  KernelNumaCPU* cpus; //Node of each CPU
+  uint8_t* distances; //node_amount*node_amount matrix of relative distances between nodes (10
+                      //meaning local), or NULL if unknown
+} __attribute__ ((packed));
+
 struct KernelInformation {
   char* command_line;
   size_t kmmap_length;
   KernelMMapItem* kmmap; //A bootstrap-provided map of memory, featuring kernel module locations
   KernelCPUInfo cpu_info; //Information about the processor we run on
+  KernelNumaInfo numa_info; //NUMA topology of the system
   ArchSpecificKInfo arch_info; //Other arch-specific information
 } __attribute__ ((packed));
 
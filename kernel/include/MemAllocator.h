@@ -26,7 +26,7 @@
 #include <ProcessManager.h>
 #include <PagingManager.h>
 
-const int MEMALLOCATOR_VERSION = 2; //Increase this when deep changes require a modification of
+const int MEMALLOCATOR_VERSION = 3; //Increase this when deep changes require a modification of
                                      //the testing protocol
 
 typedef class ProcessManager ProcessManager;
@@ -43,6 +43,11 @@ class MemAllocator {
         MallocProcess* free_process_descs; //A collection of ready to use process descriptors
         OwnerlessMutex proclist_mutex; //Hold that mutex when parsing or modifying the process list
 
+        //Memory reclamation
+        ShrinkerDescriptor shrinkers[MALLOC_MAX_SHRINKERS]; //Sorted by increasing priority value
+        int shrinker_amount;
+        OwnerlessMutex shrinkers_mutex;
+
         //Internal allocator
         bool alloc_mapitems(); //Get some memory map storage space
         bool alloc_process_descs(); //Get some process descriptors
@@ -52,12 +57,10 @@ class MemAllocator {
         //Allocation, liberation and sharing functions -- normal processes
         size_t allocator(MallocProcess* target,
                          const size_t size,
-                         const PageFlags flags,
-                         const bool force = false);
+                         const PageFlags flags);
         size_t allocator_shareable(MallocProcess* target,
                                    size_t size,
-                                   const PageFlags flags,
-                                   const bool force = false);
+                                   const PageFlags flags);
         bool liberator(MallocProcess* target, const size_t location);
         size_t share(MallocProcess* source,
                      const size_t location,
@@ -76,13 +79,17 @@ class MemAllocator {
         bool set_pool(MallocProcess* target, size_t pool_location);
 
         //Auxiliary functions
-        void liberate_memory();
+        void liberate_memory(const size_t amount, //Ask shrinkers for memory after a failed
+                             const int attempt);  //allocation. Panics if it's hopeless.
     public:
         MemAllocator(RamManager& ram_manager, PagingManager& paging_manager);
 
         //Late feature initialization
         bool init_process(ProcessManager& process_manager); //Run once process management is available
 
+        //Memory reclamation
+        bool add_shrinker(const ShrinkerDescriptor& shrinker); //Register a way to get memory back
+
         //Process management functions
         //PID add_process(PID id, ProcessProperties properties); //Adds a new process to MemAllocator's database
         void remove_process(PID target); //Removes all traces of a PID in MemAllocator
@@ -108,6 +115,8 @@ class MemAllocator {
         //Give another process access to that data under the limits of "flags".
         //Note that by doing so, the current owner loses property of that data : free will only
         //remove his right to access the data, and not the data itself.
+        //Adding PAGE_FLAG_C to "flags" (including PAGE_FLAGS_SAME) shares the data copy-on-write :
+        //it is read-only on both sides, until a process writes in a page and gets its own copy.
         //Also, always allocate data used for this with malloc_shareable.
         size_t share(PID source,
                      const size_t location,
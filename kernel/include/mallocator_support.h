@@ -58,6 +58,30 @@ struct MemoryChunk {
 };
 
 
+//Large allocations of processes other than the kernel are backed by RAM on demand, a page at a
+//time when it is first accessed, instead of being allocated all at once.
+const size_t MALLOC_DEMAND_THRESHOLD = 0x100000;
+
+
+//When memory is short, MemAllocator asks other kernel components to give back memory which they
+//don't really need (caches, spare management structures...) before giving up. Those components
+//describe how they may do so using the following structure.
+const int MALLOC_MAX_SHRINKERS = 16; //Maximal amount of registered shrinkers
+const int MALLOC_MAX_RETRIES = 4; //Forced allocations are retried this many times before panicking
+struct ShrinkerDescriptor {
+    const char* shrinker_name; //Name of the component, for debugging purposes
+    int priority; //Shrinkers are called by increasing priority value : cheap caches should have a
+                  //low value, and expensive reclamation methods a high one.
+    size_t (*shrink)(const size_t); //Pointer to a function which attempts to liberate at least
+                                    //the requested amount of memory, in bytes, and returns how
+                                    //much was actually liberated.
+
+    ShrinkerDescriptor() : shrinker_name(NULL),
+                           priority(0),
+                           shrink(NULL) {}
+};
+
+
 //There are two maps per process, and we must keep track of each process. The same assumptions as
 //before apply.
 struct MallocProcess {
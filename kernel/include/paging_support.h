@@ -20,6 +20,7 @@
 #define _PAGING_SUPPORT_H_
 
 #include <address.h>
+#include <AddressTree.h>
 #include <ram_support.h>
 #include <pid.h>
 #include <stdint.h>
@@ -30,12 +31,14 @@ typedef uint32_t PageFlags;
 const PageFlags PAGE_FLAG_R = 1; //Region of memory is readable
 const PageFlags PAGE_FLAG_W = (1<<1); //...writable
 const PageFlags PAGE_FLAG_X = (1<<2); //...executable
-const PageFlags PAGE_FLAG_A = (1<<3); //...absent (accessing it will result in a page fault)
+const PageFlags PAGE_FLAG_A = (1<<3); //...absent (accessing it will result in a page fault which
+                        //can't be resolved, even in memory which is allocated on demand)
 const PageFlags PAGE_FLAG_K = (1<<4); //...Global kernel memory (present in all address spaces and not
                         //accessible by user programs directly, used on kernel pages which are common
-                        //to all processes. K pages should not be created after the first non-kernel
-                        //process has been created and run, for their presence in that process' address
-                        //space cannot be guaranteed)
+                        //to all processes. Only the kernel may create K pages, and they do not appear
+                        //in the memory maps of other processes)
+const PageFlags PAGE_FLAG_C = (1<<5); //...copy-on-write (it is mapped read-only, and writable pages
+                        //are copied when they are first written, so that writes remain private)
 const PageFlags PAGE_FLAGS_SAME = (1<<31); //This special paging flag overrides all others,
                         //and is used for sharing. It means that the shared memory region is set up
                         //using the same flags as its "mother" region.
@@ -43,7 +46,8 @@ const PageFlags PAGE_FLAGS_RX = PAGE_FLAG_R + PAGE_FLAG_X;
 const PageFlags PAGE_FLAGS_RW = PAGE_FLAG_R + PAGE_FLAG_W;
 
 
-//Represents an item in a map of page translations, managed as a linked list at the moment.
+//Represents an item in a map of page translations. The map is a linked list sorted by location,
+//which is also indexed by an address tree so that chunks and holes may be quickly found.
 struct PageChunk {
     size_t location;
     size_t size;
@@ -54,12 +58,18 @@ struct PageChunk {
     //WARNING : PageChunk properties after this point are nonstandard, subject to change without
     //warnings, and should not be read or manipulated by external software.
     PageChunk* next_mapitem;
+    AddressTreeNode<PageChunk> tree_node; //Used to index the map by address
+    size_t gap; //Free address space between the previous map item (or the first page) and this one
+    size_t max_gap; //Largest gap in this item's subtree of the index
     PageChunk() : location(0),
                   size(0),
                   flags(PAGE_FLAGS_RW),
                   points_to(NULL),
                   next_buddy(NULL),
-                  next_mapitem(NULL) {};
+                  next_mapitem(NULL),
+                  tree_node(),
+                  gap(0),
+                  max_gap(0) {};
     //Algorithms finding things in or about the map
     PageChunk* find_thischunk(const size_t location) const;
     size_t length() const;
@@ -70,11 +80,76 @@ struct PageChunk {
 };
 
 
+//Keeps track of the largest gap in each subtree of the map index, so that a hole of a given size
+//can be found in logarithmic time.
+struct PageChunkGaps {
+    static void update(PageChunk* item) {
+        item->max_gap = item->gap;
+        PageChunk* child = item->tree_node.left;
+        if(child && (child->max_gap > item->max_gap)) item->max_gap = child->max_gap;
+        child = item->tree_node.right;
+        if(child && (child->max_gap > item->max_gap)) item->max_gap = child->max_gap;
+    }
+};
+
+
+//Recent virtual-to-physical translations of a process are kept in a small direct-mapped cache,
+//indexed by virtual page, so that looking them up again does not take a walk in paging
+//structures. Entries are dropped whenever the translations which they hold are flushed from the
+//TLB. Hits and misses are counted, to tell how useful the cache is.
+const int TRANSLATION_CACHE_SIZE = 64; //Amount of cached translations per process
+struct TranslationCache {
+    size_t vir_pages[TRANSLATION_CACHE_SIZE]; //Virtual page of each entry (NULL if it is empty)
+    size_t phy_pages[TRANSLATION_CACHE_SIZE]; //Physical page where it is mapped
+    uint64_t flags[TRANSLATION_CACHE_SIZE]; //Arch-specific paging flags of the translation
+    int used; //Amount of entries which are not empty
+    uint64_t hits;
+    uint64_t misses;
+    TranslationCache() : hits(0), misses(0) {clear();}
+    void clear() {
+        for(int index = 0; index < TRANSLATION_CACHE_SIZE; ++index) vir_pages[index] = NULL;
+        used = 0;
+    }
+    void drop(const int index) {if(vir_pages[index]) {vir_pages[index] = NULL; --used;}}
+    int slot(const size_t vir_page) const {return (vir_page/PG_SIZE)%TRANSLATION_CACHE_SIZE;}
+    void store(const size_t vir_page, const size_t phy_page, const uint64_t page_flags) {
+        const int index = slot(vir_page);
+        if(!vir_pages[index]) ++used;
+        vir_pages[index] = vir_page;
+        phy_pages[index] = phy_page;
+        flags[index] = page_flags;
+    }
+    size_t find_frame(const size_t phy_page,     //Find a cached translation of a physical page
+                      const size_t vir_addr,     //in a range of virtual addresses, return NULL
+                      const size_t size) const { //if there's none
+        for(int index = 0; used && (index < TRANSLATION_CACHE_SIZE); ++index) {
+            if(!vir_pages[index] || (phy_pages[index] != phy_page)) continue;
+            if((vir_pages[index] >= vir_addr) && (vir_pages[index] < vir_addr+size)) return vir_pages[index];
+        }
+        return NULL;
+    }
+    void invalidate(const size_t vir_addr, const size_t size) { //Drop the entries of a range
+        if(!used) return;
+        if(size/PG_SIZE < TRANSLATION_CACHE_SIZE) {
+            //Small ranges are looked up page by page, larger ones entry by entry
+            for(size_t vir_page = vir_addr; vir_page < vir_addr+size; vir_page+= PG_SIZE) {
+                if(vir_pages[slot(vir_page)] == vir_page) drop(slot(vir_page));
+            }
+        } else {
+            for(int index = 0; index < TRANSLATION_CACHE_SIZE; ++index) {
+                if((vir_pages[index] >= vir_addr) && (vir_pages[index] < vir_addr+size)) drop(index);
+            }
+        }
+    }
+};
+
+
 //There is one map of page translations per process. Since there probably won't ever be more than
 //1000 processes running and paging-related requests don't occur that often, a linked
 //list sounds like the most sensible option because of its flexibility.
 struct PagingManagerProcess {
     PageChunk* map_pointer;
+    AddressTree<PageChunk, PageChunkGaps> map_index; //Address-ordered index of the map
     size_t pml4t_location;
 
     //WARNING : PagingManagerProcess properties after this point are nonstandard, subject to change without
@@ -82,12 +157,19 @@ struct PagingManagerProcess {
     PID identifier;
     PagingManagerProcess* next_item;
     OwnerlessMutex mutex;
-    bool may_free_kpages; //Specifies if the process descriptor can free pages with the K flag
+    uint16_t pcid; //Tag of the address space's TLB entries (0 for the kernel, or if none is assigned)
+    uint64_t pcid_stamp; //Last time the address space was switched to, for PCID recycling purposes
+    bool tlb_stale; //TLB entries tagged with the PCID must be flushed when switching to it
+    TranslationCache tcache; //Recent translations of the process' own part of the address space
     PagingManagerProcess() : map_pointer(NULL),
+                             map_index(),
                              pml4t_location(NULL),
                       	     identifier(PID_INVALID),
                              next_item(NULL),
-                             may_free_kpages(false) {};
+                             pcid(0),
+                             pcid_stamp(0),
+                             tlb_stale(false),
+                             tcache() {};
     //Comparing list items is fairly straightforward and should be done by default
     //by the C++ compiler, but well...
     bool operator==(const PagingManagerProcess& param) const;
@@ -20,25 +20,52 @@
 #define _RAM_SUPPORT_H_
 
 #include <address.h>
+#include <AddressTree.h>
+#include <align.h>
 #include <pid.h>
 #include <stdint.h>
 #include <synchronization.h>
 
-//A list of PIDs
+//A sorted array of PIDs, holding the extra owners of chunks which are shared between processes.
+//Arrays come in a few size classes (64B, 512B and 4KB), and are managed by RamManager.
+const int PIDARRAY_CLASSES = 3;
+inline size_t pidarray_bytes(const int size_class) {return (size_t) 64 << (3*size_class);}
+
+struct PIDArray {
+    uint32_t length;
+    uint32_t size_class;
+    PIDArray* next_item; //Used to chain free arrays
+
+    PIDArray(const int the_class = 0) : length(0),
+                                        size_class(the_class),
+                                        next_item(NULL) {}
+
+    //The PIDs themselves follow the array header
+    PID* pids() {return (PID*) (this+1);}
+    const PID* pids() const {return (const PID*) (this+1);}
+    size_t capacity() const {return (pidarray_bytes(size_class)-sizeof(PIDArray))/sizeof(PID);}
+    size_t lower_bound(const PID& the_pid) const; //Index of the first PID which is >= the_pid
+    bool has_pid(const PID& the_pid) const;
+};
+
+//The owners of a chunk of RAM. Most chunks have a single owner, which is stored inline. Chunks
+//which are shared between several processes spill their other owners in a PIDArray.
 struct PIDs {
-    PID current_pid;
-    PIDs* next_item;
+    PID first_pid;
+    PIDArray* others;
 
     //Constructors and destructors
-    PIDs() : current_pid(PID_INVALID),
-                         next_item(NULL) {}
-    PIDs(const PID& first) : current_pid(first),
-                             next_item(NULL) {}
+    PIDs() : first_pid(PID_INVALID),
+             others(NULL) {}
+    PIDs(const PID& first) : first_pid(first),
+                             others(NULL) {}
 
     //Various utility function
     bool has_pid(const PID& the_pid) const;
-    size_t length() const;
+    size_t length() const; //Amount of owners, a process being counted once per time it has
+                           //been given the chunk
     PIDs& operator=(const PID& param); //Set the contents of a blank PIDs to a single PID
+    PID operator[](const size_t index) const; //Owner number "index", the inline one being number 0
 
     //Comparison of PIDs
     bool operator==(const PIDs& param) const;
@@ -46,6 +73,8 @@ struct PIDs {
 };
 
 
+struct RamOwnedItem;
+
 //Represents an item in a map of RAM, managed as a chained list at the moment.
 struct RamChunk {
     size_t location;
@@ -58,13 +87,23 @@ struct RamChunk {
     //WARNING : RamChunk properties after this point are nonstandard, subject to change without
     //warnings, and should not be read or manipulated by external software.
     RamChunk* next_mapitem;
+    RamChunk* previous_mapitem; //Used to find the buddy of a block which lies before it
+    RamChunk* previous_buddy; //Free lists of the buddy allocator are doubly linked
+    bool in_free_list; //Whether this chunk is a free block sitting in a buddy allocator free list
+    AddressTreeNode<RamChunk> tree_node; //Used to index the memory map by address
+    RamOwnedItem* owned_item; //Entry of the chunk in the owned chunks of a process, if any
 
     RamChunk() : location(0),
                  size(0),
                  owners(PID_INVALID),
                  allocatable(true),
                  next_buddy(NULL),
-                 next_mapitem(NULL) {};
+                 next_mapitem(NULL),
+                 previous_mapitem(NULL),
+                 previous_buddy(NULL),
+                 in_free_list(false),
+                 tree_node(),
+                 owned_item(NULL) {};
     //This mirrors the member functions of "owners"
     bool has_owner(const PID the_owner) const {return owners.has_pid(the_owner);}
     //Algorithms finding things in or about the map
@@ -80,17 +119,144 @@ struct RamChunk {
     bool operator!=(const RamChunk& param) const {return !(*this==param);}
 };
 
-//This structure is used for the process management functionality of RamManager.
+//The following flags may be used to request large frames from RamManager. Allocated memory is
+//then made of naturally aligned blocks of that size, which can be mapped using large pages.
+typedef uint32_t RamAllocFlags;
+const RamAllocFlags RAM_ALLOC_2M = 1; //Memory is made of 2MB frames
+const RamAllocFlags RAM_ALLOC_1G = (1<<1); //Memory is made of 1GB frames
+const RamAllocFlags RAM_ALLOC_ZEROED = (1<<2); //Memory is filled with zeroes
+
+//Free memory is managed by a buddy allocator, separately for each zone of RAM (low memory, high
+//memory...). Free list number N of a zone holds free blocks of PG_SIZE*2^N bytes, which are
+//aligned on their own size and chained together using next_buddy and previous_buddy.
+const int RAM_BUDDY_ORDERS = 19; //Blocks go from 4KB (order 0) to 1GB (order 18)
+inline size_t buddy_size(const int order) {return ((size_t) PG_SIZE) << order;}
+
+//Naturally aligned 2MB and 1GB blocks can be mapped using large pages. Some of them are kept in
+//reserve : smaller allocations only split them when no other free memory is available.
+const int RAM_ORDER_2M = 9;
+const int RAM_ORDER_1G = 18;
+const size_t RAM_RESERVE_2M = 16; //Amount of free 2MB blocks kept in reserve (including those
+                                  //which are part of larger free blocks)
+const size_t RAM_RESERVE_1G = 1; //Amount of free 1GB blocks kept in reserve
+
+//On NUMA systems, high memory is split in several zones, each belonging to one NUMA node
+const int RAM_MAX_NODES = 8;
+const int RAM_MAX_ZONES = 32;
+
+//On machines with lots of RAM, giving all free memory to the buddy allocator takes a while. Only
+//memory below RAM_EAGER_INIT is given at boot time, the rest of each zone is given in batches when
+//the zone runs out of free memory or when CPUs are idle.
+const size_t RAM_EAGER_INIT = 0x40000000; //Set to MAX_RAM_ADDRESS to give all memory at boot time
+const size_t RAM_DEFERRED_BATCH = 0x40000000;
+
+struct RamZone {
+    size_t location;
+    size_t size;
+    uint32_t node; //NUMA node to which this zone belongs
+    RamChunk* free_lists[RAM_BUDDY_ORDERS];
+    size_t free_blocks[RAM_BUDDY_ORDERS]; //Length of each free list
+    size_t ready_size; //Free memory beyond this offset has not been given to the buddy allocator yet
+
+    RamZone(const size_t zone_location = 0,
+            const size_t zone_size = 0,
+            const uint32_t zone_node = 0) : location(zone_location),
+                                            size(zone_size),
+                                            node(zone_node),
+                                            ready_size(zone_size) {
+        for(int order = 0; order < RAM_BUDDY_ORDERS; ++order) {
+            free_lists[order] = NULL;
+            free_blocks[order] = 0;
+        }
+    }
+    //Tells whether using a free block of some order to serve a request of a smaller order would
+    //eat into the reserves of large blocks
+    bool breaks_reserves(const int block_order, const int request_order) const;
+    //Amount of free memory which is made of blocks of at least some order
+    size_t free_memory(const int min_order = 0) const;
+    //Tells whether a block of memory fits entirely in this zone
+    bool contains(const size_t block_location, const size_t block_size) const {
+        if(block_location < location) return false;
+        return (block_location-location <= size) && (block_size <= size-(block_location-location));
+    }
+};
+
+//Contiguous allocations fail when free memory is too fragmented, even if there's plenty of it.
+//Memory compaction then moves used pages out of the way. The fragmentation index of a zone, for
+//some order, is the share of its free memory (in thousandths) which is made of smaller blocks.
+const int RAM_COMPACT_THRESHOLD = 500; //Zones are compacted at idle time above this index for
+                                      //2MB blocks
+const int RAM_COMPACT_RUNS = 64; //Maximal amount of windows compacted in a single idle period
+
+//Single pages of high memory are the most common allocation, so each CPU keeps a small stock of
+//them (a "magazine") which is refilled from and drained to the buddy allocator in batches. This
+//way, most single-page allocations do not need to grab the memory map's mutex.
+const int RAM_MAGAZINE_CPUS = 64; //CPUs beyond this number share magazines with other CPUs
+const int RAM_MAGAZINE_SIZE = 64; //Maximal amount of pages in a magazine
+const int RAM_MAGAZINE_BATCH = 32; //Amount of pages moved at once to or from the buddy allocator
+
+//Zeroed pages are requested for paging structures and fresh allocations. To keep zeroing out of
+//the critical path, a pool of pages is zeroed in advance when the CPU is idle.
+const size_t RAM_ZEROED_POOL = 256; //Amount of zeroed pages which the idle zeroer keeps ready
+const int RAM_ZEROED_BATCH = 16; //Amount of pages zeroed in a single run of the idle zeroer
+
+struct RamMagazine {
+    OwnerlessMutex mutex;
+    uint32_t node; //NUMA node of the CPU(s) using this magazine, where its pages come from
+    int length;
+    RamChunk* pages[RAM_MAGAZINE_SIZE]; //Free pages, the most recently freed one being on top
+    //Statistics, used to size magazines
+    uint64_t allocations; //Single-page allocations which went through this magazine...
+    uint64_t hits; //...and how many of them were served without refilling it
+    uint64_t refills; //Amount of times the magazine was refilled from the buddy allocator
+    uint64_t drains; //Amount of times the magazine was drained into the buddy allocator
+
+    RamMagazine() : node(0),
+                    length(0),
+                    allocations(0),
+                    hits(0),
+                    refills(0),
+                    drains(0) {}
+};
+
+//Record of a chunk which a process has allocated and still owns. Only chunks which are in use
+//have one, so the memory map items of free memory don't pay for this bookkeeping. Records are
+//managed by RamManager, which keeps spare ones chained using next_item.
+struct RamOwnedItem {
+    size_t location; //Location of the chunk, by which the record is indexed
+    RamChunk* chunk;
+    PID list_owner; //Process in whose tree of owned chunks this record is
+    bool shared; //Set once the chunk has been shared. Ownership of chunks which have never been
+                 //is protected by the mutex of the process which lists them (see RamManager).
+    AddressTreeNode<RamOwnedItem> tree_node;
+    RamOwnedItem* next_item;
+
+    RamOwnedItem() : location(0),
+                     chunk(NULL),
+                     list_owner(PID_INVALID),
+                     shared(false),
+                     tree_node(),
+                     next_item(NULL) {}
+};
+
+//This structure is used for the process management functionality of RamManager. So that a process
+//may be torn down quickly, and find its own chunks without looking at the memory map, the chunks
+//which it allocates are indexed by address for as long as it owns them. Chunks which are shared
+//with it are rarer, and only counted.
 struct RamManagerProcess {
     OwnerlessMutex mutex;
     PID identifier;
     size_t memory_usage;
     size_t memory_cap;
+    AddressTree<RamOwnedItem> owned_chunks; //Protected by "mutex"
+    size_t shared_chunks;
     RamManagerProcess* next_item;
 
     RamManagerProcess() : identifier(PID_INVALID),
                           memory_usage(0),
                           memory_cap(MAX_RAM_ADDRESS),
+                          owned_chunks(),
+                          shared_chunks(0),
                           next_item(NULL) {}
 };
 
@@ -28,6 +28,14 @@ extern const char* PANIC_MAXIMAL_SHARING_REACHED; //Someone has attempted to sha
 extern const char* PANIC_MM_UNINITIALIZED; //Someone called kalloc() and such with the force
                                            //switch on while they were not initialized yet
 extern const char* PANIC_OUT_OF_MEMORY; //MemAllocator runs out of memory
+extern const char* PANIC_MIGRATION_FAILED; //The page migrator could not map the copy of a page
+                                           //which memory compaction has moved
+extern const char* PANIC_NO_MM_STORAGE; //RamManager found no free region large enough to hold
+                                        //its memory map and bitmap
+extern const char* PANIC_NO_KERNEL_HALF; //PagingManager could not allocate the kernel half of
+                                         //address spaces
+extern const char* PANIC_NO_PHYSMAP; //PagingManager could not map physical memory, because RAM
+                                     //extends past PHYSMAP_SIZE or paging structures ran out
 
 void panic(const char* error_message);
 
@@ -32,6 +32,14 @@ const char* PANIC_MAXIMAL_SHARING_REACHED = "MemAllocator : Congratulations! You
 const char* PANIC_MM_UNINITIALIZED = "MemAllocator : Called memory management functions while \
 memory management itself was not initialized yet";
 const char* PANIC_OUT_OF_MEMORY = "MemAllocator : Out of memory";
+const char* PANIC_MIGRATION_FAILED = "RamManager : The page migrator failed to map a page which\
+ memory compaction has moved";
+const char* PANIC_NO_MM_STORAGE = "RamManager : No free region of high memory is large enough to\
+ hold memory management structures";
+const char* PANIC_NO_KERNEL_HALF = "PagingManager : Could not allocate the kernel half of address\
+ spaces";
+const char* PANIC_NO_PHYSMAP = "PagingManager : Could not map physical memory in the kernel half\
+ (is there more RAM than the physical map can hold ?)";
 
 void panic(const char* error_message) {
     dbgout << bkgcolor(BKG_PURPLE);